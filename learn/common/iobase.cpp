@@ -198,6 +198,29 @@ FNameID IOAux::grab_max_file(const char *dname, const char *fmt) noexcept {
   if (closedir(pd) < 0) die(ERR_CLL("closedir"));
   return ret; }
 
+void ArchIndex::to_bytes(char *p) const noexcept {
+  assert(p);
+  memset(p, 0, size);
+  int_to_bytes<int64_t>(no,       p);
+  int_to_bytes<int64_t>(offset,   p +  8);
+  int_to_bytes<int64_t>(wght,     p + 16);
+  int_to_bytes<uint>   (len_xz,   p + 24);
+  int_to_bytes<uint>   (len_csa,  p + 28);
+  int_to_bytes<ushort> (len_play, p + 32);
+  p[34] = static_cast<char>(type);
+  int_to_bytes<uint64_t>(digest, p + 40); }
+
+void ArchIndex::from_bytes(const char *p) noexcept {
+  assert(p);
+  no       = bytes_to_int<int64_t>(p);
+  offset   = bytes_to_int<int64_t>(p +  8);
+  wght     = bytes_to_int<int64_t>(p + 16);
+  len_xz   = bytes_to_int<uint>   (p + 24);
+  len_csa  = bytes_to_int<uint>   (p + 28);
+  len_play = bytes_to_int<ushort> (p + 32);
+  type     = static_cast<uchar>(p[34]);
+  digest   = bytes_to_int<uint64_t>(p + 40); }
+
 template <typename T> T IOAux::bytes_to_int(const char *p) noexcept {
   using value_t = typename std::make_unsigned<T>::type;
   assert(p);
@@ -212,6 +235,7 @@ template <typename T> T IOAux::bytes_to_int(const char *p) noexcept {
 template ushort IOAux::bytes_to_int(const char *p) noexcept;
 template uint IOAux::bytes_to_int(const char *p) noexcept;
 template int64_t IOAux::bytes_to_int(const char *p) noexcept;
+template uint64_t IOAux::bytes_to_int(const char *p) noexcept;
 
 template <typename T> void IOAux::int_to_bytes(const T &v, char *p) noexcept {
   using value_t = typename std::make_unsigned<T>::type;
@@ -226,3 +250,4 @@ template <typename T> void IOAux::int_to_bytes(const T &v, char *p) noexcept {
 template void IOAux::int_to_bytes(const ushort &v, char *p) noexcept;
 template void IOAux::int_to_bytes(const uint &v, char *p) noexcept;
 template void IOAux::int_to_bytes(const int64_t &v, char *p) noexcept;
+template void IOAux::int_to_bytes(const uint64_t &v, char *p) noexcept;
@@ -80,3 +80,27 @@ public:
 };
 
 bool operator<(const FNameID &fn1, const FNameID &fn2);
+
+// An entry of arch<no>.csa.idx, the index of arch<no>.csa.xz.  The archive
+// is a concatenation of xz streams, one for each record and one for each
+// "/\n" separator, so that it decodes to the records separated by "/\n"
+// as a whole, and a record decodes from its own stream alone.
+class ArchIndex {
+  using uint   = unsigned int;
+  using ushort = unsigned short;
+  using uchar  = unsigned char;
+
+public:
+  static constexpr size_t size = 48U;
+  int64_t no;       // record no.
+  int64_t offset;   // offset of the record's stream in the archive
+  int64_t wght;     // weight no., or -1
+  uint len_xz;      // size of the stream
+  uint len_csa;     // size of the record
+  ushort len_play;  // number of moves
+  uchar type;       // NodeType of the last node, black to move if even len_play
+  uint64_t digest;  // crc64 of the record from "PI" on, as in the log
+
+  void to_bytes(char *p) const noexcept;
+  void from_bytes(const char *p) noexcept;
+};
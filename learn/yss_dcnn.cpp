@@ -2507,6 +2507,56 @@ const int USE_XZ_BOTH      = 2;
 
 const int USE_XZ = USE_XZ_POOL_ONLY;	//  1...poolΤ xz ǡ2...poolarchive xz 
 
+// index(arch*.csa.idx  pool.csa.idx)Сδxzȥ꡼Ÿ롣
+// index̵ -1褬̵ 0 ֤
+static int find_kif_from_idx(const char *file_idx, const char *file_xz, int search_n)
+{
+	FILE *fp_idx = fopen(file_idx,"rb");
+	if ( fp_idx==NULL ) return -1;
+
+	// Ƭδֹ椫֤
+	char buf[ArchIndex::size];
+	ArchIndex index;
+	int ok = ( fread(buf, 1, sizeof(buf), fp_idx)==sizeof(buf) );
+	if ( ok ) {
+		index.from_bytes(buf);
+		ok = ( search_n >= index.no && fseek(fp_idx, (long)(search_n - index.no) * ArchIndex::size, SEEK_SET)==0 && fread(buf, 1, sizeof(buf), fp_idx)==sizeof(buf) );
+	}
+	fclose(fp_idx);
+	if ( ok==0 ) return 0;
+	index.from_bytes(buf);
+	if ( index.no != search_n ) { PRT("Err %s, no=%d,search_n=%d\n",file_idx,(int)index.no,search_n); return 0; }
+	if ( index.len_csa > KIF_BUF_MAX-256 ) DEBUG_PRT("Err one csa kif is too big\n");
+
+	const char *filename = file_xz;
+	FILE *fp_arch = fopen(filename,"rb");
+	if ( fp_arch==NULL ) { PRT("not found. %s\n",filename); return 0; }
+	unique_ptr<char []> xz(new char [index.len_xz]);
+	ok = ( fseeko(fp_arch, (off_t)index.offset, SEEK_SET)==0 && fread(xz.get(), 1, index.len_xz, fp_arch)==index.len_xz );
+	fclose(fp_arch);
+	if ( ok==0 ) { PRT("Err read %s\n",filename); return 0; }
+
+	PtrLen<const char> pl_in(xz.get(), index.len_xz);
+	PtrLen<char> pl_out(KifBuf, 0);
+	XZDecode<PtrLen<const char>, PtrLen<char>> xzd;
+	if ( !xzd.decode(&pl_in, &pl_out, KIF_BUF_MAX-256) ) { PRT("Err XZDecode %s\n",filename); return 0; }
+	KifBuf[pl_out.len] = 0;
+	nKifBufNum = 0;
+	nKifBufSize = strlen(KifBuf);
+	if ( nKifBufSize == 0 ) { PRT("Err size=0, search_n=%d\n",search_n); exit(0); }
+	return 1;
+}
+
+static int find_kif_from_archive_idx(const char *dir_arch, int arch_n, int search_n)
+{
+	char file_idx[TMP_BUF_LEN], file_xz[TMP_BUF_LEN];
+	sprintf(file_idx,"%sarch%012d.csa.idx",dir_arch,arch_n);
+	sprintf(file_xz, "%sarch%012d.csa.xz", dir_arch,arch_n);
+	int ret = find_kif_from_idx(file_idx, file_xz, search_n);
+	if ( ret==0 ) PRT("not found in %s\n",file_idx);
+	return ret;
+}
+
 // archiveֹ=n δФKifBuf[] 롣®̵롣fpǤ100ܰʹߤ٤̵
 int find_kif_from_archive(int search_n)
 {
@@ -2514,6 +2564,10 @@ int find_kif_from_archive(int search_n)
 //	char dir_arch[] = "/home/yss/tcp_backup/archive20190421/unpack/";
 	char dir_arch[] = "./archive/";
 	int arch_n = (search_n/10000) * 10000;	// 20001 -> 20000
+	if ( USE_XZ==USE_XZ_BOTH ) {	// index1ɤ
+		int ret = find_kif_from_archive_idx(dir_arch, arch_n, search_n);
+		if ( ret >= 0 ) return ret;
+	}
 
 	char filename[TMP_BUF_LEN];
 	if ( USE_XZ==USE_XZ_BOTH ) {
@@ -2619,6 +2673,11 @@ int find_kif_from_pool(int search_n)
 		unique_ptr<char []> ptr;
 		size_t size = read_xz_if_exist(filename, ptr);
 		if (!ptr) {
+			// Фϴ褴ȤΥե餺 pool.csa.xz ɵ
+			char file_idx[TMP_BUF_LEN], file_xz[TMP_BUF_LEN];
+			sprintf(file_idx,"%s/pool.csa.idx",dir_pool);
+			sprintf(file_xz, "%s/pool.csa.xz", dir_pool);
+			if ( find_kif_from_idx(file_idx, file_xz, search_n) > 0 ) return 1;
 //			PRT("not found. %s\n",filename);
 			return 0;
 		}
@@ -59,6 +59,7 @@ static void init() noexcept {
 			   {"DirLog",        "./log"},
 			   {"DirCSA",        "./csa"},
 			   {"Device",        "-1"},
+			   {"NGame",         "1"},
 			   {"SizeSendQueue", "64"},
 			   {"RecvTO",        "3"},
 			   {"SendTO",        "3"},
@@ -88,13 +89,14 @@ static void init() noexcept {
   uint print_csa      = Config::get<uint>  (m, "PrintCSA");
   uint keep_wght      = Config::get<uint>  (m, "KeepWeight");
   uint port           = Config::get<ushort>(m, "Port");
+  uint ngame          = Config::get<uint>  (m, "NGame",         is_posi);
   vector<int> devices = Config::getv<int>  (m, "Device");
 
   Client::get().start(cstr_dwght, cstr_addr, port, recvTO, recv_bufsiz, sendTO,
 		      send_bufsiz, max_retry, size_queue, keep_wght);
   OSI::handle_signal(on_signal);
   Pipe::get().start(cstr_cname, cstr_dlog, devices, cstr_csa, max_csa,
-		    print_csa, print_speed);
+		    print_csa, print_speed, ngame);
   cout << "self-play start" << endl; }
 
 int main() {
@@ -105,7 +105,8 @@ WghtFile::~WghtFile() noexcept {
   remove(_fname.get_fname());
   _all.erase(_fname); }
 
-static uint16_t receive_header(const OSI::Conn &conn, uint TO, uint bufsiz) {
+static uint16_t receive_header(const OSI::Conn &conn, uint TO, uint bufsiz,
+			       bool &accept_recpack) {
   char buf[8];
   conn.recv(buf, 8, TO, bufsiz);
   
@@ -114,16 +115,20 @@ static uint16_t receive_header(const OSI::Conn &conn, uint TO, uint bufsiz) {
   if (Major != Ver::major || Ver::minor < Minor)
     die(ERR_INT("Please update autousi!"));
   
+  accept_recpack = (static_cast<uchar>(buf[4]) & Ver::accept_recpack) != 0;
   return bytes_to_int<uint16_t>(buf + 2); }
 
-Client::Client() noexcept : _quit(false), _has_conn(false), _wght_id(-1),
+Client::Client() noexcept : _quit(false), _has_conn(false),
+			    _accept_recpack(false), _wght_id(-1),
 			    _ver_engine(-1) {}
 Client::~Client() noexcept {}
 
 void Client::get_new_wght() {
   // get new weight information
   OSI::Conn conn(_saddr.get(), _port);
-  _ver_engine = receive_header(conn, _recvTO, _recv_bufsiz);
+  bool accept_recpack;
+  _ver_engine = receive_header(conn, _recvTO, _recv_bufsiz, accept_recpack);
+  _accept_recpack = accept_recpack;
 
   char buf[BUFSIZ];
   static_assert(12 <= BUFSIZ, "BUSIZ too small");
@@ -262,15 +267,17 @@ void Client::reader() noexcept {
     cout << "connect again ..." << endl;
     do_retry = true; } }
 
+// A job holds the command byte followed by the compressed record.
 void Client::sender() noexcept {
   char buf[len_head];
-  buf[0] = 0;
 
   while (true) {
     Job *pJob = _pJQueue->pop();
     if (!pJob) break;
 
-    int_to_bytes<uint32_t>(static_cast<uint32_t>(pJob->get_len()), buf + 1);
+    buf[0] = pJob->get_p()[0];
+    int_to_bytes<uint32_t>(static_cast<uint32_t>(pJob->get_len() - 1U),
+			   buf + 1);
     uint retry_count = 0;
     uint sec         = snd_retry_interval;
     while (!_quit) {
@@ -281,9 +288,13 @@ void Client::sender() noexcept {
       
       try {
 	OSI::Conn conn(_saddr.get(), _port);
-	_ver_engine = receive_header(conn, _recvTO, _recv_bufsiz);
+	bool accept_recpack;
+	_ver_engine = receive_header(conn, _recvTO, _recv_bufsiz,
+				     accept_recpack);
+	_accept_recpack = accept_recpack;
 	conn.send(buf, len_head, _sendTO, _send_bufsiz);
-	conn.send(pJob->get_p(), pJob->get_len(), _sendTO, _send_bufsiz);
+	conn.send(pJob->get_p() + 1, pJob->get_len() - 1U, _sendTO,
+		  _send_bufsiz);
 	_has_conn = true;
 	pJob->reset();
 	sleep_for(milliseconds(snd_sleep));
@@ -343,9 +354,13 @@ void Client::end() noexcept {
   _thread_reader.join();
   _thread_sender.join(); }
 
-void Client::add_rec(const char *p, size_t len) noexcept {
+// Sends the binary form if the server has said it takes one, and the CSA
+// text otherwise.
+void Client::add_rec(const string &csa, const string &pack) noexcept {
+  bool bPack = _accept_recpack;
+  const string &rec = bPack ? pack : csa;
   XZEncode<PtrLen<const char>, PtrLen<char>> xze;
-  PtrLen<const char> pl_in(p, len);
+  PtrLen<const char> pl_in(rec.c_str(), rec.size());
   PtrLen<char> pl_out(_prec_xz.get(), 0);
   xze.start(&pl_out, maxlen_rec_xz, 9);
   if (!xze.append(&pl_in) || !xze.end() || UINT32_MAX < pl_out.len) {
@@ -353,8 +368,9 @@ void Client::add_rec(const char *p, size_t len) noexcept {
     return; }
   
   Job *pjob = _pJQueue->get_free();
-  pjob->reset(pl_out.len);
-  memcpy(pjob->get_p(), _prec_xz.get(), pl_out.len);
+  pjob->reset(pl_out.len + 1U);
+  pjob->get_p()[0] = bPack ? 3 : 0;
+  memcpy(pjob->get_p() + 1, _prec_xz.get(), pl_out.len);
   _pJQueue->push_free(); }
 
 shared_ptr<const WghtFile> Client::get_wght() noexcept {
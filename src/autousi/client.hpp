@@ -7,6 +7,7 @@
 #include <thread>
 #include <set>
 #include <memory>
+#include <string>
 #include <cstdint>
 
 class Job;
@@ -34,6 +35,7 @@ class Client {
   using uint = unsigned int;
   volatile std::atomic<bool> _quit;
   volatile std::atomic<bool> _has_conn;
+  volatile std::atomic<bool> _accept_recpack;
   int64_t _wght_id;
   std::unique_ptr<JQueue<Job>> _pJQueue;
   std::unique_ptr<char []> _prec_xz;
@@ -57,7 +59,7 @@ class Client {
   
 public:
   static Client & get() noexcept;
-  void add_rec(const char *p, size_t len) noexcept;
+  void add_rec(const std::string &csa, const std::string &pack) noexcept;
   void start(const char *dwght, const char *cstr_addr, uint port, uint recvTO,
 	     uint recv_bufsiz, uint sendTO, uint send_bufsiz, uint max_retry,
 	     uint size_queue, uint keep_wght) noexcept;
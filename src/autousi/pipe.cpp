@@ -8,6 +8,7 @@
 #include "iobase.hpp"
 #include "osi.hpp"
 #include "pipe.hpp"
+#include "recpack.hpp"
 #include "shogibase.hpp"
 #include "version.hpp"
 #include <chrono>
@@ -42,6 +43,7 @@ constexpr float speed_update_rate1 = 0.05f;
 constexpr float speed_update_rate2 = 0.005f;
 constexpr uint speed_th_1to2       = 100U;
 constexpr uint max_nchild          = 32;
+constexpr uint max_ngame           = 256;
 
 void write_record(const char *prec, size_t len,
 		  const char *dname, uint max_csa) noexcept;
@@ -52,21 +54,33 @@ constexpr char fmt_csa_scn[] = "rec%16[^.].csa";
 class NodeRec : public Node {
 public:
   string startpos, record;
+  RecPack pack;
   void clear() noexcept {
     Node::clear();
     record.clear();
+    pack.clear();
     startpos = string("position startpos moves"); } };
 
+// one of the games played by an engine. aobaz -g K plays K of them at once.
+class USIGame {
+public:
+  time_point<system_clock> time_last;
+  uint nmove;
+  bool idle;
+  NodeRec node; };
+
 class USIEngine : public OSI::Pipe {
   shared_ptr<const WghtFile> _wght;
   uint _id;
   int _device;
   
 public:
-  time_point<system_clock> time_last;
   float speed_average, speed_rate;
-  uint speed_nmove, nmove;
-  NodeRec node;
+  uint speed_nmove, ngame;
+  uint64_t crc64_loaded;
+  int eng_ver;
+  string eng_settings;
+  unique_ptr<USIGame []> games;
   FName flog;
   ofstream ofs;
 
@@ -153,10 +167,69 @@ static void engine_out(USIEngine &c, const char *fmt, ...) noexcept {
     if (errno == EPIPE) die(ERR_INT("engine no. %d terminates", c.get_id()));
     die(ERR_CLL("write")); } }
 
+// commands for game g are sent as "g <g> ..." when the engine plays more
+// than one game
+static const char *game_prefix(const USIEngine &c, uint g, char *buf)
+  noexcept {
+  assert(buf && g < c.ngame);
+  if (c.ngame == 1U) buf[0] = '\0';
+  else sprintf(buf, "g %u ", g);
+  return buf; }
+
+static void engine_go(USIEngine &c, uint g) noexcept {
+  char pre[16];
+  engine_out(c, "%s%s", game_prefix(c, g, pre),
+	     c.games[g].node.startpos.c_str());
+  engine_out(c, "%sgo visit", game_prefix(c, g, pre)); }
+
+static void game_start(USIEngine &c, uint g, uint print_csa) noexcept {
+  USIGame &game = c.games[g];
+  char buf[17], pre[16];
+  snprintf(buf, sizeof(buf), "%16" PRIx64, c.get_wght()->get_crc64());
+  game.nmove = 0;
+  game.idle  = false;
+  game.node.clear();
+  engine_out(c, "%susinewgame", game_prefix(c, g, pre));
+  engine_go(c, g);
+  game.time_last    = system_clock::now();
+  game.node.record  = string("'w ") + to_string(c.get_wght()->get_id());
+  game.node.record += string(" (crc64:") + string(buf);
+  game.node.record += string("), autousi ") + to_string(Ver::major);
+  game.node.record += string(".") + to_string(Ver::minor);
+  game.node.record += string(", usi-engine ") + to_string(c.eng_ver);
+  game.node.record += string("\n'") + c.eng_settings;
+  game.node.record += string("\n");
+  game.node.pack.start(game.node.record);
+  game.node.record += string("PI\n+\n");
+  if (c.get_id() == 0 && g == 0 && print_csa) cout << "PI +" << endl; }
+
+static bool is_all_idle(const USIEngine &c) noexcept {
+  for (uint g = 0; g < c.ngame; ++g) if (!c.games[g].idle) return false;
+  return true; }
+
+// new weights are loaded only after all games of the engine have finished,
+// so that each record is played by a single weight file
+static void engine_newgame(USIEngine &c, uint g, uint print_csa) noexcept {
+  c.games[g].idle = true;
+  c.update_wght();
+  if (c.get_wght()->get_crc64() == c.crc64_loaded) {
+    game_start(c, g, print_csa);
+    return; }
+  
+  if (!is_all_idle(c)) return;
+  engine_out(c, "setoption name WeightsFile value %s",
+	     c.get_wght()->get_fname());
+  c.crc64_loaded = c.get_wght()->get_crc64();
+
+  // the settings recorded in each header name the weight file, so ask again
+  engine_out(c, "usi");
+  if (read_id(c, c.eng_ver, c.eng_settings) < 0 || c.eng_settings.empty()) {
+    close_flush(c); die(ERR_INT("Bad usi command")); }
+  engine_out(c, "isready");
+  for (uint u = 0; u < c.ngame; ++u) game_start(c, u, print_csa); }
+
 static void engine_start(USIEngine &c, const FName &cname, uint print_csa)
   noexcept {
-  c.nmove = 0;
-  c.node.clear();
   c.update_wght();
 
   unique_ptr<char []> path(new char [cname.get_len_fname() + 1U]);
@@ -167,50 +240,37 @@ static void engine_start(USIEngine &c, const FName &cname, uint print_csa)
   char a4[] = "-n";
   char a5[] = "-m";  char a6[] = "30";
   char a7[] = "-w";
+  char a9[] = "-u";  char a10[16];
+  char a11[] = "-g"; char a12[16];
   memcpy(path.get(), cname.get_fname(), cname.get_len_fname() + 1U);
   memcpy(a0.get(), cname.get_fname(), cname.get_len_fname() + 1U);
   memcpy(a8.get(), c.get_wght()->get_fname(),
 	 c.get_wght()->get_len_fname() + 1U);
-  if (c.get_device() < 0) {
-    char *argv[] = { a0.get(), a1, a2, a3, a4, a5, a6, a7, a8.get(),
-		     nullptr };
-    c.open(path.get(), argv); }
-  else {
-    char a9[] = "-u";  char a10[16];
-    sprintf(a10, "%i", c.get_device());
-    char *argv[] = { a0.get(), a9, a10, a1, a2, a3, a4, a5, a6, a7,
-		     a8.get(), nullptr };
-    c.open(path.get(), argv); }
+  sprintf(a10, "%i", c.get_device());
+  sprintf(a12, "%u", c.ngame);
+  vector<char *> argv = { a0.get() };
+  if (0 <= c.get_device()) { argv.push_back(a9);  argv.push_back(a10); }
+  if (1U < c.ngame)        { argv.push_back(a11); argv.push_back(a12); }
+  for (char *a : { a1, a2, a3, a4, a5, a6, a7, a8.get() }) argv.push_back(a);
+  argv.push_back(nullptr);
+  c.open(path.get(), argv.data());
+  c.crc64_loaded = c.get_wght()->get_crc64();
   
   c.ofs.open(c.flog.get_fname(), ios::trunc);
   if (!c.ofs) die(ERR_INT("cannot write to log"));
   
-  int eng_ver;
-  string eng_settings;
   engine_out(c, "usi");
-  if (read_id(c, eng_ver, eng_settings) < 0) {
+  if (read_id(c, c.eng_ver, c.eng_settings) < 0) {
     close_flush(c); die(ERR_INT("Bad usi command")); }
-  if (eng_ver < 0) {
+  if (c.eng_ver < 0) {
     close_flush(c); die(ERR_INT("Bad version of usi engine")); }
-  if (eng_settings.empty()) {
+  if (c.eng_settings.empty()) {
     close_flush(c); die(ERR_INT("Bad settings of usi engine")); }
-  if (eng_ver < Client::get().get_ver_engine()) {
+  if (c.eng_ver < Client::get().get_ver_engine()) {
     close_flush(c); die(ERR_INT("Please update USI engine.")); }
 
-  char buf[17];
-  snprintf(buf, sizeof(buf), "%16" PRIx64, c.get_wght()->get_crc64());
   engine_out(c, "isready");
-  engine_out(c, "%s", c.node.startpos.c_str());
-  engine_out(c, "go visit");
-  c.time_last    = system_clock::now();
-  c.node.record  = string("'w ") + to_string(c.get_wght()->get_id());
-  c.node.record += string(" (crc64:") + string(buf);
-  c.node.record += string("), autousi ") + to_string(Ver::major);
-  c.node.record += string(".") + to_string(Ver::minor);
-  c.node.record += string(", usi-engine ") + to_string(eng_ver);
-  c.node.record += string("\n'") + eng_settings;
-  c.node.record	+= string("\nPI\n+\n");
-  if (c.get_id() == 0 && print_csa) cout << "PI +" << endl; }
+  for (uint g = 0; g < c.ngame; ++g) game_start(c, g, print_csa); }
 
 Pipe & Pipe::get() noexcept {
   static Pipe instance;
@@ -220,10 +280,12 @@ Pipe::Pipe() noexcept {}
 Pipe::~Pipe() noexcept {}
 void Pipe::start(const char *cname, const char *dlog,
 		 const vector<int> &devices,  const char *cstr_csa,
-		 uint max_csa, uint print_csa, uint print_speed) noexcept {
+		 uint max_csa, uint print_csa, uint print_speed, uint ngame)
+  noexcept {
   assert(cname && cstr_csa && dlog);
   if (devices.empty() || max_nchild < devices.size())
     die(ERR_INT("bad devices"));
+  if (ngame == 0 || max_ngame < ngame) die(ERR_INT("bad number of games"));
   _cname.reset_fname(cname);
   _dname_csa.reset_fname(cstr_csa);
   _nchild      = static_cast<uint>(devices.size());
@@ -238,11 +300,29 @@ void Pipe::start(const char *cname, const char *dlog,
     c.speed_rate    = speed_update_rate1;
     c.flog          = FName(dlog);
     c.flog.add_fmt_fname(fmt_log, u);
+    c.ngame         = ngame;
+    c.games.reset(new USIGame [ngame]);
     c.set_id(u);
     c.set_device(devices[u]); } }
 
-static bool play_update(char *line, USIEngine &c, uint print_csa) noexcept {
-  NodeRec &node = c.node;
+// removes "g <n> " that aobaz -g puts before the replies for the n-th game
+static char *strip_game(char *line, const USIEngine &c, uint &g) noexcept {
+  assert(line);
+  g = 0;
+  if (c.ngame == 1U) return line;
+  if (line[0] != 'g' || line[1] != ' ') return nullptr;
+
+  char *endptr;
+  long int l = strtol(line + 2, &endptr, 10);
+  if (endptr == line + 2 || *endptr != ' ' || l < 0 || c.ngame <= l)
+    return nullptr;
+  g = static_cast<uint>(l);
+  return endptr + 1; }
+
+static bool play_update(char *line, USIEngine &c, uint g, uint print_csa)
+  noexcept {
+  USIGame &game = c.games[g];
+  NodeRec &node = game.node;
   int id = c.get_id();
   assert(line && 0 <= id);
   
@@ -267,22 +347,22 @@ static bool play_update(char *line, USIEngine &c, uint print_csa) noexcept {
 
   if (actionPlay.is_move()) {
     time_point<system_clock> time_now = system_clock::now();
-    auto _f = duration_cast<milliseconds>(time_now - c.time_last).count();
-    float f = static_cast<float>(_f);
+    auto _f = duration_cast<milliseconds>(time_now - game.time_last).count();
+    float f = static_cast<float>(_f) / static_cast<float>(c.ngame);
     if (speed_th_1to2 < ++c.speed_nmove) c.speed_rate = speed_update_rate2;
     c.speed_average += c.speed_rate * (f - c.speed_average);
-    c.time_last = time_now;
+    game.time_last = time_now;
 
     node.startpos += " ";
     node.startpos += str_move_usi;
     node.record   += node.get_turn().to_str();
-    if (id == 0 && 0 < print_csa) {
+    if (id == 0 && g == 0 && 0 < print_csa) {
       cout << node.get_turn().to_str() << actionPlay.to_str(SAux::csa)
 	   << " (" << f << "ms)";
-      if ((c.nmove % print_csa) == print_csa - 1U) cout << "\n";
-      else                                         cout << " ";
+      if ((game.nmove % print_csa) == print_csa - 1U) cout << "\n";
+      else                                            cout << " ";
       cout.flush(); }
-    c.nmove     += 1U;
+    game.nmove  += 1U;
     node.record += actionPlay.to_str(SAux::csa);
     
     const char *str_count = OSI::strtok(nullptr, " ,", &saveptr);
@@ -300,6 +380,7 @@ static bool play_update(char *line, USIEngine &c, uint print_csa) noexcept {
     num_best = num;
     node.record += ",'";
     node.record += to_string(num);
+    node.pack.add_move(actionPlay, static_cast<uint>(num));
 
     // read candidate moves
     while (true) {
@@ -327,7 +408,8 @@ static bool play_update(char *line, USIEngine &c, uint print_csa) noexcept {
 
       node.record += ",";
       num_tot     += num;
-      node.record += to_string(num); } }
+      node.record += to_string(num);
+      node.pack.add_cand(action, static_cast<uint>(num)); } }
 
   if (num_best < num_tot) {
     close_flush(c);
@@ -363,29 +445,41 @@ void Pipe::wait() noexcept {
 	if (!c.ofs) die(ERR_INT("cannot write to log (engine no. %d)",
 				c.get_id()));
 	
-	if (play_update(line, c, _print_csa)) {
-	  if (c.node.get_type().is_term()) engine_out(c, "quit");
+	uint g;
+	char *body = strip_game(line, c, g);
+	if (body && play_update(body, c, g, _print_csa)) {
+	  NodeRec &node = c.games[g].node;
+	  if (!node.get_type().is_term()) engine_go(c, g);
 	  else {
-	    engine_out(c, "%s", c.node.startpos.c_str());
-	    engine_out(c, "go visit"); } } } }
+	    node.record += "%";
+	    node.record += node.get_type().to_str();
+	    node.record += "\n";
+	    if (c.get_id() == 0 && g == 0) {
+	      out_speed = true;
+	      if (_print_csa) cout << "%" << node.get_type().to_str() << endl; }
+	    
+	    node.pack.end(node.get_type());
+	    Client::get().add_rec(node.record, node.pack.get());
+	    write_record(node.record.c_str(), node.record.size(),
+			 _dname_csa.get_fname(), _max_csa);
+
+	    // keep the engine resident; it reloads weights only on a new crc64
+	    if (!has_conn) {
+	      c.games[g].idle = true;
+	      if (is_all_idle(c)) engine_out(c, "quit"); }
+	    else {
+	      if (g == 0) {
+		c.ofs.close();
+		c.ofs.open(c.flog.get_fname(), ios::trunc);
+		if (!c.ofs) die(ERR_INT("cannot write to log")); }
+	      engine_newgame(c, g, _print_csa); } } } } }
     
     if (eof) {
-      NodeType type = c.node.get_type();
-      if (!type.is_term()) {
+      for (uint g = 0; g < c.ngame; ++g) {
+	const USIGame &game = c.games[g];
+	if (game.idle || game.node.get_type().is_term()) continue;
 	close_flush(c);
 	die(ERR_INT("Engine no. %d terminates.", c.get_id())); }
-
-      assert(c.node.get_type().is_term());
-      c.node.record += "%";
-      c.node.record += c.node.get_type().to_str();
-      c.node.record += "\n";
-      if (c.get_id() == 0) {
-	out_speed = true;
-	if (_print_csa) cout << "%" << c.node.get_type().to_str() << endl; }
-	
-      Client::get().add_rec(c.node.record.c_str(), c.node.record.size());
-      write_record(c.node.record.c_str(), c.node.record.size(),
-		   _dname_csa.get_fname(), _max_csa);
       close_flush(c); } }
 
   if (out_speed && _print_speed) {
@@ -21,7 +21,8 @@ public:
 
   void start(const char *cname, const char *dlog,
 	     const std::vector<int> &devices, const char *cstr_csa,
-	     uint max_csa, uint print_csa, uint print_speed) noexcept;
+	     uint max_csa, uint print_csa, uint print_speed, uint ngame)
+    noexcept;
   void wait() noexcept;
   void end() noexcept;
 };
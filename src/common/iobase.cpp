@@ -134,12 +134,42 @@ bool IOAux::is_weight_ok(const char *fname, uint64_t &digest) noexcept {
   ifs.read(ptr.get(), len);
   return is_weight_ok(PtrLen<const char>(ptr.get(), len), digest); }
 
+// binary weights written by aobaz -save_bin. 64-byte header starting with
+// "AZWBIN1\n", payload length at 32 and payload crc64 at 40.
+constexpr char wght_bin_magic[]  = "AZWBIN1";
+constexpr size_t len_wght_bin_head = 64U;
+
+static bool is_weight_bin_ok(PtrLen<const char> plxz, uint64_t &digest)
+  noexcept {
+  XZDecode<PtrLen<const char>, DevNul> xzd_len;
+  PtrLen<const char> plxz_len(plxz);
+  DevNul devnul;
+  if (!xzd_len.decode(&plxz_len, &devnul, SIZE_MAX)) return false;
+  size_t len = xzd_len.get_len_out();
+  if (len < len_wght_bin_head) return false;
+
+  unique_ptr<char []> ptr(new char [len]);
+  PtrLen<char> pl(ptr.get(), 0);
+  XZDecode<PtrLen<const char>, PtrLen<char>> xzd;
+  if (!xzd.decode(&plxz, &pl, len)) return false;
+  
+  uint64_t len_payload = bytes_to_int<uint64_t>(ptr.get() + 32);
+  uint64_t crc64_head  = bytes_to_int<uint64_t>(ptr.get() + 40);
+  if (len_payload != len - len_wght_bin_head) return false;
+  if (XZAux::crc64(ptr.get() + len_wght_bin_head, len_payload, 0)
+      != crc64_head) return false;
+  
+  digest = xzd.get_crc64();
+  return true; }
+
 bool IOAux::is_weight_ok(PtrLen<const char> plxz, uint64_t &digest) noexcept {
   assert(plxz.ok());
   XZDecode<PtrLen<const char>, PtrLen<char>> xzd;
+  PtrLen<const char> plxz0(plxz);
   char token[256];
   PtrLen<char> pl(token,0);
   char *endptr;
+  bool is_first = true;
 
   xzd.init();
   while (true) {
@@ -151,6 +181,9 @@ bool IOAux::is_weight_ok(PtrLen<const char> plxz, uint64_t &digest) noexcept {
     assert(pl.len < sizeof(token));
     
     pl.p[pl.len] = '\0';
+    if (is_first && strcmp(token, wght_bin_magic) == 0)
+      return is_weight_bin_ok(plxz0, digest);
+    is_first = false;
     errno = 0;
     strtof(token, &endptr);
     if (*endptr != '\0' || endptr == token || errno == ERANGE) return false; }
@@ -186,6 +219,29 @@ FNameID IOAux::grab_max_file(const char *dname, const char *fmt) noexcept {
 
   return ret; }
 
+void ArchIndex::to_bytes(char *p) const noexcept {
+  assert(p);
+  memset(p, 0, size);
+  int_to_bytes<int64_t>(no,       p);
+  int_to_bytes<int64_t>(offset,   p +  8);
+  int_to_bytes<int64_t>(wght,     p + 16);
+  int_to_bytes<uint>   (len_xz,   p + 24);
+  int_to_bytes<uint>   (len_csa,  p + 28);
+  int_to_bytes<ushort> (len_play, p + 32);
+  p[34] = static_cast<char>(type);
+  int_to_bytes<uint64_t>(digest, p + 40); }
+
+void ArchIndex::from_bytes(const char *p) noexcept {
+  assert(p);
+  no       = bytes_to_int<int64_t>(p);
+  offset   = bytes_to_int<int64_t>(p +  8);
+  wght     = bytes_to_int<int64_t>(p + 16);
+  len_xz   = bytes_to_int<uint>   (p + 24);
+  len_csa  = bytes_to_int<uint>   (p + 28);
+  len_play = bytes_to_int<ushort> (p + 32);
+  type     = static_cast<uchar>(p[34]);
+  digest   = bytes_to_int<uint64_t>(p + 40); }
+
 template <typename T> T IOAux::bytes_to_int(const char *p) noexcept {
   using value_t = typename std::make_unsigned<T>::type;
   assert(p);
@@ -200,6 +256,7 @@ template <typename T> T IOAux::bytes_to_int(const char *p) noexcept {
 template ushort IOAux::bytes_to_int(const char *p) noexcept;
 template uint IOAux::bytes_to_int(const char *p) noexcept;
 template int64_t IOAux::bytes_to_int(const char *p) noexcept;
+template uint64_t IOAux::bytes_to_int(const char *p) noexcept;
 
 template <typename T> void IOAux::int_to_bytes(const T &v, char *p) noexcept {
   using value_t = typename std::make_unsigned<T>::type;
@@ -214,3 +271,4 @@ template <typename T> void IOAux::int_to_bytes(const T &v, char *p) noexcept {
 template void IOAux::int_to_bytes(const ushort &v, char *p) noexcept;
 template void IOAux::int_to_bytes(const uint &v, char *p) noexcept;
 template void IOAux::int_to_bytes(const int64_t &v, char *p) noexcept;
+template void IOAux::int_to_bytes(const uint64_t &v, char *p) noexcept;
@@ -0,0 +1,149 @@
+// 2019 Team AobaZero
+// This source code is in the public domain.
+#include "iobase.hpp"
+#include "recpack.hpp"
+#include "shogibase.hpp"
+#include <cassert>
+#include <cstring>
+using std::string;
+using std::to_string;
+using IOAux::bytes_to_int;
+using IOAux::int_to_bytes;
+using uchar  = unsigned char;
+using ushort = unsigned short;
+using uint   = unsigned int;
+
+constexpr char RecPack::magic[4];
+
+template <typename T> static void put(string &bin, const T &v) noexcept {
+  char buf[sizeof(T)];
+  int_to_bytes<T>(v, buf);
+  bin.append(buf, sizeof(T)); }
+
+template <typename T> static void put_at(string &bin, size_t pos, const T &v)
+  noexcept {
+  assert(pos + sizeof(T) <= bin.size());
+  int_to_bytes<T>(v, &bin[pos]); }
+
+// reads bytes in bounds
+class Reader {
+  const char *_p, *_end;
+public:
+  explicit Reader(const char *p, size_t len) noexcept : _p(p), _end(p + len) {}
+  bool ok(size_t len) const noexcept {
+    return len <= static_cast<size_t>(_end - _p); }
+  bool done() const noexcept { return _p == _end; }
+  template <typename T> bool get(T &v) noexcept {
+    if (!ok(sizeof(T))) return false;
+    v = bytes_to_int<T>(_p);
+    _p += sizeof(T);
+    return true; }
+  const char *skip(size_t len) noexcept {
+    if (!ok(len)) return nullptr;
+    const char *p = _p;
+    _p += len;
+    return p; }
+};
+
+void RecPack::start(const string &head) noexcept {
+  assert(head.size() <= UINT16_MAX);
+  _bin.clear();
+  _bin.append(magic, sizeof(magic));
+  put<ushort>(_bin, static_cast<ushort>(head.size()));
+  _bin += head;
+  put<ushort>(_bin, 0);
+  _nmove = _ncand = 0;
+  _pos_ncand = 0; }
+
+void RecPack::add_move(const Action &action, uint visits) noexcept {
+  if (0 < _nmove)
+    put_at<ushort>(_bin, _pos_ncand, static_cast<ushort>(_ncand));
+  put<ushort>(_bin, action.to_u16());
+  put<uint>(_bin, visits);
+  _pos_ncand = _bin.size();
+  put<ushort>(_bin, 0);
+  _nmove += 1U;
+  _ncand  = 0; }
+
+void RecPack::add_cand(const Action &action, uint visits) noexcept {
+  assert(0 < _nmove);
+  uint u = static_cast<uint>(action.to_u16()) << 16;
+  if (visits < 0xffffU) put<uint>(_bin, u | visits);
+  else {
+    put<uint>(_bin, u | 0xffffU);
+    put<uint>(_bin, visits); }
+  _ncand += 1U; }
+
+void RecPack::end(const NodeType &type) noexcept {
+  if (0 < _nmove)
+    put_at<ushort>(_bin, _pos_ncand, static_cast<ushort>(_ncand));
+  size_t pos_nmove = sizeof(magic) + 2U + bytes_to_int<ushort>(&_bin[4]);
+  put_at<ushort>(_bin, pos_nmove, static_cast<ushort>(_nmove));
+  _bin += static_cast<char>(type.to_u()); }
+
+bool RecPack::to_csa(const char *p, size_t len, string &csa, size_t &len_head,
+		     uint &len_play, uint &nchild) noexcept {
+  assert(p);
+  Reader rd(p, len);
+  const char *pmagic = rd.skip(sizeof(magic));
+  if (!pmagic || memcmp(pmagic, magic, sizeof(magic)) != 0) return false;
+
+  ushort len_comment, nmove;
+  if (!rd.get(len_comment)) return false;
+  const char *comment = rd.skip(len_comment);
+  if (!comment || memchr(comment, '\0', len_comment)) return false;
+  if (0 < len_comment && comment[len_comment - 1U] != '\n') return false;
+  if (!rd.get(nmove) || SAux::maxlen_path <= nmove) return false;
+
+  csa.assign(comment, len_comment);
+  len_head = csa.size();
+  csa += "PI\n+\n";
+  len_play = nchild = 0;
+
+  Node node;
+  for (uint u = 0; u < nmove; ++u) {
+    ushort umove, ncand;
+    uint visits;
+    if (!rd.get(umove) || !rd.get(visits) || !rd.get(ncand)) return false;
+    if (visits < 1U || INT32_MAX < visits) return false;
+    Action action = node.action_interpret(umove);
+    if (!action.is_move()) return false;
+
+    csa += node.get_turn().to_str();
+    csa += action.to_str(SAux::csa);
+    csa += ",'";
+    csa += to_string(visits);
+
+    for (uint v = 0; v < ncand; ++v) {
+      uint ucand, nvisit;
+      if (!rd.get(ucand)) return false;
+      nvisit = ucand & 0xffffU;
+      if (nvisit == 0xffffU && !rd.get(nvisit)) return false;
+      if (nvisit < 1U || INT32_MAX < nvisit) return false;
+      Action cand = node.action_interpret(static_cast<uint16_t>(ucand >> 16));
+      if (!cand.is_move()) return false;
+      csa += ",";
+      csa += cand.to_str(SAux::csa);
+      csa += ",";
+      csa += to_string(nvisit); }
+    csa += "\n";
+
+    nchild   += ncand;
+    len_play += 1U;
+    node.take_action(action);
+    if (node.is_nyugyoku()) node.take_action(SAux::windecl); }
+
+  const char *ptype = rd.skip(1U);
+  if (!ptype || !rd.done()) return false;
+  NodeType type(static_cast<uchar>(*ptype));
+  if (!type.is_term()) return false;
+  if (!node.get_type().is_term()) {
+    if      (type == SAux::resigned) node.take_action(SAux::resign);
+    else if (type == SAux::windclrd) node.take_action(SAux::windecl);
+    else return false; }
+  if (node.get_type() != type) return false;
+
+  csa += "%";
+  csa += type.to_str();
+  csa += "\n";
+  return true; }
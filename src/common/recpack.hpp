@@ -0,0 +1,44 @@
+// 2019 Team AobaZero
+// This source code is in the public domain.
+#pragma once
+#include <string>
+#include <cstddef>
+#include <cstdint>
+
+class Action;
+class NodeType;
+
+// Binary form of a game record. The comment lines before "PI" stay as
+// text, and the moves are packed as follows (little endian):
+//   char[4]  "AZR1"
+//   uint16   length of the comment lines
+//   char[]   the comment lines
+//   uint16   number of moves
+//   for each move
+//     uint16 move (see Action::to_u16())
+//     uint32 visit count of the move
+//     uint16 number of candidates
+//     uint32 (move << 16) | visits for each candidate, followed by another
+//            uint32 of the visits if they do not fit in 16 bits
+//   uint8    NodeType of the last node
+class RecPack {
+  using uint = unsigned int;
+  std::string _bin;
+  size_t _pos_ncand;
+  uint _nmove, _ncand;
+
+public:
+  static constexpr char magic[4] = { 'A', 'Z', 'R', '1' };
+  void clear() noexcept { _bin.clear(); }
+  void start(const std::string &head) noexcept;
+  void add_move(const Action &action, uint visits) noexcept;
+  void add_cand(const Action &action, uint visits) noexcept;
+  void end(const NodeType &type) noexcept;
+  const std::string &get() const noexcept { return _bin; }
+
+  // Replays a binary record and writes it out as CSA text, in the same
+  // form that autousi writes. Returns false if it is broken or illegal.
+  static bool to_csa(const char *p, size_t len, std::string &csa,
+		     size_t &len_head, uint &len_play, uint &nchild)
+    noexcept;
+};
@@ -118,6 +118,15 @@ FixLStr<7U> Action::to_str(SAux::Mode mode) const noexcept {
 	if (_type == promotion) str += "+"; } } }
   return str; }
 
+// bit 0-6: to, bit 7-13: from, or 81 + piece for a drop, bit 14: promotion
+uint16_t Action::to_u16() const noexcept {
+  assert(is_move());
+  uint u = _to.to_u();
+  if (_type == drop) u |= (Sq::ok_size + _pc.to_u()) << 7;
+  else               u |= _from.to_u() << 7;
+  if (_type == promotion) u |= 0x4000U;
+  return static_cast<uint16_t>(u); }
+
 bool Action::ok() const noexcept {
   if (is_notmove()) {
     if (_from.ok() || _to.ok() || _pc.ok() || _cap.ok()) return false; }
@@ -642,3 +651,26 @@ Action Node::action_interpret(const char *cstr, SAux::Mode mode) noexcept {
 
   if (!_board.action_ok_full(_turn, action)) return Action();
   return action; }
+
+Action Node::action_interpret(uint16_t u) noexcept {
+  assert(ok());
+  if (_type.is_term()) return Action();
+  uint uto   = u & 0x7fU;
+  uint ufrom = (u >> 7) & 0x7fU;
+  if (Sq::ok_size <= uto || (u & 0x8000U)) return Action();
+  
+  Action action;
+  Sq to(uto);
+  if (Sq::ok_size <= ufrom) {
+    if (Sq::ok_size + Pc::hand_size <= ufrom || (u & 0x4000U))
+      return Action();
+    action = Action(to, Pc(ufrom - Sq::ok_size)); }
+  else {
+    Sq from(ufrom);
+    Pc pc  = _board.get_pc(from);
+    Pc cap = _board.get_pc(to);
+    action = Action(from, to, pc, cap,
+		    (u & 0x4000U) ? Action::promotion : Action::normal); }
+  
+  if (!_board.action_ok_full(_turn, action)) return Action();
+  return action; }
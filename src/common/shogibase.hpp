@@ -410,6 +410,7 @@ public:
   bool ok() const noexcept;
 
   FixLStr<7U> to_str(SAux::Mode mode = SAux::csa) const noexcept;
+  uint16_t to_u16() const noexcept;
 };
 
 namespace SAux {
@@ -536,5 +537,6 @@ public:
   void take_action(const Action &a) noexcept;
   Action action_interpret(const char *cstr,
 			  SAux::Mode mode = SAux::csa) noexcept;
+  Action action_interpret(uint16_t u) noexcept;
   FixLStr<512U> to_str() const noexcept { return _board.to_str(_turn); }
 };
@@ -4,4 +4,6 @@ namespace Ver {
   constexpr unsigned char major = 1;
   constexpr unsigned char minor = 1;
   constexpr unsigned short usi_engin = 5;
+  // bits of the fifth byte of the server's greeting
+  constexpr unsigned char accept_recpack = 0x01U;
 }
@@ -38,6 +38,63 @@ uint64_t XZAux::crc64(const char *p, uint64_t crc64) noexcept {
   assert(p);
   return lzma_crc64(reinterpret_cast<const uint8_t *>(p), strlen(p), crc64); }
 
+uint32_t XZAux::nthreads(uint32_t nmax) noexcept {
+  uint32_t n = lzma_cputhreads();
+  if (n == 0) n = 1U;
+  return min(n, nmax); }
+
+// Multi-threaded streams are cut into independent blocks of 3 * dict_size
+// bytes.  The dictionary is capped so that each worker needs about 165 MiB
+// at level 9 (674 MiB uncapped), and the block sizes written in the headers
+// let the decoder below run the blocks in parallel as well.
+static lzma_ret encoder_mt(lzma_stream *strm, uint32_t level,
+			   uint32_t threads) noexcept {
+  constexpr uint32_t maxlen_dict = 8U * 1024U * 1024U;
+  lzma_options_lzma opt;
+  if (lzma_lzma_preset(&opt, level)) return LZMA_OPTIONS_ERROR;
+  opt.dict_size = min(opt.dict_size, maxlen_dict);
+  
+  lzma_filter filters[2] = { { LZMA_FILTER_LZMA2, &opt },
+			     { LZMA_VLI_UNKNOWN, nullptr } };
+  lzma_mt mt;
+  memset(&mt, 0, sizeof(mt));
+  mt.threads    = threads;
+  mt.block_size = 3U * static_cast<uint64_t>(opt.dict_size);
+  mt.filters    = filters;
+  mt.check      = LZMA_CHECK_CRC64;
+  return lzma_stream_encoder_mt(strm, &mt); }
+
+// An input shorter than the dictionary gains nothing from it, and the
+// 64 MiB dictionary of level 9 costs more to set up than a game record
+// does to compress.
+static lzma_ret encoder_fit(lzma_stream *strm, uint32_t level,
+			    uint64_t len_in) noexcept {
+  lzma_options_lzma opt;
+  if (lzma_lzma_preset(&opt, level)) return LZMA_OPTIONS_ERROR;
+  uint64_t len = std::max<uint64_t>(len_in, LZMA_DICT_SIZE_MIN);
+  opt.dict_size = static_cast<uint32_t>(min<uint64_t>(opt.dict_size, len));
+  
+  lzma_filter filters[2] = { { LZMA_FILTER_LZMA2, &opt },
+			     { LZMA_VLI_UNKNOWN, nullptr } };
+  return lzma_stream_encoder(strm, filters, LZMA_CHECK_CRC64); }
+
+// lzma_stream_decoder_mt() is available from liblzma 5.4.0 on.  Older
+// libraries (e.g. win/include) decode on the calling thread.
+static lzma_ret decoder_mt(lzma_stream *strm, uint32_t threads) noexcept {
+#if 50040002 <= LZMA_VERSION
+  if (1U < threads) {
+    lzma_mt mt;
+    memset(&mt, 0, sizeof(mt));
+    mt.flags              = LZMA_CONCATENATED;
+    mt.threads            = threads;
+    mt.memlimit_threading = UINT64_MAX;
+    mt.memlimit_stop      = UINT64_MAX;
+    return lzma_stream_decoder_mt(strm, &mt); }
+#else
+  (void)threads;
+#endif
+  return lzma_stream_decoder(strm, UINT64_MAX, LZMA_CONCATENATED); }
+
 /*
 void XZBase::xzwrite(int *fd, size_t len) const noexcept {
   ssize_t ret = write(*fd, _outbuf, len);
@@ -97,14 +154,21 @@ bool XZEncode<T_IN, T_OUT>::encode(const lzma_action &a, lzma_ret &ret)
 
 template <typename T_IN, typename T_OUT>
 void XZEncode<T_IN, T_OUT>::start(T_OUT *out, size_t maxlen_out_tot,
-				  uint32_t level, bool bExt) noexcept {
+				  uint32_t level, bool bExt, uint32_t threads,
+				  uint64_t len_in) noexcept {
   assert(out);
   assert(0 <= level && level <= 9);
+  assert(0 < threads);
   
   if (bExt) level |= LZMA_PRESET_EXTREME;
   
   const char *msg;
-  switch (lzma_easy_encoder(&_strm, level, LZMA_CHECK_CRC64)) {
+  lzma_ret ret;
+  if (1U < threads)    ret = encoder_mt(&_strm, level, threads);
+  else if (0 < len_in) ret = encoder_fit(&_strm, level, len_in);
+  else ret = lzma_easy_encoder(&_strm, level, LZMA_CHECK_CRC64);
+  
+  switch (ret) {
   case LZMA_OK:
     _out            = out;
     _len_out_tot    = 0;
@@ -155,7 +219,7 @@ void XZDecode<T_IN, T_OUT>::init() noexcept {
   
   _len_out_tot = 0;
   _crc64       = 0;
-  switch (lzma_stream_decoder(&_strm, UINT64_MAX, LZMA_CONCATENATED)) {
+  switch (decoder_mt(&_strm, _threads)) {
   case LZMA_OK:
     _strm.next_in   = _inbuf;
     _strm.avail_in  = 0;
@@ -319,3 +383,4 @@ template class XZDecode<ifstream, ofstream>;
 template class XZDecode<ifstream, PtrLen<char>>;
 // template class XZDecode<int, PtrLen<char>>;
 template class XZDecode<ifstream, DevNul>;
+template class XZDecode<PtrLen<const char>, DevNul>;
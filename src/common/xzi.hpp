@@ -13,6 +13,7 @@ namespace XZAux {
   uint64_t crc64(const FName & fname) noexcept;
   uint64_t crc64(const char *p, uint64_t crc64) noexcept;
   uint64_t crc64(const char *p, size_t len, uint64_t crc64) noexcept;
+  uint32_t nthreads(uint32_t nmax) noexcept;
 }
 
 class DevNul {};
@@ -61,8 +62,11 @@ class XZEncode : private XZBase {
 public:
   explicit XZEncode() noexcept : _strm(LZMA_STREAM_INIT) {}
   ~XZEncode() noexcept { lzma_end(&_strm); }
+  // len_in is the length of the whole input if known, and bounds the
+  // dictionary of a single-threaded stream.
   void start(T_OUT *out, size_t _maxlen_out_tot, uint32_t level,
-	     bool bExt = false) noexcept;
+	     bool bExt = false, uint32_t threads = 1U,
+	     uint64_t len_in = 0) noexcept;
   bool append(T_IN *in) noexcept;
   bool end() noexcept;
   
@@ -74,9 +78,11 @@ class XZDecode : private XZBase {
   lzma_stream _strm;
   size_t _len_out_tot;
   uint64_t _crc64;
+  uint32_t _threads;
   
 public:
-  explicit XZDecode() noexcept : _strm(LZMA_STREAM_INIT) {}
+  explicit XZDecode(uint32_t threads = 1U) noexcept
+    : _strm(LZMA_STREAM_INIT), _threads(threads) {}
   ~XZDecode() noexcept { lzma_end(&_strm); }
   void init() noexcept;
   bool decode(T_IN *in, T_OUT *out, size_t size_limit) noexcept;
@@ -1,12 +1,16 @@
 // 2019 Team AobaZero
 // This source code is in the public domain.
 #include "err.hpp"
+#include "iobase.hpp"
 #include "osi.hpp"
 #include "xzi.hpp"
 #include <fstream>
 #include <iostream>
 #include <string>
+#include <vector>
 #include <cassert>
+#include <cinttypes>
+#include <cstdlib>
 #include <cstring>
 #include <unistd.h>
 #include <sys/types.h>
@@ -15,13 +19,27 @@ using std::ifstream;
 using std::ofstream;
 using std::ios;
 using std::string;
+using std::vector;
 using ErrAux::die;
 using uint = unsigned int;
-static void extract(const char *fname) noexcept;
+static bool extract_idx(const char *fname, int64_t no) noexcept;
+static void extract(const char *fname, int64_t no) noexcept;
 constexpr char ftmp[] = "tmp.csa.x_";
 
+// extract [-n no] archive ...
+// writes no<no>.csa.xz of the records in the archives, or only of record
+// no. if -n is given.
 int main(int argc, char **argv) {
+  int64_t no = -1;
   while (*++argv) {
+    if (strcmp(*argv, "-n") == 0) {
+      if (!*++argv) die(ERR_INT("no number after -n"));
+      char *endptr;
+      no = strtoll(*argv, &endptr, 10);
+      if (endptr == *argv || *endptr != '\0' || no < 0)
+	die(ERR_INT("bad number %s", *argv));
+      continue; }
+    
     struct stat sb;
     if (stat(*argv, &sb) < 0) die(ERR_CLL("stat() failed"));
     if ((sb.st_mode & S_IFMT) != S_IFREG) {
@@ -29,21 +47,70 @@ int main(int argc, char **argv) {
       argv += 1;
       continue; }
 
-    extract(*argv); }
+    if (!extract_idx(*argv, no)) extract(*argv, no); }
   return 0; }
 
-static void extract(const char *fname) noexcept {
+// Copies the records' own xz streams out of an archive that has an index
+// (see ArchIndex), so that a record costs no more than its own size.
+static bool extract_idx(const char *fname, int64_t no) noexcept {
   assert(fname);
+  size_t len = strlen(fname);
+  if (len < 3U || strcmp(fname + len - 3U, ".xz") != 0) return false;
+  
+  string str_fidx(fname, len - 3U);
+  str_fidx += ".idx";
+  ifstream ifs_idx(str_fidx, ios::binary);
+  if (!ifs_idx) return false;
+  
   ifstream ifs(fname, ios::binary);
   if (!ifs) die(ERR_INT("cannot read %s", fname));
+
+  char buf[ArchIndex::size];
+  ArchIndex index;
+  if (0 <= no) {
+    if (!ifs_idx.read(buf, sizeof(buf))) die(ERR_INT("bad index %s",
+						     str_fidx.c_str()));
+    index.from_bytes(buf);
+    if (no < index.no) ifs_idx.seekg(0, ios::end);
+    else ifs_idx.seekg((no - index.no) * ArchIndex::size); }
+
+  uint nplay = 0;
+  vector<char> xz;
+  while (ifs_idx.read(buf, sizeof(buf))) {
+    index.from_bytes(buf);
+    if (0 <= no && index.no != no) break;
+
+    xz.resize(index.len_xz);
+    ifs.seekg(index.offset);
+    if (!ifs.read(xz.data(), xz.size())) die(ERR_INT("bad archive %s", fname));
+
+    char fout[64];
+    snprintf(fout, sizeof(fout), "no%012" PRIi64 ".csa.xz", index.no);
+    std::cout << fout << " " << index.len_csa << std::endl;
+    ofstream ofs(ftmp, ios::binary | ios::trunc);
+    ofs.write(xz.data(), xz.size());
+    ofs.close();
+    if (!ofs) die(ERR_INT("cannot write to %s", ftmp));
+    if (rename(ftmp, fout) < 0) die(ERR_CLL("rename"));
+    nplay += 1U;
+    if (0 <= no) break; }
   
-  XZDecode<ifstream, PtrLen<char>> xzd;
+  std::cout << "Play: " << nplay << std::endl;
+  return true; }
+
+static void extract(const char *fname, int64_t no) noexcept {
+  assert(fname);
+  ifstream ifs(fname, ios::binary);
+  if (!ifs) die(ERR_INT("cannot read %s", fname));
+  
+  XZDecode<ifstream, PtrLen<char>> xzd(XZAux::nthreads(8U));
   xzd.init();
 
   uint nline_tot = 0;
   uint nline     = 0;
   uint nplay     = 0;
   bool eof       = false;
+  int64_t no_rec = -1;
   string str_rec, str_fname;
 
   do {
@@ -59,7 +126,10 @@ static void extract(const char *fname) noexcept {
     if (sizeof(line) <= pl_line.len) die(ERR_INT("line too long"));
     line[pl_line.len] = '\0';
 
-    if (line[0] == '/' || eof) {
+    if ((line[0] == '/' || eof) && 0 <= no && no_rec != no) {
+      str_rec = string("");
+      nline   = 0; }
+    else if (line[0] == '/' || eof) {
       std::cout << str_fname  << " " << nline << std::endl;
       ofstream ofs(ftmp, ios::binary | ios::trunc);
       XZEncode<PtrLen<const char>, ofstream> xze;
@@ -83,7 +153,8 @@ static void extract(const char *fname) noexcept {
 	char *token = OSI::strtok(line, "' ", &saveptr);
 	if (strlen(token) != 14U) die(ERR_INT("bad record number"));
 	str_fname = string(token);
-	str_fname += ".csa.xz"; } }
+	str_fname += ".csa.xz";
+	no_rec = strtoll(token + 2, nullptr, 10); } }
   } while (!eof);
   
   std::cout << "Line: " << nline_tot << std::endl;
@@ -4,13 +4,16 @@
 #include "jqueue.hpp"
 #include "logging.hpp"
 #include "datakeep.hpp"
+#include "recpack.hpp"
 #include "shogibase.hpp"
 #include "hashtbl.hpp"
 #include <chrono>
+#include <iterator>
 #include <climits>
 #include <cstring>
 #include <fcntl.h>
 #include <unistd.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 using std::ios;
 using std::ifstream;
@@ -18,9 +21,16 @@ using std::lock_guard;
 using std::make_shared;
 using std::map;
 using std::max;
+using std::min;
+using std::move;
+using std::mutex;
+using std::unique_lock;
+using std::unique_ptr;
 using std::shared_ptr;
+using std::string;
 using std::set;
 using std::thread;
+using std::vector;
 using std::this_thread::sleep_for;
 using std::chrono::seconds;
 using ErrAux::die;
@@ -28,16 +38,49 @@ using namespace IOAux;
 using namespace Log;
 
 constexpr uint64_t size_cluster  = 10000U;
+constexpr unsigned int maxrec_sync = 64U;
 constexpr char fname_wght_list[] = "weight_list.cfg";
 constexpr char fname_tmp[]       = "tmp.csa.x_";
+constexpr char fname_pool[]      = "pool.csa.xz";
+constexpr char fname_pool_idx[]  = "pool.csa.idx";
+constexpr char fname_bloom[]     = "redundancy.bloom";
+constexpr char bloom_magic[4]    = { 'A', 'Z', 'B', 'F' };
 constexpr char fmt_arch[]        = "arch%012" PRIi64 ".csa.xz";
+constexpr char fmt_idx[]         = "arch%012" PRIi64 ".csa.idx";
 constexpr char fmt_pool[]        = "no%012" PRIi64 ".csa.xz";
 constexpr char fmt_wght_scn[]    = "w%16[^.].txt.xz";
 constexpr char fmt_pool_scn[]    = "no%16[^.].csa.xz";
+constexpr char fmt_arch_scn[]    = "arch%16[^.].csa.xz";
+constexpr char fmt_idx_scn[]     = "arch%16[^.].csa.idx";
 const PtrLen<const char> pl_CSAsepa("/\n", 2);
 
+// checks "'w <no> (crc64:<digest>)..." against the weights
+static bool is_wght_ok(char *line, int64_t &wght) noexcept {
+  assert(line);
+  char *saveptr_token, *endptr, *token;
+  uint64_t digest1, digest2;
+  int64_t no;
+  
+  if (line[0] != '\'' || line[1] != 'w') return false;
+  token = strtok_r(line+ 2, " ", &saveptr_token);
+  no = strtoll(token, &endptr, 10);
+  if (endptr == token || *endptr != '\0' || no < 0 || no == LLONG_MAX)
+    return false;
+  wght = no;
+  
+  token = strtok_r(nullptr, "(:", &saveptr_token);
+  token = strtok_r(nullptr, ")", &saveptr_token);
+  errno = 0;
+  digest1 = strtoull(token, &endptr, 16);
+  if (endptr == token || *endptr != '\0' || errno == ERANGE)
+    die(ERR_INT("bad crc64 %s", token));
+  
+  if (!WghtKeep::get().get_crc64(no, digest2)) return false;
+  return digest1 == digest2; }
+
 static bool is_record_ok(const char *rec, size_t len_rec, uint64_t &digest,
-			 uint &len_play, float &ave_child) noexcept {
+			 uint &len_play, float &ave_child, int64_t &wght,
+			 uint &type) noexcept {
   assert(rec);
   constexpr char newline[] = "\n";
   char buf[len_rec + 1U];
@@ -46,28 +89,11 @@ static bool is_record_ok(const char *rec, size_t len_rec, uint64_t &digest,
     
   len_play  = 0;
   ave_child = 0.0f;
+  wght      = -1;
+  type      = NodeType().to_u();
   strcpy(buf, rec);
   line = strtok_r(buf, "\n", &saveptr_line);
-  if (line[0] != '\'' || line[1] != 'w') return false;
-  else {
-    char *saveptr_token, *endptr, *token;
-    uint64_t digest1, digest2;
-    int64_t no;
-    
-    token = strtok_r(line+ 2, " ", &saveptr_token);
-    no = strtoll(token, &endptr, 10);
-    if (endptr == token || *endptr != '\0' || no < 0 || no == LLONG_MAX)
-      return false;
-  
-    token = strtok_r(nullptr, "(:", &saveptr_token);
-    token = strtok_r(nullptr, ")", &saveptr_token);
-    errno = 0;
-    digest1 = strtoull(token, &endptr, 16);
-    if (endptr == token || *endptr != '\0' || errno == ERANGE)
-      die(ERR_INT("bad crc64 %s", token));
-
-    if (!WghtKeep::get().get_crc64(no, digest2)) return false;
-    if (digest1 != digest2) return false; }
+  if (!is_wght_ok(line, wght)) return false;
   
   line = strtok_r(nullptr, "\n", &saveptr_line);
   if (line[0] != '\'') return false;
@@ -130,19 +156,221 @@ static bool is_record_ok(const char *rec, size_t len_rec, uint64_t &digest,
     len_play += 1U;
     node.take_action(action); }
   
+  type = node.get_type().to_u();
   if (!node.get_type().is_term()) return false;
   ave_child = (float)tot_nchild / (float)len_play;
   return true; }
 
-static void write_pooltemp(const FName &fxz, PtrLen<const char> pl) noexcept {
+// computes the same digest as is_record_ok() does, without checking the
+// record, i.e., the crc64 of the lines from "PI" on
+static bool rec_digest(const char *rec, size_t len, uint64_t &digest)
+  noexcept {
+  assert(rec);
+  const char *p = strstr(rec, "\nPI\n");
+  if (!p) return false;
+  p += 1;
+  digest = XZAux::crc64(p, len - (p - rec), 0);
+  return true; }
+
+// A binary record (see RecPack) is replayed into the CSA text that autousi
+// would have sent, which spares parsing the text.
+static bool is_pack_ok(const char *p, size_t len, string &csa, uint64_t &digest,
+		       uint &len_play, float &ave_child, int64_t &wght,
+		       uint &type) noexcept {
+  size_t len_head;
+  uint nchild;
+  wght = -1;
+  if (!RecPack::to_csa(p, len, csa, len_head, len_play, nchild))
+    return false;
+  
+  // the comment lines are the two that autousi writes
+  string head(csa, 0, len_head);
+  char *saveptr;
+  char *line = strtok_r(&head[0], "\n", &saveptr);
+  if (!line || !is_wght_ok(line, wght)) return false;
+  line = strtok_r(nullptr, "\n", &saveptr);
+  if (!line || line[0] != '\'' || strtok_r(nullptr, "\n", &saveptr))
+    return false;
+  
+  digest    = XZAux::crc64(csa.data() + len_head, csa.size() - len_head, 0);
+  type      = static_cast<unsigned char>(p[len - 1U]);
+  ave_child = (len_play == 0) ? 0.0f : (float)nchild / (float)len_play;
+  return true; }
+
+// A record is compressed once into a stream of its own, which serves both
+// as the pool file and as the record's part of the archive.
+static void encode_rec(PtrLen<const char> pl, vector<char> &xz) noexcept {
   assert(pl.ok());
-  ofstream ofs(fxz.get_fname(), ios::binary | ios::trunc);
-  XZEncode<PtrLen<const char>, ofstream> xze;
-  xze.start(&ofs, SIZE_MAX, 9);
-  xze.append(&pl);
-  xze.end();
+  xz.resize(lzma_stream_buffer_bound(pl.len));
+  PtrLen<char> plxz(xz.data(), 0);
+  XZEncode<PtrLen<const char>, PtrLen<char>> xze;
+  xze.start(&plxz, xz.size(), 9, false, 1U, pl.len);
+  if (!xze.append(&pl) || !xze.end()) die(ERR_INT("XZEncode::encode()"));
+  xz.resize(plxz.len); }
+
+static const vector<char> &xz_CSAsepa() noexcept {
+  static const vector<char> xz = []{
+    vector<char> v;
+    encode_rec(pl_CSAsepa, v);
+    return v; }();
+  return xz; }
+
+static void write_all(int fd, const char *p, size_t len) noexcept {
+  while (0 < len) {
+    ssize_t ret = write(fd, p, len);
+    if (ret < 0 && errno == EINTR) continue;
+    if (ret < 0) die(ERR_CLL("write"));
+    p   += ret;
+    len -= ret; } }
+
+// moves a file by rename(), or by a copy through ftmp if the directories
+// are on different file systems
+static void move_file(const FName &from, const FName &to, const FName &ftmp)
+  noexcept {
+  if (rename(from.get_fname(), to.get_fname()) == 0) return;
+  if (errno != EXDEV) die(ERR_CLL("rename"));
+  
+  ifstream ifs(from.get_fname(), ios::binary);
+  ofstream ofs(ftmp.get_fname(), ios::binary | ios::trunc);
+  ofs << ifs.rdbuf();
   ofs.close();
-  if (!ofs) die(ERR_INT("cannot write to %s", fxz.get_fname())); }
+  if (!ifs || !ofs) die(ERR_INT("cannot copy %s to %s", from.get_fname(),
+				ftmp.get_fname()));
+  
+  int fd = ::open(ftmp.get_fname(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) die(ERR_CLL("open"));
+  if (fsync(fd) < 0) die(ERR_CLL("fsync"));
+  if (::close(fd) < 0) die(ERR_CLL("close"));
+  if (rename(ftmp.get_fname(), to.get_fname()) < 0) die(ERR_CLL("rename"));
+  if (remove(from.get_fname()) < 0) die(ERR_CLL("remove")); }
+
+void ArchWriter::open(const FName &fxz, const FName &fidx, int64_t len,
+		      uint nrec) noexcept {
+  assert(_fd_xz < 0 && _fd_idx < 0 && 0 <= len);
+  _fxz    = fxz;
+  _fidx   = fidx;
+  _len    = len;
+  _nrec   = nrec;
+  _fd_xz  = ::open(_fxz.get_fname(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+  if (_fd_xz < 0) die(ERR_CLL("open"));
+  _fd_idx = ::open(_fidx.get_fname(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+  if (_fd_idx < 0) die(ERR_CLL("open"));
+  
+  if (ftruncate(_fd_xz, len) < 0
+      || ftruncate(_fd_idx, static_cast<off_t>(nrec) * ArchIndex::size) < 0)
+    die(ERR_CLL("ftruncate"));
+  if (lseek(_fd_xz, 0, SEEK_END) < 0 || lseek(_fd_idx, 0, SEEK_END) < 0)
+    die(ERR_CLL("lseek")); }
+
+void ArchWriter::append(PtrLen<const char> plxz, ArchIndex &index) noexcept {
+  assert(0 <= _fd_xz && plxz.ok());
+  if (0 < _nrec) {
+    const vector<char> &sepa = xz_CSAsepa();
+    write_all(_fd_xz, sepa.data(), sepa.size());
+    _len += sepa.size(); }
+  
+  index.offset = _len;
+  index.len_xz = static_cast<uint>(plxz.len);
+  write_all(_fd_xz, plxz.p, plxz.len);
+  _len  += plxz.len;
+  _nrec += 1U;
+
+  char buf[ArchIndex::size];
+  index.to_bytes(buf);
+  write_all(_fd_idx, buf, sizeof(buf)); }
+
+void ArchWriter::sync() noexcept {
+  assert(0 <= _fd_xz);
+  if (fdatasync(_fd_xz) < 0 || fdatasync(_fd_idx) < 0)
+    die(ERR_CLL("fdatasync")); }
+
+void ArchWriter::close() noexcept {
+  if (_fd_xz < 0) return;
+  sync();
+  if (::close(_fd_xz) < 0 || ::close(_fd_idx) < 0) die(ERR_CLL("close"));
+  _fd_xz = _fd_idx = -1; }
+
+// The filter has nbit_rec bits per expected record, rounded up to a power
+// of two. A digest sets nbit of them, so that less than 0.5% of the tests
+// hit wrongly while the filter holds up to nrec records.
+void BloomFilter::open(const FName &fname, uint64_t nrec) noexcept {
+  static_assert(sizeof(std::atomic<uint64_t>) == sizeof(uint64_t),
+		"std::atomic<uint64_t> must be a bare word");
+  uint log2_nbit = 12U;
+  while (log2_nbit < 48U && (UINT64_C(1) << log2_nbit) < nrec * nbit_rec)
+    log2_nbit += 1U;
+  assert(6U * nbit <= 64U);
+  _log2_nword = log2_nbit - 6U;
+  _len = len_head + (static_cast<size_t>(1U) << _log2_nword) * 8U;
+  _fd  = ::open(fname.get_fname(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (_fd < 0) die(ERR_CLL("open"));
+
+  // make it anew unless the file is of the same shape
+  struct stat sb;
+  char head[len_head];
+  if (fstat(_fd, &sb) < 0) die(ERR_CLL("fstat"));
+  bool bNew = (static_cast<size_t>(sb.st_size) != _len
+	       || pread(_fd, head, len_head, 0) != len_head
+	       || memcmp(head, bloom_magic, sizeof(bloom_magic)) != 0
+	       || bytes_to_int<uint>(head + 4) != log2_nbit);
+  if (bNew && (ftruncate(_fd, 0) < 0 || ftruncate(_fd, _len) < 0))
+    die(ERR_CLL("ftruncate"));
+
+  void *p = mmap(nullptr, _len, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0);
+  if (p == MAP_FAILED) die(ERR_CLL("mmap"));
+  _p     = static_cast<char *>(p);
+  _words = reinterpret_cast<std::atomic<uint64_t> *>(_p + len_head);
+  if (bNew) {
+    memcpy(_p, bloom_magic, sizeof(bloom_magic));
+    int_to_bytes<uint>(log2_nbit, _p + 4);
+    set_id_end(0); } }
+
+void BloomFilter::close() noexcept {
+  if (_p) {
+    if (msync(_p, _len, MS_SYNC) < 0) die(ERR_CLL("msync"));
+    if (munmap(_p, _len) < 0) die(ERR_CLL("munmap"));
+    _p = nullptr; }
+  if (0 <= _fd) {
+    if (::close(_fd) < 0) die(ERR_CLL("close"));
+    _fd = -1; } }
+
+// returns true if the digest might have been added before
+bool BloomFilter::test_and_add(uint64_t digest) noexcept {
+  assert(_p);
+  uint64_t index = (digest * UINT64_C(0x9e3779b97f4a7c15)) >> (64U
+							     - _log2_nword);
+  uint64_t mask  = 0;
+  for (uint u = 0; u < nbit; ++u)
+    mask |= UINT64_C(1) << ((digest >> (6U * u)) & 63U);
+  uint64_t old = _words[index].fetch_or(mask, std::memory_order_relaxed);
+  return (old & mask) == mask; }
+
+int64_t BloomFilter::get_id_end() const noexcept {
+  assert(_p);
+  return bytes_to_int<int64_t>(_p + 8); }
+
+// the bits reach the disk first, then the header
+void BloomFilter::set_id_end(int64_t id) noexcept {
+  assert(_p);
+  if (msync(_p, _len, MS_SYNC) < 0) die(ERR_CLL("msync"));
+  int_to_bytes<int64_t>(id, _p + 8);
+  if (msync(_p, len_head, MS_SYNC) < 0) die(ERR_CLL("msync")); }
+
+Wght::Wght(int64_t no, const char *fname) noexcept : _no(no) {
+  _fd = open(fname, O_RDONLY | O_CLOEXEC);
+  if (_fd < 0) die(ERR_CLL("open"));
+  struct stat sb;
+  if (fstat(_fd, &sb) < 0) die(ERR_CLL("fstat"));
+  if (sb.st_size == 0) die(ERR_INT("empty weight file %s", fname));
+  
+  _len = sb.st_size;
+  void *p = mmap(nullptr, _len, PROT_READ, MAP_SHARED, _fd, 0);
+  if (p == MAP_FAILED) die(ERR_CLL("mmap"));
+  _p = static_cast<const char *>(p); }
+
+Wght::~Wght() noexcept {
+  munmap(const_cast<char *>(_p), _len);
+  close(_fd); }
 
 bool WghtKeep::get_crc64(int64_t no, uint64_t &digest) const noexcept {
   auto it = _map_wght.find(no);
@@ -155,15 +383,8 @@ void WghtKeep::get_new_wght() noexcept {
   grab_files(no, _dwght.get_fname(), fmt_wght_scn, _i64_now + 1);
   
   for (auto it = no.rbegin(); it != no.rend(); ++it) {
-    int fd = open(it->get_fname(), O_RDONLY);
-    if (fd < 0) die(ERR_CLL("open"));
-    struct stat sb;
-    if (fstat(fd, &sb) < 0) die(ERR_CLL("fstat"));
-
-    shared_ptr<Wght> pw = make_shared<Wght>(it->get_id(), sb.st_size);
-    PtrLen<char> pl = pw->ptrlen();
-    if (sb.st_size != read(fd, pl.p, pl.len)) die(ERR_CLL("read"));
-    close(fd);
+    shared_ptr<Wght> pw = make_shared<Wght>(it->get_id(), it->get_fname());
+    PtrLen<const char> pl = pw->ptrlen();
     uint64_t digest;
     if (! is_weight_ok(pl, digest)) continue;
     
@@ -237,33 +458,18 @@ void WghtKeep::end() noexcept {
   _bEndWorker = true;
   _thread.join(); }
 
-void RecKeep::close_arch_tmp() noexcept {
-  _xze.end();
-  _ofs_arch_tmp.close();
-  if (!_ofs_arch_tmp) die(ERR_INT("cannot write to %s",
-				  _farch_tmp.get_fname())); }
-
 RecKeep::RecKeep() noexcept {}
 RecKeep::~RecKeep() noexcept {}
 
-void RecKeep::open_arch_tmp() noexcept {
-  _ofs_arch_tmp.open(_farch_tmp.get_fname(), ios::binary | ios::trunc);
-  if (!_ofs_arch_tmp) die(ERR_INT("cannot write to %s",
-				  _farch_tmp.get_fname()));
-  _xze.start(&_ofs_arch_tmp, SIZE_MAX, 9);
-  _bFirst = true; }
-
 RecKeep & RecKeep::get() noexcept {
   static RecKeep instance;
   return instance; }
 
 void RecKeep::start(Logger *logger, const char *darch, const char *dpool,
 		    uint maxlen_job, size_t maxlen_rec, size_t maxlen_recv,
-		    uint log2_nindex_redun, uint minlen_play,
-		    uint minave_child) noexcept {
+		    uint log2_nindex_redun, uint64_t nrec_bloom,
+		    uint minlen_play, uint minave_child) noexcept {
   assert(logger && darch && dpool);
-  int64_t i64, i64_start, i64_end;
-
   _pJQueue.reset(new JQueue<JobIP>(maxlen_job));
   _prec.reset(new char [maxlen_rec]);
   _redundancy_table.reset(log2_nindex_redun, 2U << log2_nindex_redun);
@@ -276,204 +482,634 @@ void RecKeep::start(Logger *logger, const char *darch, const char *dpool,
   _darch        = FName(darch);
   _dpool        = FName(dpool);
   _farch_tmp    = FName(darch, fname_tmp);
-  _fpool_tmp    = FName(dpool, fname_tmp);
-  _thread       = thread(&RecKeep::worker, this);
-  open_arch_tmp();
+  _fpool        = FName(dpool, fname_pool);
+  _fpool_idx    = FName(dpool, fname_pool_idx);
+  _maxlen_job   = maxlen_job;
+  _bloom.open(FName(darch, fname_bloom), nrec_bloom);
+  scan_archives(_bloom.get_id_end());
+  recover_pool();
+  recover_pool_files();
+  _bloom.set_id_end(_id_pool);
+
+  _bEndIngest = false;
+  _seq_next   = _seq_commit = _seq_done = 0;
+  _id_next    = _id_arch = _id_pool + _pool.get_nrec();
+  uint nthread = max(2U, min(8U, thread::hardware_concurrency()));
+  for (uint u = 0; u < nthread; ++u)
+    _threads_ingest.emplace_back(&RecKeep::ingest, this);
+  _thread_commit = thread(&RecKeep::commit, this);
+  _thread_arch   = thread(&RecKeep::archive, this);
+  _thread        = thread(&RecKeep::worker, this); }
+
+// Adds the records of the archives from id_end on to the bloom filter.
+// This reads all the archives when the filter is made anew.
+void RecKeep::scan_archives(int64_t id_end) noexcept {
+  set<FNameID> archs;
+  grab_files(archs, _darch.get_fname(), fmt_arch_scn, id_end);
+  if (archs.empty()) return;
+  
+  vector<const FNameID *> list;
+  for (const FNameID &f : archs) list.push_back(&f);
+  std::atomic<size_t> index(0);
+  std::atomic<uint64_t> nrec(0);
+  auto scan = [&]{
+    string rec;
+    unique_ptr<char []> line(new char [65536]);
+    for (size_t u = index++; u < list.size(); u = index++) {
+      const char *fname = list[u]->get_fname();
+      ifstream ifs(fname, ios::binary);
+      if (!ifs) die(ERR_INT("cannot read %s", fname));
+      XZDecode<ifstream, PtrLen<char>> xzd;
+      xzd.init();
+      
+      bool eof = false;
+      rec.clear();
+      do {
+	PtrLen<char> pl_line(line.get(), 0);
+	if (!xzd.getline(&ifs, &pl_line, 65535U, "\n"))
+	  die(ERR_INT("bad archive %s", fname));
+	if (pl_line.len == 0) eof = true;
+	line[pl_line.len] = '\0';
+	
+	if (line[0] != '/' && !eof) {
+	  rec += line.get();
+	  rec += "\n";
+	  continue; }
+	
+	uint64_t digest;
+	if (rec_digest(rec.c_str(), rec.size(), digest)) {
+	  _bloom.test_and_add(digest);
+	  nrec += 1U; }
+	rec.clear();
+      } while (!eof); } };
+  
+  vector<thread> threads;
+  uint nthread = max(1U, min(8U, thread::hardware_concurrency()));
+  for (uint u = 0; u < nthread; ++u) threads.emplace_back(scan);
+  for (auto &t : threads) t.join();
+  _logger->out(nullptr, "%" PRIu64 " records of %zu archives added to %s",
+	       nrec.load(), list.size(), fname_bloom); }
+
+// registers a record found at start in the bloom filter and the table
+void RecKeep::add_redun(int64_t id, uint64_t digest) noexcept {
+  _bloom.test_and_add(digest);
+  RedunValue & redun_value = _redundancy_table[Key64(digest)];
+  if (redun_value.count++ == 0) redun_value.no = static_cast<uint64_t>(id); }
+
+// Looks for a digest in the indexes of the pool and of the archives, the
+// newest first, to confirm a hit of the bloom filter. The pool goes
+// before the list of the archives is taken, so that a pool that moves to
+// the archives meanwhile is read either way. This reads all the indexes
+// for a wrong hit, which is less than 0.5% of the records.
+bool RecKeep::find_digest(uint64_t digest, int64_t &id) const noexcept {
+  auto find = [&](const char *fname) {
+    ifstream ifs(fname, ios::binary);
+    char buf[ArchIndex::size];
+    ArchIndex index;
+    while (ifs.read(buf, sizeof(buf))) {
+      index.from_bytes(buf);
+      if (index.digest == digest) { id = index.no; return true; } }
+    return false; };
+  
+  if (find(_fpool_idx.get_fname())) return true;
+  set<FNameID> idxs;
+  grab_files(idxs, _darch.get_fname(), fmt_idx_scn, 0);
+  for (auto it = idxs.rbegin(); it != idxs.rend(); ++it)
+    if (find(it->get_fname())) return true;
+  return false; }
+
+// Reads the pool up to the last record that reached the disk whole, along
+// its index. This returns false if the index is missing, or if one of its
+// entries does not match the pool. A partial entry at the end is what a
+// crash leaves, and the index is still trusted then.
+bool RecKeep::read_pool(int64_t &len, uint &nrec,
+			vector<std::pair<int64_t, uint64_t>> &digests)
+  noexcept {
+  ifstream ifs(_fpool.get_fname(), ios::binary);
+  ifstream ifs_idx(_fpool_idx.get_fname(), ios::binary);
+  len      = 0;
+  nrec     = 0;
+  _id_pool = -1;
+  digests.clear();
+  if (!ifs_idx) return false;
+  
+  const vector<char> &sepa = xz_CSAsepa();
+  XZDecode<PtrLen<const char>, PtrLen<char>> xzd;
+  vector<char> xz;
+  char buf[ArchIndex::size];
+  while (ifs_idx.read(buf, sizeof(buf))) {
+    ArchIndex index;
+    index.from_bytes(buf);
+    if (nrec == 0) _id_pool = index.no;
+    int64_t offset = (nrec == 0) ? 0 : len + sepa.size();
+    if (index.no != _id_pool + nrec || index.offset != offset) return false;
+    
+    // the separator and the record
+    xz.resize(offset - len + index.len_xz);
+    if (!ifs.seekg(len) || !ifs.read(xz.data(), xz.size())) return false;
+    if (0 < nrec && memcmp(xz.data(), sepa.data(), sepa.size()) != 0)
+      return false;
+    PtrLen<const char> pl_in(xz.data() + (offset - len), index.len_xz);
+    PtrLen<char> pl_rec(_prec.get(), 0);
+    if (!xzd.decode(&pl_in, &pl_rec, _maxlen_rec - 1U)) return false;
+    pl_rec.p[pl_rec.len] = '\0';
+    
+    uint64_t digest;
+    if (rec_digest(pl_rec.p, pl_rec.len, digest))
+      digests.emplace_back(index.no, digest);
+    len   = offset + index.len_xz;
+    nrec += 1U; }
+  return true; }
+
+// Makes the index of the pool anew from its streams. The streams are read
+// up to the first one that does not decode, and the ids are taken from the
+// first lines "'no<id> <date>" of the records.
+void RecKeep::rebuild_pool_idx() noexcept {
+  ifstream ifs(_fpool.get_fname(), ios::binary);
+  if (!ifs) die(ERR_INT("cannot read from %s", _fpool.get_fname()));
+  vector<char> xz((std::istreambuf_iterator<char>(ifs)),
+		  std::istreambuf_iterator<char>());
+  ifs.close();
+  
+  int fd = open(_fpool_idx.get_fname(),
+		O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) die(ERR_CLL("open"));
+  
+  const vector<char> &sepa = xz_CSAsepa();
+  const uint8_t *pxz = reinterpret_cast<const uint8_t *>(xz.data());
+  uint8_t *prec      = reinterpret_cast<uint8_t *>(_prec.get());
+  size_t pos  = 0;
+  uint nrec   = 0;
+  int64_t id0 = 0;
+  while (pos < xz.size()) {
+    if (0 < nrec) {
+      if (xz.size() - pos < sepa.size()
+	  || memcmp(xz.data() + pos, sepa.data(), sepa.size()) != 0) break;
+      pos += sepa.size(); }
+    
+    // a stream alone, as lzma_stream_buffer_decode() stops at its end
+    uint64_t memlimit = UINT64_MAX;
+    size_t pos_end = pos, len_rec = 0;
+    if (lzma_stream_buffer_decode(&memlimit, 0, nullptr, pxz, &pos_end,
+				  xz.size(), prec, &len_rec,
+				  _maxlen_rec - 1U) != LZMA_OK) break;
+    _prec[len_rec] = '\0';
+    
+    char *endptr;
+    const char *rec = _prec.get();
+    if (strncmp(rec, "'no", 3) != 0) break;
+    int64_t id = strtoll(rec + 3, &endptr, 10);
+    if (endptr == rec + 3 || *endptr != ' ') break;
+    if (nrec == 0) id0 = id;
+    if (id != id0 + nrec) break;
+    rec = strchr(rec, '\n');
+    if (!rec) break;
+    rec += 1;
+    
+    ArchIndex index;
+    uint64_t digest;
+    uint len_play, type;
+    float ave_child;
+    is_record_ok(rec, len_rec - (rec - _prec.get()), digest, len_play,
+		 ave_child, index.wght, type);
+    index.no       = id;
+    index.offset   = pos;
+    index.len_xz   = static_cast<uint>(pos_end - pos);
+    index.len_csa  = static_cast<uint>(len_rec);
+    index.len_play = static_cast<unsigned short>(min(len_play, 65535U));
+    index.type     = static_cast<unsigned char>(type);
+    index.digest   = digest;
+    
+    char buf[ArchIndex::size];
+    index.to_bytes(buf);
+    write_all(fd, buf, sizeof(buf));
+    pos   = pos_end;
+    nrec += 1U; }
+  
+  if (fdatasync(fd) < 0 || close(fd) < 0) die(ERR_CLL("fdatasync"));
+  _logger->out(nullptr, "index of %u records rebuilt from %s", nrec,
+	       _fpool.get_fname()); }
+
+// Keeps the records of the pool that reached the disk whole, and cuts what
+// a crash left after them. The pool is never cut by an index that does not
+// match it; such an index is made anew from the pool first. The ids go on
+// from the last archive if the pool is empty.
+void RecKeep::recover_pool() noexcept {
+  ifstream ifs(_fpool.get_fname(), ios::binary);
+  ifstream ifs_idx(_fpool_idx.get_fname(), ios::binary);
+  char buf[ArchIndex::size];
+  
+  // finish moving a full pool to the archives, see archive_pool()
+  if (!ifs && ifs_idx && ifs_idx.read(buf, sizeof(buf))) {
+    ArchIndex index;
+    index.from_bytes(buf);
+    FName fidx(_darch);
+    fidx.add_fmt_fname(fmt_idx, index.no);
+    ifs_idx.close();
+    move_file(_fpool_idx, fidx, _farch_tmp); }
+  
+  int64_t len = 0;
+  uint nrec   = 0;
+  _id_pool    = -1;
+  if (ifs) {
+    ifs.close();
+    vector<std::pair<int64_t, uint64_t>> digests;
+    if (!read_pool(len, nrec, digests)) {
+      _logger->out(nullptr, "%s is missing or does not match %s",
+		   _fpool_idx.get_fname(), _fpool.get_fname());
+      rebuild_pool_idx();
+      if (!read_pool(len, nrec, digests))
+	die(ERR_INT("cannot rebuild %s", _fpool_idx.get_fname())); }
+    for (const auto &d : digests) add_redun(d.first, d.second); }
+  
+  if (nrec == 0) {
+    FNameID farch = grab_max_file(_darch.get_fname(), fmt_arch_scn);
+    _id_pool = (farch.get_id() < 0) ? 0 : farch.get_id() + size_cluster; }
+  _pool.open(_fpool, _fpool_idx, len, nrec);
+  if (0 < nrec) _logger->out(nullptr, "%u records recovered from %s", nrec,
+			     _fpool.get_fname()); }
+
+// Takes over the pool of older servers, a file for a record, by moving the
+// full clusters to the archives and the rest to the pool.
+void RecKeep::recover_pool_files() noexcept {
+  const char *dpool = _dpool.get_fname();
+  set<FNameID> files;
+  int64_t i64, i64_start, i64_end;
 
   // grab files in the pool
-  grab_files(_pool, dpool, fmt_pool_scn, 0);
-  if (_pool.empty()) return;
+  grab_files(files, dpool, fmt_pool_scn, 0);
+  if (files.empty()) return;
+  if (0 < _pool.get_nrec())
+    die(ERR_INT("both %s and record files in %s", fname_pool, dpool));
   
   // check sequence of file no.
-  i64 = _pool.begin()->get_id();
-  for (auto it = _pool.begin(); it != _pool.end(); ++it, ++i64)
+  i64 = files.begin()->get_id();
+  for (auto it = files.begin(); it != files.end(); ++it, ++i64)
     if (i64 != it->get_id()) die(ERR_INT("invalid files in %s", dpool));
   
   // remove reminders
-  i64_start = _pool.begin()->get_id();
+  i64_start = files.begin()->get_id();
   if ((i64_start % size_cluster) != 0) {
     i64_end  = i64_start / size_cluster;
     i64_end += INT64_C(1);
     i64_end *= size_cluster;
-    if (i64_end <= _pool.rbegin()->get_id())
-      for (auto it = _pool.begin();
-	   it != _pool.end() && it->get_id() < i64_end; it = _pool.erase(it))
+    if (i64_end <= files.rbegin()->get_id())
+      for (auto it = files.begin();
+	   it != files.end() && it->get_id() < i64_end; it = files.erase(it))
 	if (remove(it->get_fname()) < 0) die(ERR_CLL("remove")); }
-  if (_pool.empty()) return;
+  if (files.empty()) return;
   
   // archive clusters
-  XZDecode<ifstream, PtrLen<char>> xzd_pool;
-  PtrLen<const char> pl_in;
   while (true) {
-    assert(!_pool.empty());
-    i64_start = _pool.begin()->get_id();
+    assert(!files.empty());
+    i64_start = files.begin()->get_id();
     i64_end   = i64_start + size_cluster;
-    if (_pool.rbegin()->get_id() < i64_end) break;
+    if (files.rbegin()->get_id() < i64_end) break;
     
-    FName farch(_darch);
+    FName farch(_darch), fidx(_darch);
     farch.add_fmt_fname(fmt_arch, i64_start);
-    ofstream ofs(farch.get_fname(), ios::binary | ios::trunc);
-    bool flag_first = true;
-    
-    _xze.start(&ofs, SIZE_MAX, 9);
-    for (i64 = i64_start; i64 < i64_end; ++i64) {
-      if (flag_first) flag_first = false;
-      else {
-	pl_in = pl_CSAsepa;
-	_xze.append(&pl_in); }
-      
-      FName fpool(_dpool);
-      fpool.add_fmt_fname(fmt_pool, i64);
-      ifstream ifs(fpool.get_fname(), ios::binary);
-      if (!ifs) die(ERR_INT("cannot read from %s", fpool.get_fname()));
-
-      PtrLen<char> pl_rec(_prec.get(), 0);
-      if (!xzd_pool.decode(&ifs, &pl_rec, maxlen_rec - 1U))
-	die(ERR_INT("XZDecode::decode()"));
-
-      ifs.close();
-      pl_in = pl_rec;
-      _xze.append(&pl_in); }
-    
-    _xze.end();
-    ofs.close();
-    if (!ofs) die(ERR_INT("cannot write to %s", farch.get_fname()));
+    fidx.add_fmt_fname(fmt_idx, i64_start);
+    ArchWriter arch;
+    arch.open(farch, fidx);
+    for (i64 = i64_start; i64 < i64_end; ++i64) append_pool_file(arch, i64);
+    arch.close();
 
-    for (auto it = _pool.begin(); it->get_id() < i64_end; it = _pool.erase(it))
-      if (remove(it->get_fname()) < 0) ERR_CLL("remove"); }
+    for (auto it = files.begin(); it->get_id() < i64_end; it = files.erase(it))
+      if (remove(it->get_fname()) < 0) die(ERR_CLL("remove")); }
 
-  // write to arch's temp file
-  i64_start = _pool.begin()->get_id();
-  i64_end   = _pool.rbegin()->get_id() + INT64_C(1);
-  assert((i64_start % size_cluster) == 0);
-  assert(i64_end < i64_start + static_cast<int64_t>(size_cluster));
+  // move the rest to the pool
+  _id_pool = files.begin()->get_id();
+  assert((_id_pool % size_cluster) == 0);
+  for (const FNameID &f : files) append_pool_file(_pool, f.get_id());
+  _pool.sync();
+  for (const FNameID &f : files)
+    if (remove(f.get_fname()) < 0) die(ERR_CLL("remove")); }
+
+// Appends a pool file to an archive as it is, and reads the record only
+// for the index.
+void RecKeep::append_pool_file(ArchWriter &arch, int64_t id) noexcept {
+  FName fpool(_dpool);
+  fpool.add_fmt_fname(fmt_pool, id);
+  ifstream ifs(fpool.get_fname(), ios::binary);
+  if (!ifs) die(ERR_INT("cannot read from %s", fpool.get_fname()));
+  vector<char> xz((std::istreambuf_iterator<char>(ifs)),
+		  std::istreambuf_iterator<char>());
+  ifs.close();
   
-  for (i64 = i64_start; i64 < i64_end; ++i64) {
-    if (_bFirst) _bFirst = false;
-    else {
-      pl_in = pl_CSAsepa;
-      _xze.append(&pl_in); }
-    
-    FName fpool(_dpool);
-    fpool.add_fmt_fname(fmt_pool, i64);
-    ifstream ifs(fpool.get_fname(), ios::binary);
-    if (!ifs) die(ERR_INT("cannot read from %s", fpool.get_fname()));
-    
-    PtrLen<char> pl_rec(_prec.get(), 0);
-    if (!xzd_pool.decode(&ifs, &pl_rec, maxlen_rec - 1U))
-      die(ERR_INT("XZDecode::decode()"));
-    ifs.close();
-    
-    pl_in = pl_rec;
-    _xze.append(&pl_in);
-    if (!_ofs_arch_tmp)
-      die(ERR_INT("cannot write to %s", _farch_tmp.get_fname())); } }
+  XZDecode<PtrLen<const char>, PtrLen<char>> xzd;
+  PtrLen<const char> pl_in(xz.data(), xz.size());
+  PtrLen<char> pl_rec(_prec.get(), 0);
+  if (!xzd.decode(&pl_in, &pl_rec, _maxlen_rec - 1U))
+    die(ERR_INT("XZDecode::decode()"));
+  pl_rec.p[pl_rec.len] = '\0';
+  
+  // skip "'no<id> <date>\n"
+  const char *rec = strchr(pl_rec.p, '\n');
+  if (!rec) die(ERR_INT("bad record %s", fpool.get_fname()));
+  rec += 1;
+
+  ArchIndex index;
+  uint64_t digest;
+  uint len_play, type;
+  float ave_child;
+  is_record_ok(rec, pl_rec.len - (rec - pl_rec.p), digest, len_play,
+	       ave_child, index.wght, type);
+  if (rec_digest(pl_rec.p, pl_rec.len, digest)) add_redun(id, digest);
+  index.no       = id;
+  index.len_csa  = static_cast<uint>(pl_rec.len);
+  index.len_play = static_cast<unsigned short>(min(len_play, 65535U));
+  index.type     = static_cast<unsigned char>(type);
+  index.digest   = digest;
+  arch.append(PtrLen<const char>(xz.data(), xz.size()), index); }
+
+// One upload on its way through the pipeline
+class Ingest : public OSI::IAddr {
+  using uint = unsigned int;
+  static constexpr size_t len_head = 64U;
+  std::vector<char> _xz, _rec;
+  size_t _offset;
+  uint64_t _seq, _digest;
+  int64_t _id, _wght, _id_seen;
+  uint _len_play, _type;
+  float _ave_child;
+  bool _packed, _seen, _ok;
+
+public:
+  // the first byte of the job tells whether it is a binary record
+  explicit Ingest(uint64_t seq, const JobIP &job) noexcept
+  : _xz(job.get_p() + 1, job.get_p() + job.get_len()), _offset(len_head),
+    _seq(seq), _id_seen(-1), _packed(job.get_p()[0] != 0), _seen(false),
+    _ok(false) {
+    set_iaddr(job); }
+  Ingest & operator=(const Ingest &) = delete;
+  Ingest(const Ingest &) = delete;
+
+  const std::vector<char> &get_xz() const noexcept { return _xz; }
+  uint64_t get_seq() const noexcept { return _seq; }
+  uint64_t get_digest() const noexcept { return _digest; }
+  int64_t get_id() const noexcept { return _id; }
+  uint get_len_play() const noexcept { return _len_play; }
+  float get_ave_child() const noexcept { return _ave_child; }
+  bool ok() const noexcept { return _ok; }
+  bool is_packed() const noexcept { return _packed; }
+  bool is_seen() const noexcept { return _seen; }
+  int64_t get_id_seen() const noexcept { return _id_seen; }
+  void set_seen(bool seen) noexcept { _seen = seen; }
+  void set_id_seen(int64_t id) noexcept { _id_seen = id; }
+  PtrLen<const char> get_rec() const noexcept {
+    return PtrLen<const char>(_rec.data() + _offset, _rec.size() - _offset); }
+  
+  ArchIndex get_index() const noexcept {
+    ArchIndex index;
+    index.no       = _id;
+    index.wght     = _wght;
+    index.len_csa  = static_cast<uint>(_rec.size() - _offset);
+    index.len_play = static_cast<unsigned short>(std::min(_len_play, 65535U));
+    index.type     = static_cast<unsigned char>(_type);
+    index.digest   = _digest;
+    return index; }
+  
+  void set_decoded(const char *p, size_t len, uint64_t digest, uint len_play,
+		   float ave_child, int64_t wght, uint type) noexcept {
+    std::vector<char>().swap(_xz);
+    _rec.resize(len_head + len);
+    memcpy(_rec.data() + len_head, p, len);
+    _digest    = digest;
+    _len_play  = len_play;
+    _ave_child = ave_child;
+    _wght      = wght;
+    _type      = type;
+    _ok        = true; }
+  
+  // replaces the upload by the record compressed with its id
+  void encode() noexcept { encode_rec(get_rec(), _xz); }
+  
+  // prepends "'no<id> <date>\n"
+  void set_id(int64_t id) noexcept {
+    char buf[len_head];
+    size_t len = snprintf(buf, len_head - 1U, "'no%012" PRIi64 " ", id);
+    len += make_time_stamp(buf + len, len_head - len - 1U, "%D");
+    buf[len++] = '\n';
+    assert(len <= len_head);
+    _offset = len_head - len;
+    memcpy(_rec.data() + _offset, buf, len);
+    _id = id; }
+};
 
 void RecKeep::end() noexcept {
   _pJQueue->end();
-  _thread.join(); }
+  _thread.join();
+  
+  // let the records in the pipeline through
+  unique_lock<mutex> lock(_m_ingest);
+  _cv_done.wait(lock, [&]{ return _seq_done == _seq_next; });
+  _bEndIngest = true;
+  lock.unlock();
+  _cv_ingest.notify_all();
+  _cv_commit.notify_all();
+  _cv_arch.notify_all();
+  for (auto &t : _threads_ingest) t.join();
+  _thread_commit.join();
+  _thread_arch.join();
+  _pool.close();
+  _bloom.close(); }
+
+void RecKeep::done() noexcept {
+  lock_guard<mutex> lock(_m_ingest);
+  _seq_done += 1U;
+  _cv_done.notify_all(); }
 
 void RecKeep::worker() noexcept {
   while (true) {
     JobIP *pjob = _pJQueue->pop();
     if (!pjob) break;
-    transact(pjob);
-    pjob->reset(); }
-  close_arch_tmp(); }
 
-void RecKeep::add(const char *prec, size_t len_rec, const OSI::IAddr & iaddr)
-  noexcept {
+    unique_lock<mutex> lock(_m_ingest);
+    _cv_done.wait(lock, [&]{ return _seq_next < _seq_done + _maxlen_job; });
+    _decode_jobs.emplace_back(new Ingest(_seq_next++, *pjob));
+    lock.unlock();
+    _cv_ingest.notify_one();
+    pjob->reset(); } }
+
+void RecKeep::add(const char *prec, size_t len_rec, const OSI::IAddr & iaddr,
+		  bool packed) noexcept {
   assert(prec);
 
   JobIP *pjob = _pJQueue->get_free();
-  pjob->reset(len_rec);
-  memcpy(pjob->get_p(), prec, len_rec);
+  pjob->reset(len_rec + 1U);
+  pjob->get_p()[0] = packed ? 1 : 0;
+  memcpy(pjob->get_p() + 1, prec, len_rec);
   pjob->set_iaddr(iaddr);
   _pJQueue->push_free(); }
 
-void RecKeep::transact(const JobIP *pjob) noexcept {
-  assert(pjob);
-  
-  // add time stamp
-  assert(63U < _maxlen_rec);
-  int64_t id = (_pool.empty() ? 0 : _pool.rbegin()->get_id() + INT64_C(1));
-  char *p    = _prec.get();
-  size_t len_time = 0;
-  len_time = snprintf(p, _maxlen_rec - 1U, "'no%012" PRIi64 " ", id);
-  len_time += make_time_stamp(p + len_time, _maxlen_rec - len_time - 1U, "%D");
-  p[len_time++] = '\n';
-  
-  // decode received message
-  const PtrLen<const char> plxz(pjob->get_p(), pjob->get_len());
-  PtrLen<const char> pl_in = plxz;
-  PtrLen<char> pl_out(_prec.get() + len_time, 0);
-  if (!_xzd.decode(&pl_in, &pl_out, _maxlen_rec - len_time - 1U)) {
-    _logger->out(pjob, bad_XZ_format);
-    return; }
-  assert(len_time + pl_out.len < _maxlen_rec);
-  pl_out.p[pl_out.len] = '\0';
-
-  // examine received message
-  uint64_t digest;
-  uint len_play;
-  float ave_child;
-  if (!is_record_ok(pl_out.p, pl_out.len, digest, len_play, ave_child)) {
-    _logger->out(pjob, bad_CSA_format);
-    return; }
-  
-  if (len_play < _minlen_play) {
-    _logger->out(pjob, "play too short (%u moves)", len_play);
-    return; }
+// Decodes and checks uploads, and compresses the numbered records. The
+// latter come first, as archive() waits for them.
+void RecKeep::ingest() noexcept {
+  XZDecode<PtrLen<const char>, PtrLen<char>> xzd;
+  unique_ptr<char []> buf(new char [_maxlen_rec]);
+  string csa;
   
-  if (ave_child < static_cast<float>(_minave_child)) {
-    _logger->out(pjob, "too few children (%f per a move)", ave_child);
-    return; }
-  
-  PtrLen<char> pl_rec(_prec.get(), len_time + pl_out.len);
+  while (true) {
+    unique_lock<mutex> lock(_m_ingest);
+    _cv_ingest.wait(lock, [&]{ return (_bEndIngest || !_pool_jobs.empty()
+				       || !_decode_jobs.empty()); });
+    if (_bEndIngest) return;
 
-  RedunValue & redun_value = _redundancy_table[Key64(digest)];
-  if (1U < ++redun_value.count) {
-    _logger->out(pjob, "duplication (crc64:%016" PRIx64 " no.:%" PRIu64
-		 " count:%" PRIu64 ")",
-		 digest, redun_value.no, redun_value.count);
-    return; }
-  redun_value.no = static_cast<uint64_t>(id);
-  assert(_redundancy_table.ok());
-  
-  // save the record in pool
-  write_pooltemp(_fpool_tmp, pl_rec);
-  FNameID fpool(id, _dpool);
-  fpool.add_fmt_fname(fmt_pool, id);
-  if (rename(_fpool_tmp.get_fname(), fpool.get_fname()) < 0)
-    die(ERR_CLL("rename"));
-  _pool.insert(fpool);
-  _logger->out(pjob, "record no. %" PRIi64 " arrived (crc64:%016" PRIx64
-	       ", ave:%4.1f, len:%3u)", id, digest, ave_child, len_play);
-
-  // archive a cluster if possible
-  int64_t i64_start = _pool.begin()->get_id();
-  int64_t i64_end   = i64_start + size_cluster;
-  if (i64_end <= _pool.rbegin()->get_id()) {
-    close_arch_tmp();
-
-    FName farch(_darch);
-    farch.add_fmt_fname(fmt_arch, i64_start);
-    if (rename(_farch_tmp.get_fname(), farch.get_fname()) < 0)
-      die(ERR_CLL("rename"));
+    if (!_pool_jobs.empty()) {
+      unique_ptr<Ingest> p = move(_pool_jobs.front());
+      _pool_jobs.pop_front();
+      lock.unlock();
+      
+      p->encode();
+      
+      lock.lock();
+      int64_t id = p->get_id();
+      _pooled[id] = move(p);
+      lock.unlock();
+      _cv_arch.notify_one();
+      continue; }
+    
+    unique_ptr<Ingest> p = move(_decode_jobs.front());
+    _decode_jobs.pop_front();
+    lock.unlock();
+    
+    // decode received message
+    const std::vector<char> &xz = p->get_xz();
+    PtrLen<const char> pl_in(xz.data(), xz.size());
+    PtrLen<char> pl_out(buf.get(), 0);
+    uint64_t digest;
+    uint len_play, type;
+    float ave_child;
+    int64_t wght;
+    if (!xzd.decode(&pl_in, &pl_out, _maxlen_rec - 64U - 1U))
+      _logger->out(p.get(), bad_XZ_format);
+    else {
+      pl_out.p[pl_out.len] = '\0';
+      
+      // examine received message
+      const char *rec = pl_out.p;
+      size_t len_rec  = pl_out.len;
+      bool ok;
+      if (p->is_packed()) {
+	ok = (is_pack_ok(pl_out.p, pl_out.len, csa, digest, len_play,
+			 ave_child, wght, type)
+	      && csa.size() < _maxlen_rec - 64U);
+	rec     = csa.c_str();
+	len_rec = csa.size(); }
+      else ok = is_record_ok(pl_out.p, pl_out.len, digest, len_play,
+			     ave_child, wght, type);
+      
+      if (!ok) _logger->out(p.get(), p->is_packed() ? bad_pack_format
+			    : bad_CSA_format);
+      else if (len_play < _minlen_play)
+	_logger->out(p.get(), "play too short (%u moves)", len_play);
+      else if (ave_child < static_cast<float>(_minave_child))
+	_logger->out(p.get(), "too few children (%f per a move)", ave_child);
+      else {
+	p->set_decoded(rec, len_rec, digest, len_play, ave_child, wght, type);
+	p->set_seen(_bloom.test_and_add(digest));
+	int64_t id;
+	if (p->is_seen() && find_digest(digest, id)) p->set_id_seen(id); } }
+    
+    lock.lock();
+    uint64_t seq = p->get_seq();
+    _decoded[seq] = move(p);
+    lock.unlock();
+    _cv_commit.notify_one(); } }
+
+// Takes the checked records in order of arrival, drops duplications and
+// numbers the rest.
+void RecKeep::commit() noexcept {
+  while (true) {
+    unique_lock<mutex> lock(_m_ingest);
+    _cv_commit.wait(lock, [&]{
+	return _bEndIngest || _decoded.find(_seq_commit) != _decoded.end(); });
+    if (_bEndIngest) return;
+    
+    auto it = _decoded.find(_seq_commit);
+    unique_ptr<Ingest> p = move(it->second);
+    _decoded.erase(it);
+    _seq_commit += 1U;
+    lock.unlock();
+    
+    if (!p->ok()) { done(); continue; }
+    
+    uint64_t digest = p->get_digest();
+    RedunValue & redun_value = _redundancy_table[Key64(digest)];
+    if (1U < ++redun_value.count) {
+      _logger->out(p.get(), "duplication (crc64:%016" PRIx64 " no.:%" PRIu64
+		   " count:%" PRIu64 ")",
+		   digest, redun_value.no, redun_value.count);
+      done();
+      continue; }
+    
+    // A hit of the bloom filter is confirmed by ingest() against the
+    // indexes. An unconfirmed hit is wrong, or the original record is on
+    // its way to the pool, where the table above catches it.
+    if (0 <= p->get_id_seen()) {
+      redun_value.no    = static_cast<uint64_t>(p->get_id_seen());
+      redun_value.count = 2U;
+      _logger->out(p.get(), "duplication (crc64:%016" PRIx64 " no.:%" PRIu64
+		   " count:%" PRIu64 ")",
+		   digest, redun_value.no, redun_value.count);
+      done();
+      continue; }
+    
+    if (p->is_seen())
+      _logger->out(p.get(), "bloom filter hit wrongly (crc64:%016" PRIx64
+		   ")", digest);
+    redun_value.no = static_cast<uint64_t>(_id_next);
+    assert(_redundancy_table.ok());
+    p->set_id(_id_next++);
+    
+    lock.lock();
+    _pool_jobs.push_back(move(p));
+    lock.unlock();
+    _cv_ingest.notify_one(); } }
+
+// Moves the full pool to the archives, the index last, and starts a new
+// pool. recover_pool() finishes the move if it is cut short.
+void RecKeep::archive_pool() noexcept {
+  _pool.close();
+  FName farch(_darch), fidx(_darch);
+  farch.add_fmt_fname(fmt_arch, _id_pool);
+  fidx.add_fmt_fname(fmt_idx, _id_pool);
+  move_file(_fpool, farch, _farch_tmp);
+  move_file(_fpool_idx, fidx, _farch_tmp);
+  _id_pool += size_cluster;
+  _bloom.set_id_end(_id_pool);
+  _pool.open(_fpool, _fpool_idx); }
+
+// Appends the records to the pool in order of id, so that the pool never
+// has a gap. The pool is synced when no record follows right away, or
+// after maxrec_sync records.
+void RecKeep::archive() noexcept {
+  uint nrec_sync = 0;
+  while (true) {
+    unique_lock<mutex> lock(_m_ingest);
+    _cv_arch.wait(lock, [&]{
+	return _bEndIngest || _pooled.find(_id_arch) != _pooled.end(); });
+    if (_bEndIngest) return;
+    
+    auto it = _pooled.find(_id_arch);
+    unique_ptr<Ingest> p = move(it->second);
+    _pooled.erase(it);
+    bool bNext = (_pooled.find(_id_arch + 1) != _pooled.end());
+    lock.unlock();
+    
+    int64_t id = _id_arch++;
+    if (_id_pool + static_cast<int64_t>(size_cluster) <= id) {
+      archive_pool();
+      nrec_sync = 0; }
     
-    for (auto it = _pool.begin();
-	 it != _pool.end() && it->get_id() < i64_end; it = _pool.erase(it))
-      if (remove(it->get_fname()) < 0) die(ERR_CLL("remove"));
+    ArchIndex index = p->get_index();
+    const vector<char> &xz = p->get_xz();
+    _pool.append(PtrLen<const char>(xz.data(), xz.size()), index);
+    if (!bNext || maxrec_sync <= ++nrec_sync) {
+      _pool.sync();
+      nrec_sync = 0; }
     
-    open_arch_tmp(); }
-
-  // write to arch's temp file
-  if (_bFirst) _bFirst = false;
-  else {
-    pl_in = pl_CSAsepa;
-    _xze.append(&pl_in); }
-  
-  pl_in = pl_rec;
-  _xze.append(&pl_in);
-  if (!_ofs_arch_tmp)
-    die(ERR_INT("cannot write to %s", _farch_tmp.get_fname())); }
+    _logger->out(p.get(), "record no. %" PRIi64 " arrived (crc64:%016" PRIx64
+		 ", ave:%4.1f, len:%3u)", id, p->get_digest(),
+		 p->get_ave_child(), p->get_len_play());
+    done(); } }
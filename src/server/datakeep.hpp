@@ -5,26 +5,36 @@
 #include "hashtbl.hpp"
 #include "xzi.hpp"
 #include <atomic>
+#include <condition_variable>
+#include <deque>
 #include <fstream>
 #include <map>
 #include <memory>
 #include <mutex>
 #include <set>
 #include <thread>
+#include <utility>
+#include <vector>
 #include <cstdint>
 namespace OSI { class IAddr; }
 
+// A weight file mapped read-only. The descriptor stays open so that
+// Listen can sendfile() it to the players.
 class Wght {
   int64_t _no;
+  int _fd;
   size_t _len;
-  std::unique_ptr<char []> _p;
+  const char *_p;
   
 public:
-  explicit Wght(int64_t no, size_t len) noexcept : _no(no), _len(len),
-						   _p(new char[len]) {}
-  const PtrLen<char> ptrlen() const noexcept {
-    return PtrLen<char>(_p.get(), _len); }
-  const char *get_p() const noexcept { return _p.get(); }
+  explicit Wght(int64_t no, const char *fname) noexcept;
+  ~Wght() noexcept;
+  Wght(const Wght &) = delete;
+  Wght & operator=(const Wght &) = delete;
+  const PtrLen<const char> ptrlen() const noexcept {
+    return PtrLen<const char>(_p, _len); }
+  const char *get_p() const noexcept { return _p; }
+  int get_fd() const noexcept { return _fd; }
   int64_t get_no() const noexcept { return _no; }
   size_t get_len() const noexcept { return _len; }
 };
@@ -59,7 +69,67 @@ public:
   bool get_crc64(int64_t no, uint64_t &digest) const noexcept;
 };
 
+// Appends records to an archive and its index (see ArchIndex). open()
+// keeps the first nrec records (len bytes) of the files, and sync() makes
+// the records so far durable, the archive first.
+class ArchWriter {
+  using uint = unsigned int;
+  FName _fxz, _fidx;
+  int _fd_xz, _fd_idx;
+  int64_t _len;
+  uint _nrec;
+
+public:
+  explicit ArchWriter() noexcept : _fd_xz(-1), _fd_idx(-1) {}
+  ~ArchWriter() noexcept { close(); }
+  ArchWriter(const ArchWriter &) = delete;
+  ArchWriter & operator=(const ArchWriter &) = delete;
+  void open(const FName &fxz, const FName &fidx, int64_t len = 0,
+	    uint nrec = 0) noexcept;
+  void append(PtrLen<const char> plxz, ArchIndex &index) noexcept;
+  void sync() noexcept;
+  void close() noexcept;
+  uint get_nrec() const noexcept { return _nrec; }
+};
+
+// A blocked bloom filter of the digests of all the records, kept in a
+// file mapped shared so that it outlives the server. A digest owns nbit
+// bits of a single 64-bit word, so that a test and an addition is one
+// atomic fetch-or, and the ingest() threads share the filter without a
+// lock. The header tells up to which id the archives are in the filter.
+class BloomFilter {
+  using uint = unsigned int;
+  static constexpr size_t len_head = 64U;
+  static constexpr uint nbit       = 8U;
+  static constexpr uint nbit_rec   = 16U;
+  int _fd;
+  size_t _len;
+  char *_p;
+  std::atomic<uint64_t> *_words;
+  uint _log2_nword;
+  
+public:
+  explicit BloomFilter() noexcept : _fd(-1), _p(nullptr) {}
+  ~BloomFilter() noexcept { close(); }
+  BloomFilter(const BloomFilter &) = delete;
+  BloomFilter & operator=(const BloomFilter &) = delete;
+  void open(const FName &fname, uint64_t nrec) noexcept;
+  void close() noexcept;
+  bool test_and_add(uint64_t digest) noexcept;
+  int64_t get_id_end() const noexcept;
+  void set_id_end(int64_t id) noexcept;
+};
+
 template <typename T> class JQueue;
+// Records go through a pipeline: worker() hands the uploads out in order
+// of arrival, ingest() threads decode and check them, commit() assigns
+// the ids in order of arrival, ingest() threads compress them, and
+// archive() appends them in order of id to the pool. The pool is a log of
+// the records of the current cluster, which is synced once for the
+// records that come together, and which moves to the archives when full.
+// Duplications are caught by an exact table of the recent records, and by
+// a bloom filter of all the records whose hits are confirmed against the
+// digests in the indexes. Only commit() uses the table after start().
 class RecKeep {
   using uint = unsigned int;
   struct RedunValue {
@@ -68,24 +138,45 @@ class RecKeep {
     RedunValue & operator=(const RedunValue &value) noexcept {
       no = value.no; count = value.count; return *this; }
   };
-  std::thread _thread;
+  std::thread _thread, _thread_commit, _thread_arch;
+  std::vector<std::thread> _threads_ingest;
   std::unique_ptr<JQueue<class JobIP>> _pJQueue;
-  std::set<FNameID> _pool;
   HashTable<Key64, RedunValue> _redundancy_table;
+  BloomFilter _bloom;
   class Logger *_logger;
-  FName _fpool_tmp, _farch_tmp;
-  XZDecode<PtrLen<const char>, PtrLen<char>> _xzd;
-  XZEncode<PtrLen<const char>, std::ofstream> _xze;
-  std::ofstream _ofs_arch_tmp;
+  FName _farch_tmp, _fpool, _fpool_idx;
+  ArchWriter _pool;
   size_t _maxlen_rec;
   FName _darch, _dpool;
   std::unique_ptr<char []> _prec;
   uint _maxrec_sec, _maxrec_min, _maxrec_len, _minlen_play, _minave_child;
-  bool _bFirst;
+
+  // the pipeline, guarded by _m_ingest
+  std::mutex _m_ingest;
+  std::condition_variable _cv_ingest, _cv_commit, _cv_arch, _cv_done;
+  std::deque<std::unique_ptr<class Ingest>> _decode_jobs, _pool_jobs;
+  std::map<uint64_t, std::unique_ptr<class Ingest>> _decoded;
+  std::map<int64_t, std::unique_ptr<class Ingest>> _pooled;
+  uint64_t _seq_next, _seq_commit, _seq_done;
+  int64_t _id_next, _id_arch, _id_pool;
+  uint _maxlen_job;
+  bool _bEndIngest;
 
   void worker() noexcept;
-  void close_arch_tmp() noexcept;
-  void open_arch_tmp() noexcept;
+  void ingest() noexcept;
+  void commit() noexcept;
+  void archive() noexcept;
+  void done() noexcept;
+  void scan_archives(int64_t id_end) noexcept;
+  void add_redun(int64_t id, uint64_t digest) noexcept;
+  bool find_digest(uint64_t digest, int64_t &id) const noexcept;
+  bool read_pool(int64_t &len, uint &nrec,
+		 std::vector<std::pair<int64_t, uint64_t>> &digests) noexcept;
+  void rebuild_pool_idx() noexcept;
+  void recover_pool() noexcept;
+  void recover_pool_files() noexcept;
+  void append_pool_file(ArchWriter &arch, int64_t id) noexcept;
+  void archive_pool() noexcept;
 
   // special member functions
   explicit RecKeep() noexcept;
@@ -99,10 +190,10 @@ public:
   
   void start(Logger *logger, const char *darch, const char *dpool,
 	     uint maxlen_job, size_t maxlen_rec, size_t maxlen_recv,
-	     uint log2_nindex_redun, uint minlen_play, uint minave_child)
-    noexcept;
+	     uint log2_nindex_redun, uint64_t nrec_bloom, uint minlen_play,
+	     uint minave_child) noexcept;
     
   void end() noexcept;
-  void transact(const JobIP *pJob) noexcept;
-  void add(const char *prec, size_t len_rec, const OSI::IAddr &iaddr) noexcept;
+  void add(const char *prec, size_t len_rec, const OSI::IAddr &iaddr,
+	   bool packed) noexcept;
 };
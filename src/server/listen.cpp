@@ -16,8 +16,11 @@
 #include <thread>
 #include <cassert>
 #include <cstring>
+#include <fcntl.h>
 #include <unistd.h>
 #include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -46,10 +49,11 @@ using namespace Log;
 using namespace IOAux;
 
 constexpr uint deny_log_interval   = 3U; // in sec
+constexpr int max_events           = 256;
 constexpr char fname_deny_list[]   = "deny_list.cfg";
 constexpr char fname_ignore_list[] = "ignore_list.cfg";
 
-enum Cmd { RecvRec = 0, SendInfo = 1, SendWght = 2 };
+enum Cmd { RecvRec = 0, SendInfo = 1, SendWght = 2, RecvPack = 3 };
 enum class StatSend { DoNothing, SendInfo, SendWght, SendHeader };
 
 class IAddrValue {
@@ -96,8 +100,12 @@ class Peer : public OSI::IAddr {
   size_t _len, _len_sent;
   unique_ptr<char []> _buf;
   shared_ptr<const Wght> _wght;
-  uint _iblock;
+  uint _iblock, _gen;
   StatSend _stat_send;
+  bool _readable, _writable, _active;
+  char _out[12];
+  uint _len_out, _len_out_sent;
+  size_t _len_window;
   
 public:
   // special member functions
@@ -110,28 +118,52 @@ public:
   StatSend get_stat_send() const noexcept { return _stat_send; }
   bool have_wght() const noexcept { return static_cast<bool>(_wght); }
   uint get_iblock() const noexcept { return _iblock; }
+  uint get_gen() const noexcept { return _gen; }
   int get_sckt() const noexcept { return _sckt; }
   int sckt_ok() const noexcept { return 0 <= _sckt; }
   size_t get_len() const noexcept { return _len; }
   size_t get_len_sent() const noexcept { return _len_sent; }
   const Wght *get_wght() const noexcept { return _wght.get(); }
   const time_point<system_clock> &get_time() const noexcept { return _time; }
+  bool is_readable() const noexcept { return _readable; }
+  bool is_writable() const noexcept { return _writable; }
+  bool is_active() const noexcept { return _active; }
+  bool have_out() const noexcept { return _len_out_sent < _len_out; }
+  const char *get_out() const noexcept { return _out + _len_out_sent; }
+  size_t get_len_out() const noexcept { return _len_out - _len_out_sent; }
+  size_t get_len_window() const noexcept { return _len_window; }
   
   // non-const member functions
-  explicit Peer(size_t len) noexcept : _sckt(-1), _buf(new char [len]) {}
+  explicit Peer(size_t len) noexcept
+    : _sckt(-1), _buf(new char [len]), _gen(0), _active(false) {}
   void set_stat_send(StatSend stat_send) noexcept { _stat_send = stat_send; }
-  void set_sckt(int sckt) noexcept { _sckt = sckt; }
+  void set_sckt(int sckt) noexcept {
+    _sckt = sckt;
+    _readable = _writable = false;
+    _len_out = _len_out_sent = 0; }
   void set_len(size_t len) noexcept { _len = len; }
   void set_len_sent(size_t len) noexcept { _len_sent = len; }
   void set_iblock(uint u) noexcept { _iblock = u; }
   void set_wght(shared_ptr<const Wght> wght) noexcept { _wght = wght; }
+  void set_readable(bool b) noexcept { _readable = b; }
+  void set_writable(bool b) noexcept { _writable = b; }
+  void set_active(bool b) noexcept { _active = b; }
+  void set_len_window(size_t len) noexcept { _len_window = len; }
   void reset_wght() noexcept { _wght.reset(); }
   void reset_time() noexcept { _time = system_clock::now(); }
   char *get_buf() noexcept { return _buf.get(); }
+  char *set_out(uint len) noexcept {
+    assert(len <= sizeof(_out));
+    _len_out = len; _len_out_sent = 0;
+    return _out; }
+  void add_len_out_sent(size_t len) noexcept {
+    assert(_len_out_sent + len <= _len_out);
+    _len_out_sent += static_cast<uint>(len); }
   void clear() noexcept {
     assert(sckt_ok());
     close(_sckt);
     _wght.reset();
+    _gen += 1U;
     _sckt = -1; }
 };
 
@@ -209,6 +241,17 @@ ssize_t Listen::send_wrap(const Peer &peer, const void *buf, size_t len,
   value.update_size_com(ret, _now);
   return ret; }
 
+ssize_t Listen::sendfile_wrap(const Peer &peer, int fd, off_t offset,
+			      size_t len) noexcept {
+  assert(peer.sckt_ok() && 0 <= fd);
+  ssize_t ret = sendfile(peer.get_sckt(), fd, &offset, len);
+  if (ret <= 0) return ret;
+  IAddrValue & value = (*_maxconn_table)[IAddrKey(peer)];
+  assert(_maxconn_table->ok());
+  if (!value.initialized()) value.reset(_maxconn_len, _now);
+  value.update_size_com(ret, _now);
+  return ret; }
+
 ssize_t Listen::recv_wrap(const Peer &peer, void *buf, size_t len,
 			  int flags) noexcept {
   assert(peer.sckt_ok() && buf);
@@ -228,9 +271,18 @@ ssize_t Listen::recv_wrap(const Peer &peer, void *buf, size_t len,
 Listen::Listen() noexcept : _bEndWorker(false), _s_addr(new sockaddr_in),
   _deny_list(new AddrList(fname_deny_list)),
   _ignore_list(new AddrList(fname_ignore_list)),
-  _last_deny(system_clock::now()), _now(system_clock::now()), _sckt_lstn(-1) {}
+  _last_deny(system_clock::now()), _now(system_clock::now()), _sckt_lstn(-1),
+  _epfd(-1), _busy(false) {}
+
+Listen::~Listen() noexcept {
+  if (0 <= _epfd) close(_epfd);
+  if (0 <= _sckt_lstn) close(_sckt_lstn); }
+
+static uint64_t epoll_data(uint index, uint gen) noexcept {
+  return (static_cast<uint64_t>(gen) << 32) | index; }
 
-Listen::~Listen() noexcept { if (0 <= _sckt_lstn) close(_sckt_lstn); }
+static int64_t to_sec(const time_point<system_clock> &t) noexcept {
+  return duration_cast<seconds>(t.time_since_epoch()).count(); }
 
 void Listen::worker() noexcept {
   while (!_bEndWorker) {
@@ -269,8 +321,7 @@ void Listen::start(Logger *logger, uint port_player, uint backlog,
   _max_recv      = max_recv;
   _max_send      = max_send;
   _len_block     = len_block;
-  _selectTO_sec  = selectTO / 1000U;
-  _selectTO_usec = (selectTO % 1000U) * 1000U;
+  _selectTO      = selectTO;
   _playerTO      = playerTO;
   _thread        = thread(&Listen::worker, this);
   
@@ -286,154 +337,201 @@ void Listen::start(Logger *logger, uint port_player, uint backlog,
   if (bind(_sckt_lstn, reinterpret_cast<sockaddr *>(_s_addr.get()),
 	   sizeof(*_s_addr)) < 0) die(ERR_CLL("bind"));
   if (listen(_sckt_lstn, backlog) < 0) die(ERR_CLL("listen"));
+  int flags = fcntl(_sckt_lstn, F_GETFL);
+  if (flags < 0 || fcntl(_sckt_lstn, F_SETFL, flags | O_NONBLOCK) < 0)
+    die(ERR_CLL("fcntl"));
 
   _pPeer.reset(new Peer [_max_accept]);
-  for (uint u = 0; u < _max_accept; ++u) new (&(_pPeer[u])) Peer(_max_recv); }
+  for (uint u = 0; u < _max_accept; ++u) new (&(_pPeer[u])) Peer(_max_recv);
+  _free_peer.reserve(_max_accept);
+  _active_peer.reserve(_max_accept);
+  for (uint u = _max_accept; 0 < u; --u) _free_peer.push_back(u - 1U);
+
+  // a connection is due in its slot TimeoutPlayer + 1 sec after accepted
+  _wheel.resize(_playerTO + 2U);
+  _wheel_sec = to_sec(_now);
+
+  _epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (_epfd < 0) die(ERR_CLL("epoll_create1"));
+  epoll_event ev;
+  ev.events   = EPOLLIN | EPOLLET;
+  ev.data.u64 = epoll_data(_max_accept, 0);
+  if (epoll_ctl(_epfd, EPOLL_CTL_ADD, _sckt_lstn, &ev) < 0)
+    die(ERR_CLL("epoll_ctl")); }
+
+void Listen::close_peer(Peer &peer) noexcept {
+  peer.clear();
+  _free_peer.push_back(static_cast<uint>(&peer - _pPeer.get())); }
+
+void Listen::activate(uint index) noexcept {
+  Peer &peer = _pPeer[index];
+  if (peer.is_active()) return;
+  peer.set_active(true);
+  _active_peer.push_back(index); }
+
+void Listen::expire() noexcept {
+  int64_t sec = to_sec(_now);
+  if (sec < _wheel_sec) return;
+  
+  // all the slots at most, even if the clock jumps forward
+  int64_t len = static_cast<int64_t>(_wheel.size());
+  for (int64_t t = max(_wheel_sec, sec - len + 1); t <= sec; ++t) {
+    auto &slot = _wheel[t % len];
+    for (const auto &e : slot) {
+      Peer &peer = _pPeer[e.first];
+      if (!peer.sckt_ok() || peer.get_gen() != e.second) continue;
+      _logger->out(&peer, closed_timeout);
+      close_peer(peer); }
+    slot.clear(); }
+  _wheel_sec = sec + 1; }
 
 void Listen::handle_connect() noexcept {
-  sockaddr_in c_addr;
+  while (true) {
+    sockaddr_in c_addr;
     
-  memset(&c_addr, 0, sizeof(c_addr));
-  socklen_t c_len = sizeof(c_addr);
-  int sckt = accept(_sckt_lstn, reinterpret_cast<sockaddr *>(&c_addr), &c_len);
-  if (sckt < 0) die(ERR_CLL("accept"));
-
-  OSI::IAddr iaddr(c_addr);
-  if (_deny_list->find(iaddr.get_addr())) {
-    if (_last_deny + seconds(deny_log_interval) < _now) {
-      _logger->out(&iaddr, conn_denied);
-      _last_deny = _now; }
-    close(sckt);
-    return; }
-
-  IAddrValue & maxconn_value = (*_maxconn_table)[IAddrKey(iaddr)];
-  assert(_maxconn_table->ok());
-  if (!maxconn_value.initialized()) maxconn_value.reset(_maxconn_len, _now);
-  time_point<system_clock> *ring = maxconn_value.get_tbl_recv_time();
-  uint len = maxconn_value.get_len();
-
-  if (_cutconn_min <= len
-      && _now < ring[(len - _cutconn_min) % _maxconn_len] + seconds(60)) {
-    _deny_list->insert(iaddr);
-    _logger->out(&iaddr, cut_conn_min);
-    close(sckt);
-    return; }
-  
-  if (_maxconn_sec <= len
-      && _now < ring[(len - _maxconn_sec) % _maxconn_len] + seconds(1)) {
-    _logger->out(&iaddr, too_many_conn_sec);
-    return; }
-  
-  if (_maxconn_min <= len
-      && _now < ring[(len - _maxconn_min) % _maxconn_len] + seconds(60)) {
-    _logger->out(&iaddr, too_many_conn_min);
-    return; }
-  
-  ring[len % _maxconn_len] = _now;
-  maxconn_value.set_len(++len);
-
-  uint u;
-  for (u = 0; u < _max_accept && _pPeer[u].sckt_ok(); ++u);
-  if (u == _max_accept) {
-    _logger->out(&iaddr, too_many_conn);
-    close(sckt);
-    return; }
-
-  Peer &pr = _pPeer[u];
-  pr.set_sckt(sckt);
-  pr.set_iaddr(c_addr);
-  pr.set_len(0);
-  pr.reset_time();
-  pr.set_stat_send(StatSend::SendHeader);
-  _logger->out(&pr, conn_accepted); }
-
-void Listen::handle_send(Peer &peer) noexcept {
-  if (!peer.sckt_ok()) return;
-  
-  if (peer.get_stat_send() == StatSend::SendHeader) {
-    char buf[8];
+    memset(&c_addr, 0, sizeof(c_addr));
+    socklen_t c_len = sizeof(c_addr);
+    int sckt = accept4(_sckt_lstn, reinterpret_cast<sockaddr *>(&c_addr),
+		       &c_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (sckt < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+    if (sckt < 0 && errno == ECONNABORTED) continue;
+    if (sckt < 0) die(ERR_CLL("accept4"));
+    
+    OSI::IAddr iaddr(c_addr);
+    if (_deny_list->find(iaddr.get_addr())) {
+      if (_last_deny + seconds(deny_log_interval) < _now) {
+	_logger->out(&iaddr, conn_denied);
+	_last_deny = _now; }
+      close(sckt);
+      continue; }
+    
+    IAddrValue & maxconn_value = (*_maxconn_table)[IAddrKey(iaddr)];
+    assert(_maxconn_table->ok());
+    if (!maxconn_value.initialized()) maxconn_value.reset(_maxconn_len, _now);
+    time_point<system_clock> *ring = maxconn_value.get_tbl_recv_time();
+    uint len = maxconn_value.get_len();
+    
+    if (_cutconn_min <= len
+	&& _now < ring[(len - _cutconn_min) % _maxconn_len] + seconds(60)) {
+      _deny_list->insert(iaddr);
+      _logger->out(&iaddr, cut_conn_min);
+      close(sckt);
+      continue; }
+    
+    if (_maxconn_sec <= len
+	&& _now < ring[(len - _maxconn_sec) % _maxconn_len] + seconds(1)) {
+      _logger->out(&iaddr, too_many_conn_sec);
+      close(sckt);
+      continue; }
+    
+    if (_maxconn_min <= len
+	&& _now < ring[(len - _maxconn_min) % _maxconn_len] + seconds(60)) {
+      _logger->out(&iaddr, too_many_conn_min);
+      close(sckt);
+      continue; }
+    
+    ring[len % _maxconn_len] = _now;
+    maxconn_value.set_len(++len);
+    
+    if (_free_peer.empty()) {
+      _logger->out(&iaddr, too_many_conn);
+      close(sckt);
+      continue; }
+    
+    uint index = _free_peer.back();
+    _free_peer.pop_back();
+    Peer &pr = _pPeer[index];
+    pr.set_sckt(sckt);
+    pr.set_iaddr(c_addr);
+    pr.set_len(0);
+    pr.set_len_window(_max_send);
+    pr.reset_time();
+    
+    char *buf = pr.set_out(8);
     buf[0] = static_cast<char>(Ver::major);
     buf[1] = static_cast<char>(Ver::minor);
     int_to_bytes<ushort>(Ver::usi_engin, buf + 2);
-    buf[4] = buf[5] = buf[6] = buf[7] = 0;
-
-    ssize_t ret = send_wrap(peer, buf, 8, 0);
-    if (ret < 0 && errno == ECONNRESET) {
-      _logger->out(&peer, fmt_reset_s, "send header");
-      peer.clear();
-      return; }
-    if (ret < 0) die(ERR_CLL("send"));
+    buf[4] = static_cast<char>(Ver::accept_recpack);
+    buf[5] = buf[6] = buf[7] = 0;
+    pr.set_stat_send(StatSend::SendHeader);
     
-    peer.set_stat_send(StatSend::DoNothing);
+    epoll_event ev;
+    ev.events   = EPOLLIN | EPOLLOUT | EPOLLET;
+    ev.data.u64 = epoll_data(index, pr.get_gen());
+    if (epoll_ctl(_epfd, EPOLL_CTL_ADD, sckt, &ev) < 0)
+      die(ERR_CLL("epoll_ctl"));
+    
+    int64_t due = to_sec(_now) + _playerTO + 1;
+    _wheel[due % static_cast<int64_t>(_wheel.size())].emplace_back(index,
+								   pr.get_gen());
+    _logger->out(&pr, conn_accepted); } }
+
+// One send() of a header or of weight info, or one sendfile() of a piece
+// of a weight block straight from the mapped file. The piece starts at
+// MaxSend bytes and doubles while the socket takes it all, up to the
+// block, so that fast players need fewer rounds. A piece is never more
+// than MaxComPerAddr, so that one call cannot go far past the throttle.
+void Listen::handle_send(Peer &peer) noexcept {
+  assert(peer.sckt_ok() && peer.get_stat_send() != StatSend::DoNothing);
+  StatSend stat = peer.get_stat_send();
+  const Wght *wght = peer.get_wght();
+  size_t len_block = _len_block;
+  size_t len_start = len_block * static_cast<size_t>(peer.get_iblock());
+  size_t len_piece = min(len_block, static_cast<size_t>(_maxlen_com));
+  size_t len_send  = 0;
+  size_t len_sent  = peer.get_len_sent();
+  size_t len_buf;
+  const char *what;
+  ssize_t ret;
+  
+  if (peer.have_out()) {
+    len_buf = peer.get_len_out();
+    if      (stat == StatSend::SendHeader) what = "send header";
+    else if (stat == StatSend::SendInfo)   what = "send info";
+    else                                   what = "send wght header";
+    // the block follows the header of a weight block at once
+    int flags = MSG_NOSIGNAL | (stat == StatSend::SendWght ? MSG_MORE : 0);
+    ret = send_wrap(peer, peer.get_out(), len_buf, flags); }
+  else {
+    assert(stat == StatSend::SendWght && peer.have_wght());
+    assert(len_start < wght->get_len());
+    len_send = min(wght->get_len() - len_start, len_block);
+    assert(len_sent < len_send);
+    len_buf  = min(min(len_send - len_sent, peer.get_len_window()),
+		   len_piece);
+    what     = "send wght block";
+    ret = sendfile_wrap(peer, wght->get_fd(),
+			static_cast<off_t>(len_start + len_sent), len_buf); }
+  
+  if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+    peer.set_writable(false);
+    peer.set_len_window(max(peer.get_len_window() / 2U,
+			    static_cast<size_t>(_max_send)));
     return; }
-
-  if (peer.get_stat_send() == StatSend::SendInfo) {
-    assert(peer.have_wght());
-    const Wght *wght = peer.get_wght();
-    size_t len_wght  = wght->get_len();
-    size_t q = len_wght / static_cast<size_t>(_len_block);
-    size_t r = len_wght % static_cast<size_t>(_len_block);
-    size_t nblock    = q + min(r,size_t(1));
-    int64_t no_wght  = wght->get_no();
-    char buf[12];
-
-    int_to_bytes<int64_t>(no_wght, buf);
-    int_to_bytes<uint>(static_cast<uint>(nblock), buf + 8);
-    ssize_t ret = send_wrap(peer, buf, 12, 0);
-    if (ret < 0 && errno == ECONNRESET) {
-      _logger->out(&peer, fmt_reset_s, "send info");
-      peer.clear();
-      return; }
-    if (ret < 0) die(ERR_CLL("send"));
-    _logger->out(&peer, fmt_info_sent_ll, no_wght);
+  if (ret < 0 && (errno == ECONNRESET || errno == EPIPE)) {
+    _logger->out(&peer, fmt_reset_s, what);
+    close_peer(peer);
+    return; }
+  if (ret < 0) die(ERR_CLL(peer.have_out() ? "send" : "sendfile"));
+  
+  if (peer.have_out()) {
+    peer.add_len_out_sent(ret);
+    if (peer.have_out() || stat == StatSend::SendWght) return;
+    if (stat == StatSend::SendInfo)
+      _logger->out(&peer, fmt_info_sent_ll, wght->get_no());
     peer.set_stat_send(StatSend::DoNothing);
     return; }
-
-  if (peer.get_stat_send() == StatSend::SendWght) {
-    assert(peer.have_wght());
-    const Wght *wght   = peer.get_wght();
-    const char *p_wght = wght->get_p();
-    size_t len_wght    = wght->get_len();
-    size_t len_block   = _len_block;
-    size_t iblock      = peer.get_iblock();
-    size_t len_start   = len_block * iblock;
-    size_t max_send    = _max_send;
-    size_t len_sent    = peer.get_len_sent();
-    size_t len_rest    = len_wght - len_start;
-    size_t len_send    = min(len_rest, len_block);
-    ssize_t ret;
-    assert(0 < len_rest && len_sent < len_send && len_start < len_wght);
-
-    if (len_sent == 0) {
-      if (iblock == 0) _logger->out(&peer, fmt_wght_sent_ll, wght->get_no());
-      char buf[4];
-      int_to_bytes<uint>(static_cast<uint>(len_send), buf);
-      ret = send_wrap(peer, buf, 4, 0);
-      if (ret < 0 && errno == ECONNRESET) {
-	_logger->out(&peer, fmt_reset_s, "send wght header");
-	peer.clear();
-	return; }
-      if (ret < 0) die(ERR_CLL("send"));
-      
-      assert(4 <= max_send);
-      max_send -= 4; }
-    
-    size_t len_buf = min(len_send - len_sent, max_send);
-    ret = send_wrap(peer, p_wght + len_start + len_sent, len_buf, 0);
-    if (ret < 0 && errno == ECONNRESET) {
-      _logger->out(&peer, fmt_reset_s, "send wght block");
-      peer.clear();
-      return; }
-    if (ret < 0) die(ERR_CLL("send"));
   
-    len_sent += len_buf;
-    assert(len_sent <= len_block);
-    assert(len_start + len_sent <= len_wght);
-    if ( len_sent < len_send) peer.set_len_sent(len_sent);
-    else peer.set_stat_send(StatSend::DoNothing); } }
+  if (static_cast<size_t>(ret) == len_buf)
+    peer.set_len_window(min(peer.get_len_window() * 2U, len_piece));
+  len_sent += ret;
+  assert(len_sent <= len_block);
+  assert(len_start + len_sent <= wght->get_len());
+  if (len_sent < len_send) peer.set_len_sent(len_sent);
+  else peer.set_stat_send(StatSend::DoNothing); }
 
 void Listen::handle_recv(Peer &peer) noexcept {
-  if (!peer.sckt_ok()) return;
+  assert(peer.sckt_ok());
   
   char *buf(peer.get_buf());
   size_t len_tot = peer.get_len();
@@ -442,14 +540,17 @@ void Listen::handle_recv(Peer &peer) noexcept {
   size_t len_avail = _max_recv - len_tot;
 
   ssize_t ret = recv_wrap(peer, buf + len_tot, len_avail, 0);
+  if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+    peer.set_readable(false);
+    return; }
   if (ret < 0 && errno == ECONNRESET) {
     _logger->out(&peer, fmt_reset_s, "recv");
-    peer.clear();
+    close_peer(peer);
     return; }
   if (ret < 0) die(ERR_CLL("recv"));
   if (ret == 0) {
     _logger->out(&peer, shutdown_peer);
-    peer.clear();
+    close_peer(peer);
     return; }
 
   len_tot += ret;
@@ -458,7 +559,7 @@ void Listen::handle_recv(Peer &peer) noexcept {
   while (true) {
     constexpr size_t len_header(5U);
     if (len_tot == 0) return;
-    if (buf[0] == Cmd::RecvRec) {
+    if (buf[0] == Cmd::RecvRec || buf[0] == Cmd::RecvPack) {
       if (len_tot <= len_header) return;
       
       size_t len_rec = bytes_to_int<uint>(buf + 1);
@@ -469,7 +570,8 @@ void Listen::handle_recv(Peer &peer) noexcept {
       
       if (_ignore_list->find(peer.get_addr()))
 	_logger->out(&peer, record_ignored);
-      else RecKeep::get().add(buf + len_header, len_rec, peer);
+      else RecKeep::get().add(buf + len_header, len_rec, peer,
+			      buf[0] == Cmd::RecvPack);
       len_tot -= len_header + len_rec;
       memmove(buf, buf + len_header + len_rec, len_tot);
       peer.set_len(len_tot);
@@ -484,6 +586,15 @@ void Listen::handle_recv(Peer &peer) noexcept {
       memmove(buf, buf + 1, len_tot);
       peer.set_len(len_tot);
       peer.set_wght(WghtKeep::get().get_pw());
+
+      const Wght *wght = peer.get_wght();
+      size_t len_wght  = wght->get_len();
+      size_t q = len_wght / static_cast<size_t>(_len_block);
+      size_t r = len_wght % static_cast<size_t>(_len_block);
+      size_t nblock    = q + min(r,size_t(1));
+      char *out = peer.set_out(12);
+      int_to_bytes<int64_t>(wght->get_no(), out);
+      int_to_bytes<uint>(static_cast<uint>(nblock), out + 8);
       peer.set_stat_send(StatSend::SendInfo);
       return; }
 
@@ -501,7 +612,7 @@ void Listen::handle_recv(Peer &peer) noexcept {
       size_t len_block = _len_block;
       size_t len_wght  = wght->get_len();
       size_t len_start = len_block * static_cast<size_t>(iblock);
-      if (len_wght < len_start) {
+      if (len_wght <= len_start) {
 	_logger->out(&peer, fmt_bad_cmd_s, "iblock too large");
 	break; }
 
@@ -510,55 +621,62 @@ void Listen::handle_recv(Peer &peer) noexcept {
       peer.set_len(len_tot);
       peer.set_len_sent(0);
       peer.set_iblock(iblock);
+      if (iblock == 0) _logger->out(&peer, fmt_wght_sent_ll, wght->get_no());
+      size_t len_send = min(len_wght - len_start, len_block);
+      int_to_bytes<uint>(static_cast<uint>(len_send), peer.set_out(4));
       peer.set_stat_send(StatSend::SendWght);
       return; }
     
     _logger->out(&peer, fmt_bad_cmd_d, static_cast<int>(buf[0]));
     break; }
   
-  peer.clear(); }
+  close_peer(peer); }
 
 void Listen::wait() noexcept {
-  timeval tv;
-  fd_set read_fds, write_fds;
-
-  tv.tv_sec  = _selectTO_sec;
-  tv.tv_usec = _selectTO_usec;
-  FD_ZERO(&read_fds);
-  FD_ZERO(&write_fds);
-  FD_SET(_sckt_lstn, &read_fds);
-  int maxfd = _sckt_lstn;
+  epoll_event events[max_events];
+  int nev = epoll_wait(_epfd, events, max_events,
+		       _busy ? 0 : static_cast<int>(_selectTO));
+  if (nev < 0 && errno != EINTR) die(ERR_CLL("epoll_wait"));
   
-  for (uint u = 0; u < _max_accept; ++u) {
-    Peer & peer = _pPeer[u];
-    if (!peer.sckt_ok()) continue;
-    
-    if (peer.get_time() + seconds(_playerTO) < _now) {
-      _logger->out(&peer, closed_timeout);
-      peer.clear();
-      continue; }
-
-    int sckt = peer.get_sckt();
-    FD_SET(sckt, &read_fds);
-    maxfd = max(maxfd, sckt);
-    if (peer.get_stat_send() == StatSend::DoNothing) continue;
-    
-    IAddrValue & value = (*_maxconn_table)[IAddrKey(peer)];
-    assert(_maxconn_table->ok());
-    if (!value.initialized()) value.reset(_maxconn_len, _now);
-    if (_maxlen_com < value.get_size_com(_now)) continue;
-    FD_SET(sckt, &write_fds); }
+  _now = system_clock::now();
+  expire();
   
-  if (select(maxfd + 1, &read_fds, &write_fds, NULL, &tv) < 0)
-    die(ERR_CLL("select"));
+  bool bConnect = false;
+  for (int i = 0; i < nev; ++i) {
+    uint index = static_cast<uint>(events[i].data.u64);
+    uint gen   = static_cast<uint>(events[i].data.u64 >> 32);
+    if (index == _max_accept) { bConnect = true; continue; }
+    
+    Peer &peer = _pPeer[index];
+    if (!peer.sckt_ok() || peer.get_gen() != gen) continue;
+    if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+      peer.set_readable(true);
+    if (events[i].events & EPOLLOUT) peer.set_writable(true);
+    activate(index); }
   
-  _now = system_clock::now();
-  for (uint u = 0; u < _max_accept; ++u) {
-    Peer &peer = _pPeer[u];
-    if (!peer.sckt_ok()) continue;
+  // Only the peers with something to do: the readable ones, and the
+  // writable ones with data to send. The others wait for an edge.
+  _busy = false;
+  size_t nactive = 0;
+  for (uint index : _active_peer) {
+    Peer &peer = _pPeer[index];
+    if (peer.sckt_ok() && peer.is_readable()) handle_recv(peer);
+    
+    bool bThrottled = false;
+    if (peer.sckt_ok() && peer.is_writable()
+	&& peer.get_stat_send() != StatSend::DoNothing) {
+      IAddrValue & value = (*_maxconn_table)[IAddrKey(peer)];
+      assert(_maxconn_table->ok());
+      if (!value.initialized()) value.reset(_maxconn_len, _now);
+      bThrottled = _maxlen_com < value.get_size_com(_now);
+      if (!bThrottled) handle_send(peer); }
     
-    if (FD_ISSET(peer.get_sckt(), &read_fds)) handle_recv(peer);
-    if (peer.sckt_ok()
-	&& FD_ISSET(peer.get_sckt(), &write_fds)) handle_send(peer); }
+    bool bRead = peer.sckt_ok() && peer.is_readable();
+    bool bSend = (peer.sckt_ok() && peer.is_writable()
+		  && peer.get_stat_send() != StatSend::DoNothing);
+    if (!bRead && !bSend) { peer.set_active(false); continue; }
+    if (bRead || !bThrottled) _busy = true;
+    _active_peer[nactive++] = index; }
+  _active_peer.resize(nactive);
   
-  if (FD_ISSET(_sckt_lstn, &read_fds)) handle_connect(); }
+  if (bConnect) handle_connect(); }
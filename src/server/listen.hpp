@@ -2,6 +2,9 @@
 // This source code is in the public domain.
 #pragma once
 #include <memory>
+#include <utility>
+#include <vector>
+#include <cstdint>
 
 template <typename K, typename V> class HashTable;
 class Listen {
@@ -14,9 +17,14 @@ class Listen {
   std::unique_ptr<struct sockaddr_in> _s_addr;
   std::unique_ptr<class AddrList> _deny_list, _ignore_list;
   std::unique_ptr<class Peer []> _pPeer;
+  std::vector<uint> _free_peer, _active_peer;
+  // timer wheel of TimeoutPlayer, one slot per second: {peer, generation}
+  std::vector<std::vector<std::pair<uint, uint>>> _wheel;
+  int64_t _wheel_sec;
   time_point_t _last_deny, _now;
-  int _sckt_lstn;
-  uint _max_accept, _max_recv, _playerTO, _selectTO_sec, _selectTO_usec;
+  int _sckt_lstn, _epfd;
+  bool _busy;
+  uint _max_accept, _max_recv, _playerTO, _selectTO;
   uint _max_send, _len_block, _maxconn_sec, _maxconn_min, _maxconn_len;
   uint _cutconn_min, _maxlen_com;
 
@@ -29,6 +37,11 @@ class Listen {
 		    int flags) noexcept;
   ssize_t recv_wrap(const Peer &peer, void *buf, size_t len,
 		    int flags) noexcept;
+  ssize_t sendfile_wrap(const Peer &peer, int fd, off_t offset,
+			size_t len) noexcept;
+  void close_peer(Peer &peer) noexcept;
+  void activate(uint index) noexcept;
+  void expire() noexcept;
   void handle_connect() noexcept;
   void handle_send(Peer &peer) noexcept;
   void handle_recv(Peer &peer) noexcept;
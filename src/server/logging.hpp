@@ -13,6 +13,7 @@ namespace OSI { class IAddr; }
 namespace Log {
   constexpr char bad_XZ_format[]      = "bad XZ format";
   constexpr char bad_CSA_format[]     = "bad CSA format";
+  constexpr char bad_pack_format[]    = "bad packed record";
   constexpr char conn_denied[]        = "connection denied";
   constexpr char record_ignored[]     = "record ignored";
   constexpr char too_many_conn_sec[]  = "too many connections in a second";
@@ -46,6 +46,7 @@ static void init() noexcept {
 			   {"MaxSend",           "65536"},
 			   {"MaxSizeCSA",        "2097152"},
 			   {"Log2LenRedundant",  "18"},
+			   {"NumRecBloom",       "67108864"},
 			   {"MinLenPlay",        "16"},
 			   {"MinAveChildren",    "3"},
 			   {"MaxConnPerAddrSec", "64"},
@@ -86,14 +87,18 @@ static void init() noexcept {
   uint minave_child = Config::get<uint> (m, "MinAveChildren");
   uint log2_redun = Config::get<uint>(m, "Log2LenRedundant",
 				      [](uint u){ return 1U < u && u < 30U; });
+  int64_t nrec_bloom = Config::get<int64_t>(m, "NumRecBloom",
+					    [](int64_t i){
+					      return 0 < i && i < (INT64_C(1)
+								   << 40); });
   
   logger.reset(new Logger(dir_log, "server", len_logarch));
   logger->out(nullptr, "start server %d.%d (usi engine %d)",
 	      Ver::major, Ver::minor, Ver::usi_engin);
   WghtKeep::get().start(logger.get(), dir_wght, wght_poll);
   RecKeep::get().start(logger.get(), dir_arch, dir_pool, size_queue,
-		       maxlen_csa, max_recv, log2_redun - 1U, minlen_play,
-		       minave_child);
+		       maxlen_csa, max_recv, log2_redun - 1U, nrec_bloom,
+		       minlen_play, minave_child);
   Listen::get().start(logger.get(), port_p, backlog, selectTO, playerTO,
 		      max_accept, max_recv, max_send, len_block, maxconn_sec,
 		      maxconn_min, cutconn_min, maxlen_com); }
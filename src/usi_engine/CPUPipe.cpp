@@ -29,6 +29,8 @@
 
 #include "config.h"
 
+#include <cstring>
+
 #ifdef __APPLE__
 #include <Accelerate/Accelerate.h>
 #endif
@@ -45,6 +47,9 @@
 #include "CPUPipe.h"
 #include "Network.h"
 #include "Im2Col.h"
+#include "Utils.h"
+
+using Utils::myprintf;
 
 #ifndef USE_BLAS
 // Eigen helpers
@@ -56,248 +61,351 @@ using ConstEigenMatrixMap =
     Eigen::Map<const Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic>>;
 #endif
 
-void CPUPipe::initialize(int channels) {
-    m_input_channels = channels;
-}
-
-void CPUPipe::winograd_transform_in(const std::vector<float>& in,
-                                    std::vector<float>& V,
-                                    const int C) {
-    constexpr auto W = BOARD_SIZE;
-    constexpr auto H = BOARD_SIZE;
-    constexpr auto WTILES = WINOGRAD_WTILES;
-    constexpr auto P = WINOGRAD_P;
-
-    constexpr auto Wpad = 2 + WINOGRAD_M * WTILES;
-
-    constexpr auto buffersize = 32;
+// Winograd input and output transforms, written once for T = float
+// (one channel at a time) and for GCC vector types of N floats (N channels
+// per instruction). V and M keep the channels innermost ([tile][P][C] and
+// [tile][P][K]) so that the N channels are loaded and stored as one vector.
+// A batch of positions is stacked along P, position i owning the tiles
+// [i*WINOGRAD_P, (i+1)*WINOGRAD_P).
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define WINOGRAD_SIMD
+#define WINOGRAD_INLINE inline __attribute__((always_inline))
+typedef float v8sf __attribute__((vector_size(32)));
+typedef float v16sf __attribute__((vector_size(64)));
+#else
+#define WINOGRAD_INLINE inline
+#endif
 
-    std::array<std::array<float, Wpad>, Wpad> in_pad{0.0f};
+namespace {
 
-    std::array<float, buffersize * WINOGRAD_ALPHA * WINOGRAD_ALPHA> buffer;
-    auto buffer_offset = 0;
-    auto buffer_entries = 0;
+constexpr auto WINOGRAD_WPAD = 2 + WINOGRAD_M * WINOGRAD_WTILES;
 
+// multiple vector [i0..i5] by Bt and produce [o0..o5]
+// const auto Bt = std::array<float, WINOGRAD_TILE>
+//           {1.0f,  0.0f,     -5.0f/2.0f,  0.0f,      1.0f, 0.0f,
+//            0.0f, -SQ2,      -2.0f,       SQ2/2.0f,  1.0f, 0.0f,
+//            0.0f,  SQ2,      -2.0f,      -SQ2/2.0f,  1.0f, 0.0f,
+//            0.0f, -SQ2/2.0f, -1.0f/2.0f,  SQ2,       1.0f, 0.0f,
+//            0.0f,  SQ2/2.0f, -1.0f/2.0f, -SQ2,       1.0f, 0.0f,
+//            0.0f,  1.0f,      0.0f,      -5.0f/2.0f, 0.0f, 1.0f};
+template <typename T>
+WINOGRAD_INLINE void multiply_bt(T* o, const T& i0, const T& i1, const T& i2,
+                                 const T& i3, const T& i4, const T& i5) {
+    const T i3m1 = i1 * -SQ2 + i3 * (SQ2 / 2.0f);
+    const T i4m2 = i2 * -2.0f + i4 * 1.0f;
 
-    // multiple vector [i0..i5] by Bt and produce [o0..o5]
-    // const auto Bt = std::array<float, WINOGRAD_TILE>
-    //           {1.0f,  0.0f,     -5.0f/2.0f,  0.0f,      1.0f, 0.0f,
-    //            0.0f, -SQ2,      -2.0f,       SQ2/2.0f,  1.0f, 0.0f,
-    //            0.0f,  SQ2,      -2.0f,      -SQ2/2.0f,  1.0f, 0.0f,
-    //            0.0f, -SQ2/2.0f, -1.0f/2.0f,  SQ2,       1.0f, 0.0f,
-    //            0.0f,  SQ2/2.0f, -1.0f/2.0f, -SQ2,       1.0f, 0.0f,
-    //            0.0f,  1.0f,      0.0f,      -5.0f/2.0f, 0.0f, 1.0f};
-    auto multiply_bt = [](
-        float & o0, float & o1, float & o2, float & o3, float & o4, float & o5,
-        float i0, float i1, float i2, float i3, float i4, float i5
-    ) {
-        auto i3m1 = i1 * -SQ2 + i3 * (SQ2 / 2.0f);
-        auto i4m2 = i2 * -2.0f + i4 * 1.0f;
+    o[0] = i0 + i2 * (-5.0f/2.0f) + i4;
+    o[1] = i3m1 + i4m2;
+    o[2] = -i3m1 + i4m2;
 
-        o0 = i0 + i2 * (-5.0f/2.0f) + i4;
-        o1 = i3m1 + i4m2;
-        o2 = -i3m1 + i4m2;
+    const T i3m1_2 = i3 * (SQ2) + i1 * (-SQ2/2.0f);
+    const T i4m2_2 = i2 * (-1.0f/2.0f) + i4;
 
-        auto i3m1_2 = i3 * (SQ2) + i1 * (-SQ2/2.0f);
-        auto i4m2_2 = i2 * (-1.0f/2.0f) + i4;
+    o[3] = i3m1_2 + i4m2_2;
+    o[4] = -i3m1_2 + i4m2_2;
 
-        o3 = i3m1_2 + i4m2_2;
-        o4 = -i3m1_2 + i4m2_2;
+    o[5] = i1 + i3 * (-5.0f/2.0f) + i5;
+}
 
-        o5 = i1 + i3 * (-5.0f/2.0f) + i5;
-    };
+// multiple vector [i0..i5] by At and produce [o0..o3]
+// const auto At = std::array<float, WINOGRAD_ALPHA * WINOGRAD_M>
+//       {1.0f, 1.0f,      1.0f,       1.0f,      1.0f,     0.0f,
+//        0.0f, SQ2/2.0f, -SQ2/2.0f,   SQ2,      -SQ2,      0.0f,
+//        0.0f, 1.0f/2.0f, 1.0f/2.0f,  2.0f,      2.0f,     0.0f,
+//        0.0f, SQ2/4.0f, -SQ2/4.0f,   2.0f*SQ2, -2.0f*SQ2, 1.0f};
+template <typename T>
+WINOGRAD_INLINE void multiply_at(T* o, const T& i0, const T& i1, const T& i2,
+                                 const T& i3, const T& i4, const T& i5) {
+    const T t1p2 = (i1 + i2) * (1.0f / 2.0f);
+    const T t1m2 = (i1 - i2) * (SQ2/4.0f);
+    const T t3p4 = i3 + i4;
+    const T t3m4 = (i3 - i4) * (SQ2);
+
+    o[0] = i0 + t1p2 + t1p2 + t3p4;
+    o[1] = t1m2 + t1m2 + t3m4;
+    o[2] = t1p2 + t3p4 + t3p4;
+    o[3] = t1m2 + t3m4 + t3m4 + i5;
+}
 
-    for (auto ch = 0; ch < C; ch++) {
-        for (auto yin = 0; yin < H; yin++) {
-            for (auto xin = 0; xin < W; xin++) {
-                in_pad[yin + 1][xin + 1] = in[ch*(W*H) + yin*W + xin];
+// Channels [ch_begin, ch_end) in groups of N. Returns the first channel
+// that was not transformed (the remainder when ch_end - ch_begin is not a
+// multiple of N).
+template <typename T, int N>
+WINOGRAD_INLINE int transform_in_channels(const float* in, float* V,
+                                          const int C,
+                                          const int batch_size,
+                                          const int ch_begin,
+                                          const int ch_end) {
+    constexpr auto W = BOARD_SIZE;
+    constexpr auto H = BOARD_SIZE;
+    constexpr auto WTILES = WINOGRAD_WTILES;
+    constexpr auto Wpad = WINOGRAD_WPAD;
+    const auto P = WINOGRAD_P * batch_size;
+
+    auto ch = ch_begin;
+    for (; ch + N <= ch_end; ch += N) {
+        for (auto pos = 0; pos < batch_size; pos++) {
+            const auto in_pos = &in[pos*C*(W*H)];
+            T in_pad[Wpad][Wpad];
+            float lanes[N];
+            for (auto y = 0; y < Wpad; y++) {
+                for (auto x = 0; x < Wpad; x++) {
+                    const auto inside = (y >= 1 && y <= H && x >= 1 && x <= W);
+                    for (auto n = 0; n < N; n++) {
+                        lanes[n] = inside ?
+                            in_pos[(ch + n)*(W*H) + (y - 1)*W + (x - 1)] : 0.0f;
+                    }
+                    std::memcpy(&in_pad[y][x], lanes, sizeof(T));
+                }
             }
-        }
-        for (auto block_y = 0; block_y < WTILES; block_y++) {
-            // Tiles overlap by 2
-            const auto yin = WINOGRAD_M * block_y;
-            for (auto block_x = 0; block_x < WTILES; block_x++) {
-                const auto xin = WINOGRAD_M * block_x;
-#define DECL_T1(XX) \
-                float T1_##XX##_0, T1_##XX##_1, T1_##XX##_2, T1_##XX##_3, T1_##XX##_4, T1_##XX##_5;
-                DECL_T1(0)
-                DECL_T1(1)
-                DECL_T1(2)
-                DECL_T1(3)
-                DECL_T1(4)
-                DECL_T1(5)
-
-                // Calculates transpose(B).x.B
-#define MULTIPLY_BT(XX) \
-                multiply_bt( \
-                    T1_0_##XX, T1_1_##XX, T1_2_##XX, T1_3_##XX, T1_4_##XX, T1_5_##XX, \
-                    in_pad[yin + 0][xin + XX], \
-                    in_pad[yin + 1][xin + XX], \
-                    in_pad[yin + 2][xin + XX], \
-                    in_pad[yin + 3][xin + XX], \
-                    in_pad[yin + 4][xin + XX], \
-                    in_pad[yin + 5][xin + XX] \
-                );
-                MULTIPLY_BT(0)
-                MULTIPLY_BT(1)
-                MULTIPLY_BT(2)
-                MULTIPLY_BT(3)
-                MULTIPLY_BT(4)
-                MULTIPLY_BT(5)
-
-#define MULTIPLY_B(XX) \
-                multiply_bt( \
-                    buffer[buffersize * (XX * WINOGRAD_ALPHA + 0) + buffer_entries], \
-                    buffer[buffersize * (XX * WINOGRAD_ALPHA + 1) + buffer_entries], \
-                    buffer[buffersize * (XX * WINOGRAD_ALPHA + 2) + buffer_entries], \
-                    buffer[buffersize * (XX * WINOGRAD_ALPHA + 3) + buffer_entries], \
-                    buffer[buffersize * (XX * WINOGRAD_ALPHA + 4) + buffer_entries], \
-                    buffer[buffersize * (XX * WINOGRAD_ALPHA + 5) + buffer_entries], \
-                    T1_##XX##_0, T1_##XX##_1, T1_##XX##_2, T1_##XX##_3, T1_##XX##_4, T1_##XX##_5 \
-                );
-                MULTIPLY_B(0)
-                MULTIPLY_B(1)
-                MULTIPLY_B(2)
-                MULTIPLY_B(3)
-                MULTIPLY_B(4)
-                MULTIPLY_B(5)
-
-                if (buffer_entries == 0) {
-                    buffer_offset = ch * P + block_y * WTILES + block_x;
+            for (auto block_y = 0; block_y < WTILES; block_y++) {
+                // Tiles overlap by 2
+                const auto yin = WINOGRAD_M * block_y;
+                for (auto block_x = 0; block_x < WTILES; block_x++) {
+                    const auto xin = WINOGRAD_M * block_x;
+                    const auto b = pos*WINOGRAD_P + block_y * WTILES + block_x;
+
+                    // Calculates transpose(B).x.B
+                    T T1[WINOGRAD_ALPHA][WINOGRAD_ALPHA];
+                    T out[WINOGRAD_ALPHA];
+                    for (auto j = 0; j < WINOGRAD_ALPHA; j++) {
+                        T col[WINOGRAD_ALPHA];
+                        multiply_bt(col,
+                                    in_pad[yin + 0][xin + j], in_pad[yin + 1][xin + j],
+                                    in_pad[yin + 2][xin + j], in_pad[yin + 3][xin + j],
+                                    in_pad[yin + 4][xin + j], in_pad[yin + 5][xin + j]);
+                        for (auto i = 0; i < WINOGRAD_ALPHA; i++) {
+                            T1[i][j] = col[i];
+                        }
+                    }
+                    for (auto i = 0; i < WINOGRAD_ALPHA; i++) {
+                        multiply_bt(out, T1[i][0], T1[i][1], T1[i][2],
+                                    T1[i][3], T1[i][4], T1[i][5]);
+                        for (auto j = 0; j < WINOGRAD_ALPHA; j++) {
+                            std::memcpy(&V[(i*WINOGRAD_ALPHA + j)*P*C + b*C + ch],
+                                        &out[j], sizeof(T));
+                        }
+                    }
                 }
-                buffer_entries++;
+            }
+        }
+    }
+    return ch;
+}
 
-                if (buffer_entries >= buffersize ||
-                    (ch == C - 1 && block_x == WTILES - 1 && block_y == WTILES - 1)) {
+// Also adds the bias (batchnorm folded in) and the residual input when
+// there is one, and applies ReLU.
+template <typename T, int N>
+WINOGRAD_INLINE int transform_out_channels(const float* M, float* Y,
+                                           const int K,
+                                           const int batch_size,
+                                           const int k_begin,
+                                           const int k_end,
+                                           const float* bias,
+                                           const float* res) {
+    constexpr auto W = BOARD_SIZE;
+    constexpr auto H = BOARD_SIZE;
+    constexpr auto WTILES = WINOGRAD_WTILES;
+    const auto P = WINOGRAD_P * batch_size;
+
+    auto k = k_begin;
+    for (; k + N <= k_end; k += N) {
+        float lanes[N];
+        T bias_k;
+        std::memcpy(&bias_k, &bias[k], sizeof(T));
+        const T zero = T{};
+        for (auto pos = 0; pos < batch_size; pos++) {
+            for (auto block_y = 0; block_y < WTILES; block_y++) {
+                const auto y = WINOGRAD_M * block_y;
+                for (auto block_x = 0; block_x < WTILES; block_x++) {
+                    const auto x = WINOGRAD_M * block_x;
+                    const auto b = pos*WINOGRAD_P + block_y * WTILES + block_x;
+
+                    T temp_m[WINOGRAD_ALPHA][WINOGRAD_ALPHA];
+                    for (auto xi = 0; xi < WINOGRAD_ALPHA; xi++) {
+                        for (auto nu = 0; nu < WINOGRAD_ALPHA; nu++) {
+                            std::memcpy(&temp_m[xi][nu],
+                                        &M[(xi*WINOGRAD_ALPHA + nu)*P*K + b*K + k],
+                                        sizeof(T));
+                        }
+                    }
 
-                    for (auto i = 0; i < WINOGRAD_ALPHA * WINOGRAD_ALPHA; i++) {
-                        for (auto entry = 0; entry < buffer_entries; entry++) {
-                            V[i*C*P + buffer_offset + entry] = buffer[i*buffersize + entry];
+                    // Calculates transpose(A).temp_m.A
+                    T temp[WINOGRAD_M][WINOGRAD_ALPHA];
+                    for (auto j = 0; j < WINOGRAD_ALPHA; j++) {
+                        T col[WINOGRAD_M];
+                        multiply_at(col, temp_m[0][j], temp_m[1][j], temp_m[2][j],
+                                    temp_m[3][j], temp_m[4][j], temp_m[5][j]);
+                        for (auto i = 0; i < WINOGRAD_M; i++) {
+                            temp[i][j] = col[i];
+                        }
+                    }
+
+                    for (auto i = 0; i < WINOGRAD_M; i++) {
+                        T o[WINOGRAD_M];
+                        multiply_at(o, temp[i][0], temp[i][1], temp[i][2],
+                                    temp[i][3], temp[i][4], temp[i][5]);
+                        for (auto j = 0; j < WINOGRAD_M; j++) {
+                            if (y + i >= H || x + j >= W) {
+                                continue;
+                            }
+                            const auto idx = (pos*K + k)*(H*W) + (y + i)*W + x + j;
+                            auto val = o[j] + bias_k;
+                            if (res != nullptr) {
+                                T res_k;
+                                for (auto n = 0; n < N; n++) {
+                                    lanes[n] = res[idx + n*(H*W)];
+                                }
+                                std::memcpy(&res_k, lanes, sizeof(T));
+                                val = val + res_k;
+                            }
+                            val = val > zero ? val : zero;
+                            std::memcpy(lanes, &val, sizeof(T));
+                            for (auto n = 0; n < N; n++) {
+                                Y[idx + n*(H*W)] = lanes[n];
+                            }
                         }
                     }
-                    buffer_entries = 0;
                 }
             }
         }
     }
+    return k;
+}
+
+#ifdef WINOGRAD_SIMD
+// The target attribute lets these be built for AVX2/AVX-512 whatever -march
+// says. They are picked at run time by CPUPipe::initialize().
+__attribute__((target("avx2")))
+int transform_in_avx2(const float* in, float* V, const int C,
+                     const int batch_size) {
+    return transform_in_channels<v8sf, 8>(in, V, C, batch_size, 0, C);
+}
+
+__attribute__((target("avx2")))
+int transform_out_avx2(const float* M, float* Y, const int K,
+                      const int batch_size,
+                      const float* bias, const float* res) {
+    return transform_out_channels<v8sf, 8>(M, Y, K, batch_size, 0, K,
+                                         bias, res);
+}
+
+__attribute__((target("avx512f")))
+int transform_in_avx512(const float* in, float* V, const int C,
+                       const int batch_size) {
+    return transform_in_channels<v16sf, 16>(in, V, C, batch_size, 0, C);
+}
+
+__attribute__((target("avx512f")))
+int transform_out_avx512(const float* M, float* Y, const int K,
+                        const int batch_size,
+                        const float* bias, const float* res) {
+    return transform_out_channels<v16sf, 16>(M, Y, K, batch_size, 0, K,
+                                           bias, res);
+}
+#endif
+
+}
+
+void CPUPipe::initialize(int channels) {
+    m_input_channels = channels;
+
+    m_simd = Simd::NONE;
+#ifdef WINOGRAD_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+        m_simd = Simd::AVX512;
+    } else if (__builtin_cpu_supports("avx2")) {
+        m_simd = Simd::AVX2;
+    }
+#endif
+    const char* simd_names[] = {"scalar", "AVX2", "AVX-512"};
+    myprintf("CPU Winograd transforms: %s\n", simd_names[static_cast<int>(m_simd)]);
+}
+
+void CPUPipe::winograd_transform_in(const std::vector<float>& in,
+                                    std::vector<float>& V,
+                                    const int C,
+                                    const int batch_size) {
+    auto ch = 0;
+#ifdef WINOGRAD_SIMD
+    if (m_simd == Simd::AVX512) {
+        ch = transform_in_avx512(in.data(), V.data(), C, batch_size);
+    } else if (m_simd == Simd::AVX2) {
+        ch = transform_in_avx2(in.data(), V.data(), C, batch_size);
+    }
+#endif
+    // The channels left over by the SIMD variant
+    transform_in_channels<float, 1>(in.data(), V.data(), C, batch_size,
+                                    ch, C);
 }
 
 void CPUPipe::winograd_sgemm(const std::vector<float>& U,
                              const std::vector<float>& V,
                              std::vector<float>& M,
-                             const int C, const int K) {
-    constexpr auto P = WINOGRAD_P;
+                             const int C, const int K,
+                             const int batch_size) {
+    // All the positions of the batch go through one sgemm per tile
+    const auto P = WINOGRAD_P * batch_size;
 
+    // M[P][K] = V[P][C] x U[C][K] for each of the tiles
     for (auto b = 0; b < WINOGRAD_TILE; b++) {
         const auto offset_u = b * K * C;
         const auto offset_v = b * C * P;
         const auto offset_m = b * K * P;
 #ifdef USE_BLAS
-        cblas_sgemm(CblasRowMajor, CblasTrans, CblasNoTrans,
-                    K, P, C,
+        cblas_sgemm(CblasRowMajor, CblasNoTrans, CblasNoTrans,
+                    P, K, C,
                     1.0f,
+                    &V[offset_v], C,
                     &U[offset_u], K,
-                    &V[offset_v], P,
                     0.0f,
-                    &M[offset_m], P);
+                    &M[offset_m], K);
 #else
-        auto C_mat = EigenMatrixMap<float>(M.data() + offset_m, P, K);
+        auto C_mat = EigenMatrixMap<float>(M.data() + offset_m, K, P);
         C_mat.noalias() =
-           ConstEigenMatrixMap<float>(V.data() + offset_v, P, C)
-            * ConstEigenMatrixMap<float>(U.data() + offset_u, K, C).transpose();
+           ConstEigenMatrixMap<float>(U.data() + offset_u, K, C)
+            * ConstEigenMatrixMap<float>(V.data() + offset_v, C, P);
 #endif
     }
 }
 
 void CPUPipe::winograd_transform_out(const std::vector<float>& M,
                                      std::vector<float>& Y,
-                                     const int K) {
-    constexpr auto W = BOARD_SIZE;
-    constexpr auto H = BOARD_SIZE;
-    constexpr auto WTILES = WINOGRAD_WTILES;
-    constexpr auto P = WINOGRAD_P;
-
-    // multiple vector [i0..i5] by At and produce [o0..o3]
-    // const auto At = std::array<float, WINOGRAD_ALPHA * WINOGRAD_M>
-    //       {1.0f, 1.0f,      1.0f,       1.0f,      1.0f,     0.0f,
-    //        0.0f, SQ2/2.0f, -SQ2/2.0f,   SQ2,      -SQ2,      0.0f,
-    //        0.0f, 1.0f/2.0f, 1.0f/2.0f,  2.0f,      2.0f,     0.0f,
-    //        0.0f, SQ2/4.0f, -SQ2/4.0f,   2.0f*SQ2, -2.0f*SQ2, 1.0f};
-    auto multiply_at = [](
-        float & o0, float & o1, float & o2, float & o3,
-        float i0, float i1, float i2, float i3, float i4, float i5
-    ) {
-        auto t1p2 = (i1 + i2) * (1.0f / 2.0f);
-        auto t1m2 = (i1 - i2) * (SQ2/4.0f);
-        auto t3p4 = i3 + i4;
-        auto t3m4 = (i3 - i4) * (SQ2);
-
-        o0 = i0 + t1p2 + t1p2 + t3p4;
-        o1 = t1m2 + t1m2 + t3m4;
-        o2 = t1p2 + t3p4 + t3p4;
-        o3 = t1m2 + t3m4 + t3m4 + i5;
-    };
-
-    for (auto k = 0; k < K; k++) {
-        for (auto block_x = 0; block_x < WTILES; block_x++) {
-            const auto x = WINOGRAD_M * block_x;
-            for (auto block_y = 0; block_y < WTILES; block_y++) {
-                const auto y = WINOGRAD_M * block_y;
-
-                const auto b = block_y * WTILES + block_x;
-                using WinogradTile =
-                    std::array<std::array<float, WINOGRAD_ALPHA>, WINOGRAD_ALPHA>;
-                WinogradTile temp_m;
-                for (auto xi = 0; xi < WINOGRAD_ALPHA; xi++) {
-                    for (auto nu = 0; nu < WINOGRAD_ALPHA; nu++) {
-                        temp_m[xi][nu] =
-                            M[(xi*WINOGRAD_ALPHA + nu)*K*P + k*P + b];
-                    }
-                }
-                std::array<std::array<float, WINOGRAD_ALPHA>, WINOGRAD_M> temp;
-                std::array<std::array<float, WINOGRAD_M>, WINOGRAD_M> o;
-
-                // Calculates transpose(A).temp_m.A
-                for (auto j = 0; j < WINOGRAD_ALPHA; j++){
-                    multiply_at(
-                        temp[0][j], temp[1][j], temp[2][j], temp[3][j],
-                        temp_m[0][j], temp_m[1][j], temp_m[2][j], temp_m[3][j], temp_m[4][j], temp_m[5][j]
-                    );
-                }
-
-                for (auto i = 0; i < WINOGRAD_M; i++){
-                    multiply_at(
-                        o[i][0], o[i][1], o[i][2], o[i][3],
-                        temp[i][0], temp[i][1], temp[i][2], temp[i][3], temp[i][4], temp[i][5]
-                    );
-                }
-
-                const auto y_ind = k * H * W + y * W + x;
-                for (auto i = 0; i < WINOGRAD_M; i++) {
-                    for (auto j = 0; j < WINOGRAD_M; j++) {
-                        if (y + i < H && x + j < W) {
-                            Y[y_ind + i * W + j] = o[i][j];
-                        }
-                    }
-                }
-            }
-        }
+                                     const int K,
+                                     const int batch_size,
+                                     const std::vector<float>& bias,
+                                     const float* res) {
+    auto k = 0;
+#ifdef WINOGRAD_SIMD
+    if (m_simd == Simd::AVX512) {
+        k = transform_out_avx512(M.data(), Y.data(), K, batch_size,
+                                 bias.data(), res);
+    } else if (m_simd == Simd::AVX2) {
+        k = transform_out_avx2(M.data(), Y.data(), K, batch_size,
+                               bias.data(), res);
     }
+#endif
+    transform_out_channels<float, 1>(M.data(), Y.data(), K, batch_size,
+                                     k, K, bias.data(), res);
 }
 
 void CPUPipe::winograd_convolve3(const int outputs,
                                  const std::vector<float>& input,
                                  const std::vector<float>& U,
+                                 const std::vector<float>& bias,
                                  std::vector<float>& V,
                                  std::vector<float>& M,
-                                 std::vector<float>& output) {
+                                 std::vector<float>& output,
+                                 const int batch_size,
+                                 const float* res) {
 
     constexpr unsigned int filter_len = WINOGRAD_ALPHA * WINOGRAD_ALPHA;
     const auto input_channels = U.size() / (outputs * filter_len);
 
-    winograd_transform_in(input, V, input_channels);
-    winograd_sgemm(U, V, M, input_channels, outputs);
-    winograd_transform_out(M, output, outputs);
+    winograd_transform_in(input, V, input_channels, batch_size);
+    winograd_sgemm(U, V, M, input_channels, outputs, batch_size);
+    winograd_transform_out(M, output, outputs, batch_size, bias, res);
 }
 
 template<unsigned int filter_size>
@@ -351,39 +459,18 @@ void convolve(const size_t outputs,
     }
 }
 
-template <size_t spatial_size>
-void batchnorm(const size_t channels,
-               std::vector<float>& data,
-               const float* const means,
-               const float* const stddevs,
-               const float* const eltwise = nullptr) {
-    const auto lambda_ReLU = [](const auto val) { return (val > 0.0f) ?
-                                                          val : 0.0f; };
-    for (auto c = size_t{0}; c < channels; ++c) {
-        const auto mean = means[c];
-        const auto scale_stddev = stddevs[c];
-        const auto arr = &data[c * spatial_size];
-
-        if (eltwise == nullptr) {
-            // Classical BN
-            for (auto b = size_t{0}; b < spatial_size; b++) {
-                arr[b] = lambda_ReLU(scale_stddev * (arr[b] - mean));
-            }
-        } else {
-            // BN + residual add
-            const auto res = &eltwise[c * spatial_size];
-            for (auto b = size_t{0}; b < spatial_size; b++) {
-                arr[b] = lambda_ReLU((scale_stddev * (arr[b] - mean)) + res[b]);
-            }
-        }
-    }
-}
-
 void CPUPipe::forward(const std::vector<float>& input,
                       std::vector<float>& output_pol,
                       std::vector<float>& output_val) {
+    forward_batch(input, output_pol, output_val, 1);
+}
+
+void CPUPipe::forward_batch(const std::vector<float>& input,
+                            std::vector<float>& output_pol,
+                            std::vector<float>& output_val,
+                            const size_t batch_size) {
     // Input convolution
-    constexpr auto P = WINOGRAD_P;
+    const auto P = WINOGRAD_P * batch_size;
     // Calculate output channels
     const auto output_channels = m_input_channels;
     // input_channels is the maximum number of input channels of any
@@ -391,39 +478,134 @@ void CPUPipe::forward(const std::vector<float>& input,
     // might be bigger when the network has very few filters
     const auto input_channels = std::max(static_cast<size_t>(output_channels),
                                          static_cast<size_t>(Network::INPUT_CHANNELS));
-    auto conv_out = std::vector<float>(output_channels * NUM_INTERSECTIONS);
+    const auto batch = static_cast<int>(batch_size);
+    auto conv_out = std::vector<float>(batch_size * output_channels * NUM_INTERSECTIONS);
 
     auto V = std::vector<float>(WINOGRAD_TILE * input_channels * P);
     auto M = std::vector<float>(WINOGRAD_TILE * output_channels * P);
 
-    winograd_convolve3(output_channels, input, m_weights->m_conv_weights[0], V, M, conv_out);
-    batchnorm<NUM_INTERSECTIONS>(output_channels, conv_out,
-                                 m_weights->m_batchnorm_means[0].data(),
-                                 m_weights->m_batchnorm_stddevs[0].data());
+    // Batchnorm, residual add and ReLU are done by the output transform
+    winograd_convolve3(output_channels, input, m_conv_weights[0],
+                       m_conv_biases[0], V, M, conv_out, batch);
+
+    forward_tower(conv_out, output_pol, output_val, batch_size);
+}
+
+// Border class of a square: 0, 1, 2 for the top, middle and bottom rows,
+// times 3, plus the same for the columns. The constant planes contribute
+// the same to all the squares of one class.
+static int border_class(const int y, const int x) {
+    const auto ry = y == 0 ? 0 : (y == BOARD_SIZE - 1 ? 2 : 1);
+    const auto rx = x == 0 ? 0 : (x == BOARD_SIZE - 1 ? 2 : 1);
+    return ry * 3 + rx;
+}
+
+void CPUPipe::sparse_convolve3(const SparseInput& input, float* output) {
+    const auto K = m_input_channels;
+    auto fill = std::vector<float>(9 * K);
+    auto acc = std::vector<float>(NUM_INTERSECTIONS * K);
+
+    for (auto c = 0; c < SparseInput::CHANNELS; c++) {
+        const auto v = input.m_fill[c];
+        if (v == 0.0f) continue;
+        const auto w = &m_sparse_fill_w[c * 9 * K];
+        for (auto j = 0; j < 9 * K; j++) {
+            fill[j] += v * w[j];
+        }
+    }
+    for (auto y = 0; y < BOARD_SIZE; y++) {
+        for (auto x = 0; x < BOARD_SIZE; x++) {
+            const auto f = &fill[border_class(y, x) * K];
+            std::copy(f, f + K, &acc[(y * BOARD_SIZE + x) * K]);
+        }
+    }
+
+    // A 1 at (sy, sx) reaches the output (sy - ky + 1, sx - kx + 1)
+    // through tap ky * 3 + kx
+    for (auto i = 0; i < input.m_num_ones; i++) {
+        const auto c = input.m_ones[i] / NUM_INTERSECTIONS;
+        const auto s = input.m_ones[i] % NUM_INTERSECTIONS;
+        const auto sy = s / BOARD_SIZE;
+        const auto sx = s % BOARD_SIZE;
+        for (auto ky = 0; ky < 3; ky++) {
+            const auto y = sy - ky + 1;
+            if (y < 0 || y >= BOARD_SIZE) continue;
+            for (auto kx = 0; kx < 3; kx++) {
+                const auto x = sx - kx + 1;
+                if (x < 0 || x >= BOARD_SIZE) continue;
+                const auto w = &m_sparse_w[(c * 9 + ky * 3 + kx) * K];
+                const auto a = &acc[(y * BOARD_SIZE + x) * K];
+                for (auto k = 0; k < K; k++) {
+                    a[k] += w[k];
+                }
+            }
+        }
+    }
+
+    const auto& bias = m_conv_biases[0];
+    for (auto k = 0; k < K; k++) {
+        for (auto p = 0; p < NUM_INTERSECTIONS; p++) {
+            const auto v = acc[p * K + k] + bias[k];
+            output[k * NUM_INTERSECTIONS + p] = v > 0.0f ? v : 0.0f;
+        }
+    }
+}
+
+void CPUPipe::forward_sparse(const SparseInput* input,
+                             std::vector<float>& output_pol,
+                             std::vector<float>& output_val,
+                             const size_t batch_size) {
+    const auto conv_size = m_input_channels * NUM_INTERSECTIONS;
+    auto conv_out = std::vector<float>(batch_size * conv_size);
+    for (auto i = size_t{0}; i < batch_size; i++) {
+        sparse_convolve3(input[i], conv_out.data() + conv_size * i);
+    }
+    forward_tower(conv_out, output_pol, output_val, batch_size);
+}
+
+void CPUPipe::forward_tower(std::vector<float>& conv_out,
+                            std::vector<float>& output_pol,
+                            std::vector<float>& output_val,
+                            const size_t batch_size) {
+    const auto P = WINOGRAD_P * batch_size;
+    const auto output_channels = m_input_channels;
+    const auto batch = static_cast<int>(batch_size);
+    auto V = std::vector<float>(WINOGRAD_TILE * output_channels * P);
+    auto M = std::vector<float>(WINOGRAD_TILE * output_channels * P);
 
     // Residual tower
-    auto conv_in = std::vector<float>(output_channels * NUM_INTERSECTIONS);
-    auto res = std::vector<float>(output_channels * NUM_INTERSECTIONS);
-    for (auto i = size_t{1}; i < m_weights->m_conv_weights.size(); i += 2) {
+    auto conv_in = std::vector<float>(batch_size * output_channels * NUM_INTERSECTIONS);
+    auto res = std::vector<float>(batch_size * output_channels * NUM_INTERSECTIONS);
+    for (auto i = size_t{1}; i < m_conv_weights.size(); i += 2) {
         auto output_channels = m_input_channels;
         std::swap(conv_out, conv_in);
-        winograd_convolve3(output_channels, conv_in,
-                           m_weights->m_conv_weights[i], V, M, conv_out);
-        batchnorm<NUM_INTERSECTIONS>(output_channels, conv_out,
-                                     m_weights->m_batchnorm_means[i].data(),
-                                     m_weights->m_batchnorm_stddevs[i].data());
+        winograd_convolve3(output_channels, conv_in, m_conv_weights[i],
+                           m_conv_biases[i], V, M, conv_out, batch);
 
         std::swap(conv_in, res);
         std::swap(conv_out, conv_in);
-        winograd_convolve3(output_channels, conv_in,
-                           m_weights->m_conv_weights[i + 1], V, M, conv_out);
-        batchnorm<NUM_INTERSECTIONS>(output_channels, conv_out,
-                                     m_weights->m_batchnorm_means[i + 1].data(),
-                                     m_weights->m_batchnorm_stddevs[i + 1].data(),
-                                     res.data());
+        winograd_convolve3(output_channels, conv_in, m_conv_weights[i + 1],
+                           m_conv_biases[i + 1], V, M, conv_out, batch,
+                           res.data());
+    }
+
+    // The 1x1 heads are cheap, run them one position at a time
+    const auto conv_size = output_channels * NUM_INTERSECTIONS;
+    const auto out_pol_size = output_pol.size() / batch_size;
+    const auto out_val_size = output_val.size() / batch_size;
+    auto pos_in = std::vector<float>(conv_size);
+    auto pos_pol = std::vector<float>(out_pol_size);
+    auto pos_val = std::vector<float>(out_val_size);
+    for (auto i = size_t{0}; i < batch_size; i++) {
+        std::copy(begin(conv_out) + conv_size * i,
+                  begin(conv_out) + conv_size * (i + 1), begin(pos_in));
+        convolve<1>(Network::OUTPUTS_POLICY, pos_in, m_conv_pol_w, m_conv_pol_b, pos_pol);
+        convolve<1>(Network::OUTPUTS_VALUE, pos_in, m_conv_val_w, m_conv_val_b, pos_val);
+        std::copy(begin(pos_pol), end(pos_pol),
+                  begin(output_pol) + out_pol_size * i);
+        std::copy(begin(pos_val), end(pos_val),
+                  begin(output_val) + out_val_size * i);
     }
-    convolve<1>(Network::OUTPUTS_POLICY, conv_out, m_conv_pol_w, m_conv_pol_b, output_pol);
-    convolve<1>(Network::OUTPUTS_VALUE, conv_out, m_conv_val_w, m_conv_val_b, output_val);
 }
 
 void CPUPipe::push_weights(unsigned int /*filter_size*/,
@@ -431,7 +613,58 @@ void CPUPipe::push_weights(unsigned int /*filter_size*/,
                            unsigned int outputs,
                            std::shared_ptr<const ForwardPipeWeights> weights) {
 
-    m_weights = weights;
+    // Fold batchnorm into the transformed filters: each output channel k
+    // of U is scaled by stddev[k], and -stddev[k] * mean[k] becomes its bias.
+    // The conv biases were already moved into the means by prepare_weights().
+    const auto layers = weights->m_conv_weights.size();
+    m_conv_weights.resize(layers);
+    m_conv_biases.resize(layers);
+    for (auto i = size_t{0}; i < layers; i++) {
+        const auto& means = weights->m_batchnorm_means[i];
+        const auto& stddevs = weights->m_batchnorm_stddevs[i];
+        const auto K = means.size();
+        auto& U = m_conv_weights[i];
+        U = weights->m_conv_weights[i];
+        for (auto j = size_t{0}; j < U.size(); j++) {
+            U[j] *= stddevs[j % K];
+        }
+        auto& bias = m_conv_biases[i];
+        bias.resize(K);
+        for (auto k = size_t{0}; k < K; k++) {
+            bias[k] = -stddevs[k] * means[k];
+        }
+    }
+
+    // The input convolution of forward_sparse() works on the 3x3 filters
+    const auto K = static_cast<int>(outputs);
+    const auto C = static_cast<int>(m_conv_weights[0].size() / (WINOGRAD_TILE * K));
+    const auto f = Network::winograd_inverse_f(m_conv_weights[0], K, C);
+    m_sparse_w.resize(C * 9 * K);
+    m_sparse_fill_w.assign(C * 9 * K, 0.0f);
+    for (auto c = 0; c < C; c++) {
+        for (auto t = 0; t < 9; t++) {
+            for (auto k = 0; k < K; k++) {
+                m_sparse_w[(c * 9 + t) * K + k] = f[(k * C + c) * 9 + t];
+            }
+        }
+        for (auto y = 0; y < 3; y++) {
+            for (auto x = 0; x < 3; x++) {
+                // Row y = 0 (top) has nothing above it, so its taps ky = 0
+                // fall off the board, and likewise for the other borders
+                const auto cls = y * 3 + x;
+                for (auto ky = 0; ky < 3; ky++) {
+                    if ((y == 0 && ky == 0) || (y == 2 && ky == 2)) continue;
+                    for (auto kx = 0; kx < 3; kx++) {
+                        if ((x == 0 && kx == 0) || (x == 2 && kx == 2)) continue;
+                        for (auto k = 0; k < K; k++) {
+                            m_sparse_fill_w[(c * 9 + cls) * K + k] +=
+                                m_sparse_w[(c * 9 + ky * 3 + kx) * K + k];
+                        }
+                    }
+                }
+            }
+        }
+    }
 
     // Output head convolutions
     m_conv_pol_w = weights->m_conv_pol_w;
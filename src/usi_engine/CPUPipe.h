@@ -44,37 +44,77 @@ public:
     virtual void forward(const std::vector<float>& input,
                          std::vector<float>& output_pol,
                          std::vector<float>& output_val);
+    // Runs the whole batch through each layer at once, the Winograd tiles
+    // of all the positions stacked in one sgemm.
+    virtual void forward_batch(const std::vector<float>& input,
+                               std::vector<float>& output_pol,
+                               std::vector<float>& output_val,
+                               const size_t batch_size);
+    // Same, with the input convolution done directly from the active
+    // (plane, square) pairs instead of a Winograd convolution.
+    virtual void forward_sparse(const SparseInput* input,
+                                std::vector<float>& output_pol,
+                                std::vector<float>& output_val,
+                                const size_t batch_size);
 
     virtual void push_weights(unsigned int filter_size,
                               unsigned int channels,
                               unsigned int outputs,
                               std::shared_ptr<const ForwardPipeWeights> weights);
 private:
+    // Residual tower and heads, from the output of the input convolution
+    void forward_tower(std::vector<float>& conv_out,
+                       std::vector<float>& output_pol,
+                       std::vector<float>& output_val,
+                       const size_t batch_size);
+
+    void sparse_convolve3(const SparseInput& input, float* output);
+
     void winograd_transform_in(const std::vector<float>& in,
                                std::vector<float>& V,
-                               const int C);
+                               const int C,
+                               const int batch_size);
 
     void winograd_sgemm(const std::vector<float>& U,
                         const std::vector<float>& V,
                         std::vector<float>& M,
-                        const int C, const int K);
+                        const int C, const int K,
+                        const int batch_size);
 
     void winograd_transform_out(const std::vector<float>& M,
                                 std::vector<float>& Y,
-                                const int K);
+                                const int K,
+                                const int batch_size,
+                                const std::vector<float>& bias,
+                                const float* res);
 
     void winograd_convolve3(const int outputs,
                             const std::vector<float>& input,
                             const std::vector<float>& U,
+                            const std::vector<float>& bias,
                             std::vector<float>& V,
                             std::vector<float>& M,
-                            std::vector<float>& output);
+                            std::vector<float>& output,
+                            const int batch_size,
+                            const float* res = nullptr);
 
 
     int m_input_channels;
 
-    // Input + residual block tower
-    std::shared_ptr<const ForwardPipeWeights> m_weights;
+    // Instruction set used by the Winograd transforms, picked at run time
+    enum class Simd { NONE, AVX2, AVX512 };
+    Simd m_simd{Simd::NONE};
+
+    // Input + residual block tower, with batchnorm folded in
+    std::vector<std::vector<float>> m_conv_weights;
+    std::vector<std::vector<float>> m_conv_biases;
+
+    // Input convolution of forward_sparse(): the folded 3x3 filters as
+    // [plane][tap][K], and for the planes with one value on the whole
+    // board, the sum of the taps that stay on the board as
+    // [plane][border class][K].
+    std::vector<float> m_sparse_w;
+    std::vector<float> m_sparse_fill_w;
 
     std::vector<float> m_conv_pol_w;
     std::vector<float> m_conv_val_w;
@@ -0,0 +1,227 @@
+// 2019 Team AobaZero
+// This is a work derived from Leela Zero (May 1, 2019).
+/*
+    This file is part of Leela Zero.
+    Copyright (C) 2018-2019 Junhee Yoo and contributors
+
+    Leela Zero is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Leela Zero is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Leela Zero.  If not, see <http://www.gnu.org/licenses/>.
+
+    Additional permission under GNU GPL version 3 section 7
+
+    If you modify this Program, or any covered work, by linking or
+    combining it with NVIDIA Corporation's libraries from the
+    NVIDIA CUDA Toolkit and/or the NVIDIA CUDA Deep Neural
+    Network library and/or the NVIDIA TensorRT inference library
+    (or a modified version of those libraries), containing parts covered
+    by the terms of the respective license agreement, the licensors of
+    this Program grant you additional permission to convey the resulting
+    work.
+*/
+#include "config.h"
+
+#include <algorithm>
+#include <iterator>
+
+#include "GTP.h"
+#include "Network.h"
+#include "Utils.h"
+#include "CPUScheduler.h"
+
+using Utils::myprintf;
+
+CPUScheduler::CPUScheduler(std::unique_ptr<ForwardPipe> pipe)
+    : m_pipe(std::move(pipe)) {
+}
+
+CPUScheduler::~CPUScheduler() {
+    {
+        std::unique_lock<std::mutex> lk(m_mutex);
+        m_running = false;
+    }
+    m_cv.notify_all();
+    for (auto & x : m_worker_threads) {
+        x.join();
+    }
+}
+
+void CPUScheduler::initialize(const int channels) {
+    m_pipe->initialize(channels);
+
+    // One worker per core, but no more than there are search threads to
+    // feed them. The batches form while all the workers are busy.
+    auto num_worker_threads = std::max(1u, std::thread::hardware_concurrency());
+    num_worker_threads = std::min(num_worker_threads, cfg_num_threads);
+    num_worker_threads = std::max(num_worker_threads, 1u);
+    for (auto i = unsigned{0}; i < num_worker_threads; i++) {
+        m_worker_threads.emplace_back(&CPUScheduler::batch_worker, this);
+    }
+    myprintf("CPUScheduler. workers=%d, batch size=%d\n",
+             num_worker_threads, cfg_batch_size);
+}
+
+void CPUScheduler::push_weights(unsigned int filter_size,
+                                unsigned int channels,
+                                unsigned int outputs,
+                                std::shared_ptr<const ForwardPipeWeights> weights) {
+    m_pipe->push_weights(filter_size, channels, outputs, weights);
+}
+
+void CPUScheduler::forward(const std::vector<float>& input,
+                           std::vector<float>& output_pol,
+                           std::vector<float>& output_val) {
+    forward_batch(input, output_pol, output_val, 1);
+}
+
+void CPUScheduler::forward_batch(const std::vector<float>& input,
+                                 std::vector<float>& output_pol,
+                                 std::vector<float>& output_val,
+                                 const size_t batch_size) {
+    const auto in_size = input.size() / batch_size;
+    const auto out_pol_size = output_pol.size() / batch_size;
+    const auto out_val_size = output_val.size() / batch_size;
+
+    // Each position is queued on its own so that a worker can put it in
+    // the same batch as the positions of other search threads.
+    auto entries = std::vector<std::shared_ptr<ForwardQueueEntry>>();
+    for (auto i = size_t{0}; i < batch_size; i++) {
+        entries.push_back(std::make_shared<ForwardQueueEntry>(
+                              input.data() + in_size * i, nullptr,
+                              output_pol.data() + out_pol_size * i,
+                              output_val.data() + out_val_size * i));
+    }
+    enqueue_and_wait(entries);
+}
+
+void CPUScheduler::forward_sparse(const SparseInput* input,
+                                  std::vector<float>& output_pol,
+                                  std::vector<float>& output_val,
+                                  const size_t batch_size) {
+    const auto out_pol_size = output_pol.size() / batch_size;
+    const auto out_val_size = output_val.size() / batch_size;
+
+    // The worker hands them to the pipe as they are.
+    auto entries = std::vector<std::shared_ptr<ForwardQueueEntry>>();
+    for (auto i = size_t{0}; i < batch_size; i++) {
+        entries.push_back(std::make_shared<ForwardQueueEntry>(
+                              nullptr, input + i,
+                              output_pol.data() + out_pol_size * i,
+                              output_val.data() + out_val_size * i));
+    }
+    enqueue_and_wait(entries);
+}
+
+void CPUScheduler::enqueue_and_wait(
+    std::vector<std::shared_ptr<ForwardQueueEntry>>& entries) {
+    {
+        std::unique_lock<std::mutex> lk(m_mutex);
+        for (auto & entry : entries) {
+            m_forward_queue.push_back(entry);
+        }
+    }
+    m_cv.notify_one();
+
+    for (auto & entry : entries) {
+        std::unique_lock<std::mutex> lk(entry->mutex);
+        entry->cv.wait(lk, [&entry] () { return entry->done; });
+    }
+}
+
+void CPUScheduler::batch_worker() {
+    constexpr auto in_size = Network::INPUT_CHANNELS * BOARD_SIZE * BOARD_SIZE;
+    constexpr auto out_pol_size = Network::OUTPUTS_POLICY * BOARD_SIZE * BOARD_SIZE;
+    constexpr auto out_val_size = Network::OUTPUTS_VALUE * BOARD_SIZE * BOARD_SIZE;
+
+    // Unlike OpenCLScheduler there is no waiting for a full batch: the
+    // core would sit idle meanwhile. A worker takes whatever has been
+    // queued (up to cfg_batch_size), and the positions that arrive while
+    // it computes make up the next batch.
+    auto pickup_task = [this] () {
+        std::list<std::shared_ptr<ForwardQueueEntry>> inputs;
+
+        std::unique_lock<std::mutex> lk(m_mutex);
+        m_cv.wait(lk, [this] () {
+            return !m_running || !m_forward_queue.empty();
+        });
+        if (!m_running) return inputs;
+
+        auto count = std::min(m_forward_queue.size(),
+                              static_cast<size_t>(std::max(cfg_batch_size, 1u)));
+        auto end = begin(m_forward_queue);
+        std::advance(end, count);
+        std::move(begin(m_forward_queue), end, std::back_inserter(inputs));
+        m_forward_queue.erase(begin(m_forward_queue), end);
+        if (!m_forward_queue.empty()) {
+            m_cv.notify_one();
+        }
+        return inputs;
+    };
+
+    auto batch_input = std::vector<float>();
+    auto batch_sparse = std::vector<SparseInput>();
+    auto batch_output_pol = std::vector<float>();
+    auto batch_output_val = std::vector<float>();
+
+    while (true) {
+        auto inputs = pickup_task();
+        auto count = inputs.size();
+
+        if (count == 0) {
+            return;
+        }
+
+        batch_output_pol.resize(out_pol_size * count);
+        batch_output_val.resize(out_val_size * count);
+
+        // A batch of sparse inputs goes to forward_sparse() as it is,
+        // otherwise the sparse ones are expanded for forward_batch()
+        auto all_sparse = std::all_of(begin(inputs), end(inputs),
+            [] (const std::shared_ptr<ForwardQueueEntry>& x) { return x->in == nullptr; });
+        auto index = size_t{0};
+        if (all_sparse) {
+            batch_sparse.resize(count);
+            for (auto & x : inputs) {
+                batch_sparse[index++] = *x->sparse;
+            }
+            m_pipe->forward_sparse(batch_sparse.data(), batch_output_pol, batch_output_val, count);
+        } else {
+            batch_input.resize(in_size * count);
+            for (auto & x : inputs) {
+                if (x->in != nullptr) {
+                    std::copy(x->in, x->in + in_size, begin(batch_input) + in_size * index);
+                } else {
+                    x->sparse->expand(batch_input.data() + in_size * index);
+                }
+                index++;
+            }
+            m_pipe->forward_batch(batch_input, batch_output_pol, batch_output_val, count);
+        }
+
+        // Get output and copy back
+        index = 0;
+        for (auto & x : inputs) {
+            std::copy(begin(batch_output_pol) + out_pol_size * index,
+                      begin(batch_output_pol) + out_pol_size * (index + 1),
+                      x->out_p);
+            std::copy(begin(batch_output_val) + out_val_size * index,
+                      begin(batch_output_val) + out_val_size * (index + 1),
+                      x->out_v);
+            {
+                std::unique_lock<std::mutex> lk(x->mutex);
+                x->done = true;
+            }
+            x->cv.notify_all();
+            index++;
+        }
+    }
+}
@@ -0,0 +1,99 @@
+// 2019 Team AobaZero
+// This is a work derived from Leela Zero (May 1, 2019).
+/*
+    This file is part of Leela Zero.
+    Copyright (C) 2018-2019 Junhee Yoo and contributors
+
+    Leela Zero is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Leela Zero is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Leela Zero.  If not, see <http://www.gnu.org/licenses/>.
+
+    Additional permission under GNU GPL version 3 section 7
+
+    If you modify this Program, or any covered work, by linking or
+    combining it with NVIDIA Corporation's libraries from the
+    NVIDIA CUDA Toolkit and/or the NVIDIA CUDA Deep Neural
+    Network library and/or the NVIDIA TensorRT inference library
+    (or a modified version of those libraries), containing parts covered
+    by the terms of the respective license agreement, the licensors of
+    this Program grant you additional permission to convey the resulting
+    work.
+*/
+
+#ifndef CPUSCHEDULER_H_INCLUDED
+#define CPUSCHEDULER_H_INCLUDED
+#include "config.h"
+
+#include <condition_variable>
+#include <list>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "ForwardPipe.h"
+
+// Collects the evaluations of the search threads into batches for the
+// forward_batch() of a CPU pipe (CPUPipe or Int8Pipe), like
+// OpenCLScheduler does for the GPUs.
+class CPUScheduler : public ForwardPipe {
+    class ForwardQueueEntry {
+    public:
+        std::mutex mutex;
+        std::condition_variable cv;
+        const float* in;
+        const SparseInput* sparse;  // used when in is nullptr
+        float* out_p;
+        float* out_v;
+        bool done{false};
+        ForwardQueueEntry(const float* input,
+                          const SparseInput* input_sparse,
+                          float* output_pol,
+                          float* output_val)
+        : in(input), sparse(input_sparse), out_p(output_pol), out_v(output_val)
+          {}
+    };
+public:
+    CPUScheduler(std::unique_ptr<ForwardPipe> pipe);
+    virtual ~CPUScheduler();
+
+    virtual void initialize(const int channels);
+    virtual void forward(const std::vector<float>& input,
+                         std::vector<float>& output_pol,
+                         std::vector<float>& output_val);
+    virtual void forward_batch(const std::vector<float>& input,
+                               std::vector<float>& output_pol,
+                               std::vector<float>& output_val,
+                               const size_t batch_size);
+    virtual void forward_sparse(const SparseInput* input,
+                                std::vector<float>& output_pol,
+                                std::vector<float>& output_val,
+                                const size_t batch_size);
+    virtual void push_weights(unsigned int filter_size,
+                              unsigned int channels,
+                              unsigned int outputs,
+                              std::shared_ptr<const ForwardPipeWeights> weights);
+private:
+    bool m_running = true;
+    std::unique_ptr<ForwardPipe> m_pipe;
+
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+
+    std::list<std::shared_ptr<ForwardQueueEntry>> m_forward_queue;
+    std::list<std::thread> m_worker_threads;
+
+    void batch_worker();
+    void enqueue_and_wait(
+        std::vector<std::shared_ptr<ForwardQueueEntry>>& entries);
+};
+
+#endif
@@ -30,6 +30,10 @@
 #ifndef FORWARDPIPE_H_INCLUDED
 #define FORWARDPIPE_H_INCLUDED
 
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
 #include <memory>
 #include <vector>
 
@@ -53,6 +57,36 @@ public:
         std::vector<float> m_conv_val_b;
     };
 
+    // The input planes of one position in sparse form. The piece planes
+    // are one-hot, so only the (plane, square) pairs that are 1 are listed.
+    // Every other plane (hands, repetitions, side to move, move number)
+    // has one value on the whole board.
+    class SparseInput {
+    public:
+        static constexpr auto CHANNELS = 45 * 8 + 2;
+        static constexpr auto MAX_ONES = 40 * 8;    // 40 pieces, 8 history steps
+
+        int m_num_ones;
+        std::array<std::uint16_t, MAX_ONES> m_ones; // plane * 81 + square
+        std::array<float, CHANNELS> m_fill;         // 0 for the piece planes
+
+        // Writes the dense planes, laid out as data[plane * 81 + square].
+        void expand(float* data) const {
+            for (auto c = 0; c < CHANNELS; c++) {
+                std::fill(data + c * NUM_INTERSECTIONS,
+                          data + (c + 1) * NUM_INTERSECTIONS, m_fill[c]);
+            }
+            for (auto i = 0; i < m_num_ones; i++) {
+                data[m_ones[i]] = 1.0f;
+            }
+        }
+
+        // The last plane holds the move number / 512.
+        int move_number() const {
+            return static_cast<int>(std::lround(m_fill[CHANNELS - 1] * 512.0f));
+        }
+    };
+
     virtual ~ForwardPipe() = default;
 
     virtual void initialize(const int channels) = 0;
@@ -60,6 +94,41 @@ public:
     virtual void forward(const std::vector<float>& input,
                          std::vector<float>& output_pol,
                          std::vector<float>& output_val) = 0;
+    // Evaluates batch_size positions stored back to back in input.
+    // Pipes that cannot batch just run forward() on each of them.
+    virtual void forward_batch(const std::vector<float>& input,
+                               std::vector<float>& output_pol,
+                               std::vector<float>& output_val,
+                               const size_t batch_size) {
+        const auto in_size = input.size() / batch_size;
+        const auto out_pol_size = output_pol.size() / batch_size;
+        const auto out_val_size = output_val.size() / batch_size;
+        auto in = std::vector<float>(in_size);
+        auto out_pol = std::vector<float>(out_pol_size);
+        auto out_val = std::vector<float>(out_val_size);
+        for (auto i = size_t{0}; i < batch_size; i++) {
+            std::copy(begin(input) + in_size * i,
+                      begin(input) + in_size * (i + 1), begin(in));
+            forward(in, out_pol, out_val);
+            std::copy(begin(out_pol), end(out_pol),
+                      begin(output_pol) + out_pol_size * i);
+            std::copy(begin(out_val), end(out_val),
+                      begin(output_val) + out_val_size * i);
+        }
+    }
+    // Same as forward_batch(), for positions given as SparseInput.
+    // Pipes that have no sparse input layer expand them first.
+    virtual void forward_sparse(const SparseInput* input,
+                                std::vector<float>& output_pol,
+                                std::vector<float>& output_val,
+                                const size_t batch_size) {
+        constexpr auto in_size = SparseInput::CHANNELS * NUM_INTERSECTIONS;
+        auto in = std::vector<float>(in_size * batch_size);
+        for (auto i = size_t{0}; i < batch_size; i++) {
+            input[i].expand(in.data() + in_size * i);
+        }
+        forward_batch(in, output_pol, output_val, batch_size);
+    }
     virtual void push_weights(unsigned int filter_size,
                               unsigned int channels,
                               unsigned int outputs,
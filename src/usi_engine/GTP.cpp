@@ -68,6 +68,7 @@ int cfg_max_visits;
 size_t cfg_max_memory;
 size_t cfg_max_tree_size;
 int cfg_max_cache_ratio_percent;
+int cfg_shogi_cache_count;
 TimeManagement::enabled_t cfg_timemanage;
 int cfg_lagbuffer_cs;
 int cfg_resignpct;
@@ -94,12 +95,14 @@ float cfg_fpu_root_reduction;
 float cfg_ci_alpha;
 float cfg_lcb_min_visit_ratio;
 std::string cfg_weightsfile;
+std::string cfg_binary_weightsfile;
 std::string cfg_logfile;
 FILE* cfg_logfile_handle;
 bool cfg_quiet;
 std::string cfg_options_str;
 bool cfg_benchmark;
 bool cfg_cpu_only;
+bool cfg_cpu_int8;
 AnalyzeTags cfg_analyze_tags;
 
 #if 0
@@ -316,6 +319,21 @@ void GTP::initialize(std::unique_ptr<Network>&& net) {
     }
     myprintf("%s\n", message.c_str());
 */
+    // The shogi evaluation cache gets its share of the memory left after
+    // the network, allocated here once. Each entry takes
+    // ShogiNNCache::ENTRY_SIZE (about 632 bytes), so that share alone would
+    // reach MAX_CACHE_COUNT, about 126 MiB in every engine process.
+    // cfg_shogi_cache_count (if not 0) caps it at what the search needs.
+    const auto base_memory = s_network->get_estimated_size();
+    if (cfg_max_memory > base_memory) {
+        auto max_bytes =
+            (cfg_max_memory - base_memory) / 100 * cfg_max_cache_ratio_percent;
+        if (cfg_shogi_cache_count > 0) {
+            max_bytes = std::min(max_bytes,
+                cfg_shogi_cache_count * ShogiNNCache::ENTRY_SIZE);
+        }
+        s_network->nncache_allocate(max_bytes);
+    }
 }
 
 void GTP::setup_default_parameters() {
@@ -333,6 +351,7 @@ void GTP::setup_default_parameters() {
     // This will be overwriiten in initialize() after network size is known.
     cfg_max_tree_size = UCTSearch::DEFAULT_MAX_MEMORY;
     cfg_max_cache_ratio_percent = 10;
+    cfg_shogi_cache_count = 0;
     cfg_timemanage = TimeManagement::AUTO;
     cfg_lagbuffer_cs = 100;
 //    cfg_weightsfile = leelaz_file("best-network");
@@ -368,6 +387,7 @@ void GTP::setup_default_parameters() {
 #else
     cfg_cpu_only = false;
 #endif
+    cfg_cpu_int8 = false;
 
     cfg_analyze_tags = AnalyzeTags{};
 
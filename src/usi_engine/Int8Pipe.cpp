@@ -0,0 +1,398 @@
+// 2019 Team AobaZero
+// This is a work derived from Leela Zero (May 1, 2019).
+/*
+    This file is part of Leela Zero.
+    Copyright (C) 2018-2019 Junhee Yoo and contributors
+
+    Leela Zero is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Leela Zero is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Leela Zero.  If not, see <http://www.gnu.org/licenses/>.
+
+    Additional permission under GNU GPL version 3 section 7
+
+    If you modify this Program, or any covered work, by linking or
+    combining it with NVIDIA Corporation's libraries from the
+    NVIDIA CUDA Toolkit and/or the NVIDIA CUDA Deep Neural
+    Network library and/or the NVIDIA TensorRT inference library
+    (or a modified version of those libraries), containing parts covered
+    by the terms of the respective license agreement, the licensors of
+    this Program grant you additional permission to convey the resulting
+    work.
+*/
+#include "config.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#include "Int8Pipe.h"
+#include "CPUPipe.h"
+#include "Network.h"
+#include "Utils.h"
+
+using Utils::myprintf;
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define INT8_SIMD
+#include <immintrin.h>
+#endif
+
+namespace {
+
+// Activations are stored on a board with a border of zeros so that the
+// 3x3 taps need no bounds checks.
+constexpr auto WPAD = BOARD_SIZE + 2;
+constexpr auto PAD_INTERSECTIONS = WPAD * WPAD;
+constexpr auto QMAX = 127;
+
+// Offset of tap t = ky*3 + kx from the centre, on the padded board
+constexpr int TAP[9] = {
+    -WPAD - 1, -WPAD, -WPAD + 1,
+    -1,        0,     1,
+    WPAD - 1,  WPAD,  WPAD + 1
+};
+
+inline int padded(const int p) {
+    return (p / BOARD_SIZE + 1) * WPAD + p % BOARD_SIZE + 1;
+}
+
+// acc[p][k] = sum over the taps t and channels c of
+//             act[padded(p) + TAP[t]][c] * w[t][c/4][k][c%4]
+void conv3_scalar(const std::uint8_t* act, const std::int8_t* w,
+                  std::int32_t* acc, const int C4, const int kpad) {
+    for (auto p = 0; p < NUM_INTERSECTIONS; p++) {
+        for (auto k = 0; k < kpad; k++) {
+            auto sum = std::int32_t{0};
+            for (auto t = 0; t < 9; t++) {
+                const auto a = &act[(padded(p) + TAP[t]) * C4 * 4];
+                const auto wt = &w[(t * C4 * kpad + k) * 4];
+                for (auto c4 = 0; c4 < C4; c4++) {
+                    for (auto j = 0; j < 4; j++) {
+                        sum += a[c4*4 + j] * wt[c4*kpad*4 + j];
+                    }
+                }
+            }
+            acc[p*kpad + k] = sum;
+        }
+    }
+}
+
+#ifdef INT8_SIMD
+// The 4 bytes of one group of 4 input channels are broadcast to every
+// lane and multiplied with the weights of 8 (AVX2) or 16 (AVX-512)
+// output channels, so the int32 lanes of the accumulators are output
+// channels and need no horizontal sums. PB positions and KB vectors of
+// outputs are kept in registers.
+inline std::int32_t load4(const std::uint8_t* p) {
+    std::int32_t v;
+    std::memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+__attribute__((target("avx2")))
+void conv3_avx2(const std::uint8_t* act, const std::int8_t* w,
+                std::int32_t* acc, const int C4, const int kpad) {
+    constexpr auto LANES = 8;
+    constexpr auto PB = 2;
+    constexpr auto KB = 4;
+    const auto ones = _mm256_set1_epi16(1);
+    for (auto p0 = 0; p0 < NUM_INTERSECTIONS; p0 += PB) {
+        int base[PB];
+        for (auto i = 0; i < PB; i++) {
+            base[i] = padded(std::min(p0 + i, NUM_INTERSECTIONS - 1)) * C4 * 4;
+        }
+        for (auto k0 = 0; k0 < kpad; k0 += LANES * KB) {
+            __m256i sum[PB][KB];
+            for (auto i = 0; i < PB; i++) {
+                for (auto j = 0; j < KB; j++) {
+                    sum[i][j] = _mm256_setzero_si256();
+                }
+            }
+            for (auto t = 0; t < 9; t++) {
+                const auto tap = TAP[t] * C4 * 4;
+                for (auto c4 = 0; c4 < C4; c4++) {
+                    const auto wp = &w[((t*C4 + c4)*kpad + k0) * 4];
+                    __m256i wv[KB];
+                    for (auto j = 0; j < KB; j++) {
+                        wv[j] = _mm256_loadu_si256(
+                            reinterpret_cast<const __m256i*>(wp + j*LANES*4));
+                    }
+                    for (auto i = 0; i < PB; i++) {
+                        const auto a = _mm256_set1_epi32(
+                            load4(&act[base[i] + tap + c4*4]));
+                        for (auto j = 0; j < KB; j++) {
+                            // u8 x s8 pairs to s16, cannot saturate with
+                            // 7 bit activations; then pairs to s32
+                            const auto m = _mm256_madd_epi16(
+                                _mm256_maddubs_epi16(a, wv[j]), ones);
+                            sum[i][j] = _mm256_add_epi32(sum[i][j], m);
+                        }
+                    }
+                }
+            }
+            for (auto i = 0; i < PB && p0 + i < NUM_INTERSECTIONS; i++) {
+                for (auto j = 0; j < KB; j++) {
+                    _mm256_storeu_si256(reinterpret_cast<__m256i*>(
+                        &acc[(p0 + i)*kpad + k0 + j*LANES]), sum[i][j]);
+                }
+            }
+        }
+    }
+}
+
+__attribute__((target("avx512f,avx512vnni")))
+void conv3_avx512vnni(const std::uint8_t* act, const std::int8_t* w,
+                      std::int32_t* acc, const int C4, const int kpad) {
+    constexpr auto LANES = 16;
+    constexpr auto PB = 4;
+    constexpr auto KB = 4;
+    for (auto p0 = 0; p0 < NUM_INTERSECTIONS; p0 += PB) {
+        int base[PB];
+        for (auto i = 0; i < PB; i++) {
+            base[i] = padded(std::min(p0 + i, NUM_INTERSECTIONS - 1)) * C4 * 4;
+        }
+        for (auto k0 = 0; k0 < kpad; k0 += LANES * KB) {
+            __m512i sum[PB][KB];
+            for (auto i = 0; i < PB; i++) {
+                for (auto j = 0; j < KB; j++) {
+                    sum[i][j] = _mm512_setzero_si512();
+                }
+            }
+            for (auto t = 0; t < 9; t++) {
+                const auto tap = TAP[t] * C4 * 4;
+                for (auto c4 = 0; c4 < C4; c4++) {
+                    const auto wp = &w[((t*C4 + c4)*kpad + k0) * 4];
+                    __m512i wv[KB];
+                    for (auto j = 0; j < KB; j++) {
+                        wv[j] = _mm512_loadu_si512(wp + j*LANES*4);
+                    }
+                    for (auto i = 0; i < PB; i++) {
+                        const auto a = _mm512_set1_epi32(
+                            load4(&act[base[i] + tap + c4*4]));
+                        for (auto j = 0; j < KB; j++) {
+                            sum[i][j] = _mm512_dpbusd_epi32(sum[i][j], a, wv[j]);
+                        }
+                    }
+                }
+            }
+            for (auto i = 0; i < PB && p0 + i < NUM_INTERSECTIONS; i++) {
+                for (auto j = 0; j < KB; j++) {
+                    _mm512_storeu_si512(&acc[(p0 + i)*kpad + k0 + j*LANES],
+                                        sum[i][j]);
+                }
+            }
+        }
+    }
+}
+#endif
+
+}
+
+void Int8Pipe::initialize(int channels) {
+    m_input_channels = channels;
+    // The SIMD kernels take 64 outputs at a time
+    m_kpad = (channels + 63) / 64 * 64;
+
+    m_simd = Simd::NONE;
+#ifdef INT8_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")
+        && __builtin_cpu_supports("avx512vnni")) {
+        m_simd = Simd::AVX512VNNI;
+    } else if (__builtin_cpu_supports("avx2")) {
+        m_simd = Simd::AVX2;
+    }
+#endif
+    const char* simd_names[] = {"scalar", "AVX2", "AVX-512 VNNI"};
+    myprintf("CPU INT8 convolutions: %s\n", simd_names[static_cast<int>(m_simd)]);
+}
+
+void Int8Pipe::push_weights(unsigned int /*filter_size*/,
+                            unsigned int /*channels*/,
+                            unsigned int outputs,
+                            std::shared_ptr<const ForwardPipeWeights> weights) {
+    const auto K = static_cast<int>(outputs);
+    const auto layers = weights->m_conv_weights.size();
+    m_layers.resize(layers);
+    for (auto i = size_t{0}; i < layers; i++) {
+        const auto& U = weights->m_conv_weights[i];
+        const auto& means = weights->m_batchnorm_means[i];
+        const auto& stddevs = weights->m_batchnorm_stddevs[i];
+        const auto C = static_cast<int>(U.size() / (WINOGRAD_TILE * K));
+        const auto f = Network::winograd_inverse_f(U, K, C);
+
+        auto& layer = m_layers[i];
+        layer.C4 = (C + 3) / 4;
+        layer.w.assign(9 * layer.C4 * m_kpad * 4, 0);
+        layer.scale.assign(m_kpad, 1.0f);
+        layer.bias.assign(m_kpad, 0.0f);
+        for (auto k = 0; k < K; k++) {
+            // Batchnorm folded in as in CPUPipe, then one scale per output
+            auto wmax = 0.0f;
+            for (auto j = 0; j < C * 9; j++) {
+                wmax = std::max(wmax, std::fabs(f[k*C*9 + j] * stddevs[k]));
+            }
+            const auto scale = wmax > 0.0f ? wmax / QMAX : 1.0f;
+            for (auto c = 0; c < C; c++) {
+                for (auto t = 0; t < 9; t++) {
+                    const auto q = std::lrint(f[k*C*9 + c*9 + t] * stddevs[k] / scale);
+                    layer.w[((t*layer.C4 + c/4)*m_kpad + k)*4 + c%4] =
+                        static_cast<std::int8_t>(std::max(-QMAX, std::min(QMAX, static_cast<int>(q))));
+                }
+            }
+            layer.scale[k] = scale;
+            layer.bias[k] = -stddevs[k] * means[k];
+        }
+    }
+
+    // Output head convolutions
+    m_conv_pol_w = weights->m_conv_pol_w;
+    m_conv_pol_b.resize(m_conv_pol_w.size() / outputs, 0.0f);
+    m_conv_val_w = weights->m_conv_val_w;
+    m_conv_val_b.resize(m_conv_val_w.size() / outputs, 0.0f);
+}
+
+// in is [NUM_INTERSECTIONS][C], q the padded board of [C4*4] bytes.
+void Int8Pipe::quantize(const float* in, const int C, const int C4,
+                        std::uint8_t* q, float& scale) {
+    auto vmax = 0.0f;
+    for (auto i = 0; i < NUM_INTERSECTIONS * C; i++) {
+        vmax = std::max(vmax, in[i]);
+    }
+    scale = vmax > 0.0f ? vmax / QMAX : 1.0f;
+    const auto inv = 1.0f / scale;
+    for (auto p = 0; p < NUM_INTERSECTIONS; p++) {
+        const auto src = &in[p*C];
+        const auto dst = &q[padded(p) * C4 * 4];
+        for (auto c = 0; c < C; c++) {
+            // Negative inputs are not expected and become 0
+            const auto v = std::min(static_cast<float>(QMAX),
+                                    std::max(0.0f, src[c] * inv + 0.5f));
+            dst[c] = static_cast<std::uint8_t>(v);
+        }
+    }
+}
+
+// out[p][k] = ReLU(acc * scales + bias + res), all [NUM_INTERSECTIONS][m_kpad]
+void Int8Pipe::convolve3(const Layer& layer, const std::uint8_t* act,
+                         const float act_scale, std::int32_t* acc,
+                         const float* res, float* out) {
+#ifdef INT8_SIMD
+    if (m_simd == Simd::AVX512VNNI) {
+        conv3_avx512vnni(act, layer.w.data(), acc, layer.C4, m_kpad);
+    } else if (m_simd == Simd::AVX2) {
+        conv3_avx2(act, layer.w.data(), acc, layer.C4, m_kpad);
+    } else
+#endif
+    {
+        conv3_scalar(act, layer.w.data(), acc, layer.C4, m_kpad);
+    }
+
+    auto scale = std::vector<float>(m_kpad);
+    for (auto k = 0; k < m_kpad; k++) {
+        scale[k] = act_scale * layer.scale[k];
+    }
+    for (auto p = 0; p < NUM_INTERSECTIONS; p++) {
+        const auto a = &acc[p*m_kpad];
+        const auto o = &out[p*m_kpad];
+        for (auto k = 0; k < m_kpad; k++) {
+            auto v = a[k] * scale[k] + layer.bias[k];
+            if (res != nullptr) {
+                v += res[p*m_kpad + k];
+            }
+            o[k] = v > 0.0f ? v : 0.0f;
+        }
+    }
+}
+
+void Int8Pipe::forward(const std::vector<float>& input,
+                       std::vector<float>& output_pol,
+                       std::vector<float>& output_val) {
+    forward_batch(input, output_pol, output_val, 1);
+}
+
+void Int8Pipe::forward_batch(const std::vector<float>& input,
+                             std::vector<float>& output_pol,
+                             std::vector<float>& output_val,
+                             const size_t batch_size) {
+    constexpr auto in_channels = Network::INPUT_CHANNELS;
+    const auto K = m_input_channels;
+    const auto conv_size = NUM_INTERSECTIONS * m_kpad;
+    const auto q_in_size = PAD_INTERSECTIONS * m_layers[0].C4 * 4;
+    const auto q_size = PAD_INTERSECTIONS * m_kpad;
+
+    // The borders of the quantized boards are never written and stay 0
+    auto q_in = std::vector<std::uint8_t>(batch_size * q_in_size);
+    auto q = std::vector<std::uint8_t>(batch_size * q_size);
+    auto scales = std::vector<float>(batch_size);
+    auto acc = std::vector<std::int32_t>(conv_size);
+    auto conv_out = std::vector<float>(batch_size * conv_size);
+    auto conv_in = std::vector<float>(batch_size * conv_size);
+    auto res = std::vector<float>(batch_size * conv_size);
+
+    // Input convolution, the planes come as [channel][intersection]
+    auto in_hwc = std::vector<float>(NUM_INTERSECTIONS * in_channels);
+    for (auto n = size_t{0}; n < batch_size; n++) {
+        const auto in = &input[n * in_channels * NUM_INTERSECTIONS];
+        for (auto c = 0; c < in_channels; c++) {
+            for (auto p = 0; p < NUM_INTERSECTIONS; p++) {
+                in_hwc[p*in_channels + c] = in[c*NUM_INTERSECTIONS + p];
+            }
+        }
+        quantize(in_hwc.data(), in_channels, m_layers[0].C4,
+                 &q_in[n * q_in_size], scales[n]);
+        convolve3(m_layers[0], &q_in[n * q_in_size], scales[n], acc.data(),
+                  nullptr, &conv_out[n * conv_size]);
+    }
+
+    // Residual tower. Each layer goes over the whole batch so that its
+    // weights stay in the cache.
+    const auto C4 = m_kpad / 4;
+    auto conv_layer = [&](const Layer& layer, const std::vector<float>& in,
+                          const float* residual, std::vector<float>& out) {
+        for (auto n = size_t{0}; n < batch_size; n++) {
+            quantize(&in[n * conv_size], m_kpad, C4, &q[n * q_size], scales[n]);
+            convolve3(layer, &q[n * q_size], scales[n], acc.data(),
+                      residual ? residual + n * conv_size : nullptr,
+                      &out[n * conv_size]);
+        }
+    };
+    for (auto i = size_t{1}; i < m_layers.size(); i += 2) {
+        std::swap(conv_out, conv_in);
+        conv_layer(m_layers[i], conv_in, nullptr, conv_out);
+
+        std::swap(conv_in, res);
+        std::swap(conv_out, conv_in);
+        conv_layer(m_layers[i + 1], conv_in, res.data(), conv_out);
+    }
+
+    // Output heads in float, back in [channel][intersection]
+    const auto out_pol_size = output_pol.size() / batch_size;
+    const auto out_val_size = output_val.size() / batch_size;
+    auto pos_in = std::vector<float>(K * NUM_INTERSECTIONS);
+    auto pos_pol = std::vector<float>(out_pol_size);
+    auto pos_val = std::vector<float>(out_val_size);
+    for (auto n = size_t{0}; n < batch_size; n++) {
+        const auto out = &conv_out[n * conv_size];
+        for (auto k = 0; k < K; k++) {
+            for (auto p = 0; p < NUM_INTERSECTIONS; p++) {
+                pos_in[k*NUM_INTERSECTIONS + p] = out[p*m_kpad + k];
+            }
+        }
+        convolve<1>(Network::OUTPUTS_POLICY, pos_in, m_conv_pol_w, m_conv_pol_b, pos_pol);
+        convolve<1>(Network::OUTPUTS_VALUE, pos_in, m_conv_val_w, m_conv_val_b, pos_val);
+        std::copy(begin(pos_pol), end(pos_pol),
+                  begin(output_pol) + out_pol_size * n);
+        std::copy(begin(pos_val), end(pos_val),
+                  begin(output_val) + out_val_size * n);
+    }
+}
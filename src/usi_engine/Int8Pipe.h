@@ -0,0 +1,91 @@
+// 2019 Team AobaZero
+// This is a work derived from Leela Zero (May 1, 2019).
+/*
+    This file is part of Leela Zero.
+    Copyright (C) 2018-2019 Junhee Yoo and contributors
+
+    Leela Zero is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Leela Zero is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Leela Zero.  If not, see <http://www.gnu.org/licenses/>.
+
+    Additional permission under GNU GPL version 3 section 7
+
+    If you modify this Program, or any covered work, by linking or
+    combining it with NVIDIA Corporation's libraries from the
+    NVIDIA CUDA Toolkit and/or the NVIDIA CUDA Deep Neural
+    Network library and/or the NVIDIA TensorRT inference library
+    (or a modified version of those libraries), containing parts covered
+    by the terms of the respective license agreement, the licensors of
+    this Program grant you additional permission to convey the resulting
+    work.
+*/
+
+#ifndef INT8PIPE_H_INCLUDED
+#define INT8PIPE_H_INCLUDED
+#include "config.h"
+
+#include <cstdint>
+#include <vector>
+
+#include "ForwardPipe.h"
+
+// Residual tower with 8 bit weights and activations. The 3x3 convolutions
+// are done directly (no Winograd) as int8 dot products accumulated in
+// int32, with AVX-512 VNNI or AVX2 picked at run time. Weights have one
+// scale per output channel. Activations (non-negative after ReLU) get one
+// scale per position and layer from their maximum, and are kept to 7 bits
+// so that AVX2 vpmaddubsw cannot saturate and every path gives the same
+// sums. The residual adds and the output heads stay in float.
+class Int8Pipe : public ForwardPipe {
+public:
+    virtual void initialize(const int channels);
+    virtual void forward(const std::vector<float>& input,
+                         std::vector<float>& output_pol,
+                         std::vector<float>& output_val);
+    virtual void forward_batch(const std::vector<float>& input,
+                               std::vector<float>& output_pol,
+                               std::vector<float>& output_val,
+                               const size_t batch_size);
+
+    virtual void push_weights(unsigned int filter_size,
+                              unsigned int channels,
+                              unsigned int outputs,
+                              std::shared_ptr<const ForwardPipeWeights> weights);
+private:
+    struct Layer {
+        int C4;                      // input channels / 4, rounded up
+        std::vector<std::int8_t> w;  // [9][C4][m_kpad][4]
+        std::vector<float> scale;    // [m_kpad] weight scale of each output
+        std::vector<float> bias;     // [m_kpad] batchnorm folded in
+    };
+
+    void quantize(const float* in, const int C, const int C4,
+                  std::uint8_t* q, float& scale);
+    void convolve3(const Layer& layer, const std::uint8_t* act,
+                   const float act_scale, std::int32_t* acc,
+                   const float* res, float* out);
+
+    int m_input_channels;
+    int m_kpad;
+
+    enum class Simd { NONE, AVX2, AVX512VNNI };
+    Simd m_simd{Simd::NONE};
+
+    std::vector<Layer> m_layers;
+
+    std::vector<float> m_conv_pol_w;
+    std::vector<float> m_conv_val_w;
+    std::vector<float> m_conv_pol_b;
+    std::vector<float> m_conv_val_b;
+};
+
+#endif
@@ -28,10 +28,15 @@
 */
 
 #include "config.h"
+#include <algorithm>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
 #include <functional>
 #include <memory>
 
 #include "NNCache.h"
+#include "Random.h"
 #include "Utils.h"
 #include "UCTSearch.h"
 #include "GTP.h"
@@ -109,3 +114,322 @@ void NNCache::dump_stats() {
 size_t NNCache::get_estimated_size() {
     return m_order.size() * NNCache::ENTRY_SIZE;
 }
+
+const int ShogiNNCache::MAX_MOVES;
+const int ShogiNNCache::WAYS;
+const int ShogiNNCache::MAX_CACHE_COUNT;
+const size_t ShogiNNCache::ENTRY_SIZE;
+
+void ShogiNNCache::resize(int size) {
+    m_num_buckets = std::max(1, std::min(size, MAX_CACHE_COUNT) / WAYS);
+    // Value-initialized, so all slots are empty.
+    m_slots.reset(new Slot[m_num_buckets * WAYS]());
+    m_hands.reset(new std::atomic<std::uint8_t>[m_num_buckets]());
+}
+
+bool ShogiNNCache::lookup(std::uint64_t hash, int num_moves,
+                          float* priors, float& value) {
+    if (!m_slots) {
+        return false;
+    }
+    ++m_lookups;
+    auto slots = bucket(hash);
+    for (auto w = 0; w < WAYS; w++) {
+        auto& s = slots[w];
+        const auto version = s.version.load(std::memory_order_acquire);
+        if ((version & 1) != 0
+            || s.key.load(std::memory_order_relaxed) != hash) {
+            continue;
+        }
+        if (s.num_moves.load(std::memory_order_relaxed)
+            != static_cast<std::uint32_t>(num_moves)) {
+            return false;  // Another position with the same hash.
+        }
+        for (auto i = 0; i < num_moves; i++) {
+            priors[i] = s.priors[i].load(std::memory_order_relaxed);
+        }
+        value = s.value.load(std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (s.version.load(std::memory_order_relaxed) != version) {
+            return false;  // Overwritten while it was read.
+        }
+        s.referenced.store(true, std::memory_order_relaxed);
+        ++m_hits;
+        return true;
+    }
+    return false;
+}
+
+void ShogiNNCache::insert(std::uint64_t hash, int num_moves,
+                          const float* priors, float value) {
+    if (!m_slots || num_moves <= 0 || num_moves > MAX_MOVES) {
+        return;
+    }
+    auto slots = bucket(hash);
+    for (auto w = 0; w < WAYS; w++) {
+        if (slots[w].key.load(std::memory_order_relaxed) == hash) {
+            return;  // Already in the cache.
+        }
+    }
+
+    // CLOCK: the first slot that is empty or was not hit since the hand
+    // last passed it. Two turns at most, as the first clears the bits.
+    auto& h = hand(hash);
+    auto pos = h.load(std::memory_order_relaxed);
+    Slot* victim = nullptr;
+    for (auto n = 0; n < 2 * WAYS; n++) {
+        auto& s = slots[pos++ % WAYS];
+        if (s.num_moves.load(std::memory_order_relaxed) == 0
+            || !s.referenced.exchange(false, std::memory_order_relaxed)) {
+            victim = &s;
+            break;
+        }
+    }
+    h.store(pos, std::memory_order_relaxed);
+    if (!victim) {
+        return;
+    }
+
+    auto version = victim->version.load(std::memory_order_relaxed);
+    if ((version & 1) != 0
+        || !victim->version.compare_exchange_strong(
+               version, version + 1, std::memory_order_acquire)) {
+        return;  // Another thread is writing it.
+    }
+    victim->key.store(hash, std::memory_order_relaxed);
+    victim->num_moves.store(num_moves, std::memory_order_relaxed);
+    victim->value.store(value, std::memory_order_relaxed);
+    for (auto i = 0; i < num_moves; i++) {
+        victim->priors[i].store(priors[i], std::memory_order_relaxed);
+    }
+    victim->referenced.store(false, std::memory_order_relaxed);
+    victim->version.store(version + 2, std::memory_order_release);
+    ++m_inserts;
+}
+
+void ShogiNNCache::dump_stats() {
+    const std::uint64_t hits = m_hits;
+    const std::uint64_t lookups = m_lookups;
+    const std::uint64_t inserts = m_inserts;
+    Utils::myprintf(
+        "NNCache: %" PRIu64 "/%" PRIu64 " hits/lookups = %.1f%% hitrate, "
+        "%" PRIu64 " inserts, %.1f MiB\n",
+        hits, lookups, 100. * hits / (lookups + 1),
+        inserts, get_estimated_size() / (1024. * 1024.));
+}
+
+size_t ShogiNNCache::get_estimated_size() {
+    return m_num_buckets * (WAYS * sizeof(Slot) + sizeof(std::uint8_t));
+}
+
+const int OpeningCache::MAX_MOVE_NUMBER;
+const int OpeningCache::MAX_NEW_COUNT;
+
+static constexpr char OPENING_CACHE_MAGIC[8] = {'A','Z','O','P','E','N','1','\n'};
+static constexpr std::uint32_t OPENING_CACHE_VERSION = 1;
+
+bool OpeningCache::parse(const Utils::MappedFile& file,
+                         const Slot*& slots, std::uint32_t& num_slots,
+                         const float*& priors) const {
+    Header header;
+    if (file.size() < sizeof(header)) {
+        return false;
+    }
+    std::memcpy(&header, file.data(), sizeof(header));
+    if (std::memcmp(header.magic, OPENING_CACHE_MAGIC, sizeof(header.magic)) != 0
+        || header.version != OPENING_CACHE_VERSION) {
+        Utils::myprintf("%s is not an opening cache file.\n", m_filename.c_str());
+        return false;
+    }
+    if (header.weights_crc64 != m_weights_crc64
+        || header.softmax_temp != m_softmax_temp) {
+        Utils::myprintf("%s was made with other weights, ignored.\n",
+                        m_filename.c_str());
+        return false;
+    }
+    const auto table_size = std::uint64_t{header.num_slots} * sizeof(Slot);
+    if (header.num_slots == 0
+        || (header.num_slots & (header.num_slots - 1)) != 0
+        || header.payload_size != file.size() - sizeof(header)
+        || table_size > header.payload_size
+        || Utils::crc64_xz(file.data() + sizeof(header), header.payload_size)
+           != header.crc64) {
+        Utils::myprintf("%s is broken, ignored.\n", m_filename.c_str());
+        return false;
+    }
+    const auto num_priors = (header.payload_size - table_size) / sizeof(float);
+    slots = reinterpret_cast<const Slot*>(file.data() + sizeof(header));
+    for (auto i = std::uint32_t{0}; i < header.num_slots; i++) {
+        if (slots[i].offset + std::uint64_t{slots[i].num_moves} > num_priors) {
+            Utils::myprintf("%s is broken, ignored.\n", m_filename.c_str());
+            return false;
+        }
+    }
+    num_slots = header.num_slots;
+    priors = reinterpret_cast<const float*>(file.data() + sizeof(header) + table_size);
+    return true;
+}
+
+bool OpeningCache::open(const std::string& filename,
+                        std::uint64_t weights_crc64, float softmax_temp) {
+    m_filename = filename;
+    m_weights_crc64 = weights_crc64;
+    m_softmax_temp = softmax_temp;
+
+    m_file = std::make_unique<Utils::MappedFile>(filename);
+    if (!parse(*m_file, m_slots, m_num_slots, m_priors)) {
+        m_file.reset();
+        m_slots = nullptr;
+        m_num_slots = 0;
+        m_priors = nullptr;
+        return false;
+    }
+    Utils::myprintf("Opening cache: %s, %u slots\n", filename.c_str(), m_num_slots);
+    return true;
+}
+
+bool OpeningCache::lookup(std::uint64_t hash, int num_moves,
+                          float* priors, float& value) const {
+    const auto mask = m_num_slots - 1;
+    for (auto i = std::uint32_t{0}; i < m_num_slots; i++) {
+        const auto& slot = m_slots[(hash + i) & mask];
+        if (slot.num_moves == 0) {
+            return false;
+        }
+        if (slot.key == hash) {
+            if (slot.num_moves != num_moves) {
+                return false;   // Another position with the same hash.
+            }
+            std::copy(m_priors + slot.offset,
+                      m_priors + slot.offset + num_moves, priors);
+            value = slot.value;
+            return true;
+        }
+    }
+    return false;
+}
+
+void OpeningCache::insert(std::uint64_t hash, int num_moves,
+                          const float* priors, float value) {
+    // Mate positions have nothing worth keeping, and num_moves 0 marks
+    // an empty slot.
+    if (num_moves <= 0 || num_moves > 0xffff) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_new.size() >= static_cast<size_t>(MAX_NEW_COUNT)) {
+        return;
+    }
+    auto& entry = m_new[hash];
+    entry.value = value;
+    entry.priors.assign(priors, priors + num_moves);
+}
+
+void OpeningCache::collect(const Slot* slots, std::uint32_t num_slots,
+                           const float* priors, EntryMap& entries) {
+    for (auto i = std::uint32_t{0}; i < num_slots; i++) {
+        const auto& slot = slots[i];
+        if (slot.num_moves == 0) {
+            continue;
+        }
+        auto& entry = entries[slot.key];
+        entry.value = slot.value;
+        entry.priors.assign(priors + slot.offset,
+                            priors + slot.offset + slot.num_moves);
+    }
+}
+
+bool OpeningCache::save() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (!enabled() || m_new.empty()) {
+        return true;
+    }
+
+    // Other engines may have saved theirs since the file was opened.
+    auto entries = EntryMap{};
+    {
+        const Utils::MappedFile file(m_filename);
+        const Slot* slots;
+        std::uint32_t num_slots;
+        const float* priors;
+        if (parse(file, slots, num_slots, priors)) {
+            collect(slots, num_slots, priors, entries);
+        } else if (m_file) {
+            collect(m_slots, m_num_slots, m_priors, entries);
+        }
+    }
+    for (auto& e : m_new) {
+        entries[e.first] = std::move(e.second);
+    }
+    m_new.clear();
+
+    // At most half full, so that the probes of a miss stay short.
+    auto num_slots = std::uint32_t{1024};
+    while (num_slots < 2 * entries.size()) {
+        num_slots *= 2;
+    }
+    auto num_priors = size_t{0};
+    for (const auto& e : entries) {
+        num_priors += e.second.priors.size();
+    }
+
+    auto table = std::vector<Slot>(num_slots);
+    auto priors = std::vector<float>();
+    priors.reserve(num_priors);
+    for (const auto& e : entries) {
+        auto i = static_cast<std::uint32_t>(e.first);
+        while (table[i & (num_slots - 1)].num_moves != 0) {
+            i++;
+        }
+        auto& slot = table[i & (num_slots - 1)];
+        slot.key = e.first;
+        slot.offset = static_cast<std::uint32_t>(priors.size());
+        slot.value = e.second.value;
+        slot.num_moves = static_cast<std::uint16_t>(e.second.priors.size());
+        priors.insert(end(priors), begin(e.second.priors), end(e.second.priors));
+    }
+
+    const auto table_bytes = table.size() * sizeof(Slot);
+    const auto prior_bytes = priors.size() * sizeof(float);
+    auto buffer = std::vector<char>(sizeof(Header) + table_bytes + prior_bytes);
+    std::memcpy(buffer.data() + sizeof(Header), table.data(), table_bytes);
+    std::memcpy(buffer.data() + sizeof(Header) + table_bytes,
+                priors.data(), prior_bytes);
+
+    Header header{};
+    std::memcpy(header.magic, OPENING_CACHE_MAGIC, sizeof(header.magic));
+    header.version = OPENING_CACHE_VERSION;
+    header.num_slots = num_slots;
+    header.weights_crc64 = m_weights_crc64;
+    header.num_entries = entries.size();
+    header.payload_size = table_bytes + prior_bytes;
+    header.crc64 = Utils::crc64_xz(buffer.data() + sizeof(Header),
+                                   header.payload_size);
+    header.softmax_temp = m_softmax_temp;
+    std::memcpy(buffer.data(), &header, sizeof(header));
+
+    // Unique, as several engines may share the file
+    const auto tmpname = m_filename + ".tmp"
+        + std::to_string(Random::get_Rng().randuint64() & 0xffffff);
+    auto fp = std::fopen(tmpname.c_str(), "wb");
+    if (!fp) {
+        Utils::myprintf("Cannot write %s\n", tmpname.c_str());
+        return false;
+    }
+    const auto written = std::fwrite(buffer.data(), 1, buffer.size(), fp);
+    if (std::fclose(fp) != 0 || written != buffer.size()) {
+        Utils::myprintf("Cannot write %s\n", tmpname.c_str());
+        std::remove(tmpname.c_str());
+        return false;
+    }
+#ifdef _WIN32
+    std::remove(m_filename.c_str());    // rename() does not replace it
+#endif
+    if (std::rename(tmpname.c_str(), m_filename.c_str()) != 0) {
+        Utils::myprintf("Cannot rename %s\n", tmpname.c_str());
+        return false;
+    }
+    Utils::myprintf("Opening cache: saved %d entries to %s\n",
+                    static_cast<int>(entries.size()), m_filename.c_str());
+    return true;
+}
@@ -31,12 +31,17 @@
 #define NNCACHE_H_INCLUDED
 
 #include "config.h"
+#include "Utils.h"
 
 #include <array>
+#include <atomic>
+#include <cstdint>
 #include <deque>
 #include <memory>
 #include <mutex>
+#include <string>
 #include <unordered_map>
+#include <vector>
 
 class NNCache {
 public:
@@ -114,4 +119,155 @@ private:
     std::deque<size_t> m_order;
 };
 
+// Evaluations of shogi positions: the priors of the legal moves, in the
+// order of the move generator, and the value. The key is a hash of the
+// input planes, so it covers all that the network sees: 8 positions of
+// history, repetitions, side to move and move number.
+// The table is allocated once by resize() and is not locked: it is split
+// into buckets of WAYS slots, each slot guarded by a sequence number that
+// is odd while it is written, so a reader that raced with a writer sees a
+// miss. Each bucket evicts with its own CLOCK hand.
+class ShogiNNCache {
+public:
+    // Positions with more legal moves are not cached.
+    static constexpr int MAX_MOVES = 150;
+
+    static constexpr int WAYS = 8;
+
+    // Upper bound on the memory budget given to resize().
+    static constexpr int MAX_CACHE_COUNT = 200'000;
+
+    struct Slot {
+        std::atomic<std::uint32_t> version;     // odd while written
+        std::atomic<std::uint32_t> num_moves;   // 0 for an empty slot
+        std::atomic<std::uint64_t> key;
+        std::atomic<float> value;
+        std::atomic<bool> referenced;           // CLOCK bit, set by hits
+        std::array<std::atomic<float>, MAX_MOVES> priors;
+    };
+
+    static constexpr size_t ENTRY_SIZE = sizeof(Slot);
+
+    // Allocates about size entries, dropping all. Not to be called
+    // while other threads use the cache.
+    void resize(int size);
+
+    // Try and find an existing entry. num_moves is checked against it.
+    bool lookup(std::uint64_t hash, int num_moves,
+                float* priors, float& value);
+
+    // Insert a new entry.
+    void insert(std::uint64_t hash, int num_moves,
+                const float* priors, float value);
+
+    std::pair<std::uint64_t, std::uint64_t> hit_rate() const {
+        return {m_hits, m_lookups};
+    }
+
+    void dump_stats();
+
+    size_t get_estimated_size();
+private:
+    Slot* bucket(std::uint64_t hash) {
+        // Upper bits, so that the buckets do not follow the probes of
+        // OpeningCache.
+        const auto b = ((hash >> 32) * m_num_buckets) >> 32;
+        return &m_slots[b * WAYS];
+    }
+    std::atomic<std::uint8_t>& hand(std::uint64_t hash) {
+        return m_hands[((hash >> 32) * m_num_buckets) >> 32];
+    }
+
+    std::unique_ptr<Slot[]> m_slots;
+    std::unique_ptr<std::atomic<std::uint8_t>[]> m_hands;
+    std::uint64_t m_num_buckets{0};
+
+    // Statistics. 64 bits, since a resident engine makes billions of
+    // lookups.
+    std::atomic<std::uint64_t> m_hits{0};
+    std::atomic<std::uint64_t> m_lookups{0};
+    std::atomic<std::uint64_t> m_inserts{0};
+};
+
+// Evaluations of the opening positions, kept in a file across runs so that
+// the engine does not evaluate the same early positions again in every game.
+// The file is mapped read-only and looked up without a lock. New entries
+// are kept in memory and written out by save(), merged with the file as it
+// is then. A file made with other weights or another softmax temperature
+// is ignored.
+class OpeningCache {
+public:
+    // Positions up to this move number are stored.
+    static constexpr int MAX_MOVE_NUMBER = 30;
+
+    // Bound on the entries waiting to be saved.
+    static constexpr int MAX_NEW_COUNT = 1'000'000;
+
+    bool open(const std::string& filename,
+              std::uint64_t weights_crc64, float softmax_temp);
+    bool enabled() const { return !m_filename.empty(); }
+
+    // Try and find an entry in the file. num_moves is checked against it.
+    bool lookup(std::uint64_t hash, int num_moves,
+                float* priors, float& value) const;
+
+    // Keep a new entry for save().
+    void insert(std::uint64_t hash, int num_moves,
+                const float* priors, float value);
+
+    // Writes the file and the new entries to a temporary file, then
+    // renames it over the file.
+    bool save();
+
+private:
+    // The file: a 64 byte Header, num_slots Slots of an open-addressed
+    // table (linear probing from the low bits of the key), then the priors.
+    struct Header {
+        char magic[8];
+        std::uint32_t version;
+        std::uint32_t num_slots;        // power of 2
+        std::uint64_t weights_crc64;
+        std::uint64_t num_entries;
+        std::uint64_t payload_size;     // bytes after the header
+        std::uint64_t crc64;            // of the payload
+        float softmax_temp;
+        std::uint32_t reserved[3];
+    };
+    struct Slot {
+        std::uint64_t key;
+        std::uint32_t offset;           // in floats, from the first prior
+        float value;
+        std::uint16_t num_moves;        // 0 for an empty slot
+        std::uint16_t reserved0;
+        std::uint32_t reserved1;
+    };
+    static_assert(sizeof(Header) == 64, "OpeningCache header is not 64 bytes");
+    static_assert(sizeof(Slot) == 24, "OpeningCache slot is not 24 bytes");
+
+    struct Entry {
+        float value;
+        std::vector<float> priors;
+    };
+    using EntryMap = std::unordered_map<std::uint64_t, Entry>;
+
+    // Checks a mapped file and finds its table and priors.
+    bool parse(const Utils::MappedFile& file,
+               const Slot*& slots, std::uint32_t& num_slots,
+               const float*& priors) const;
+    static void collect(const Slot* slots, std::uint32_t num_slots,
+                        const float* priors, EntryMap& entries);
+
+    std::string m_filename;
+    std::uint64_t m_weights_crc64{0};
+    float m_softmax_temp{1.0f};
+
+    std::unique_ptr<Utils::MappedFile> m_file;
+    const Slot* m_slots{nullptr};
+    std::uint32_t m_num_slots{0};
+    const float* m_priors{nullptr};
+
+    std::mutex m_mutex;
+    EntryMap m_new;
+};
+
 #endif
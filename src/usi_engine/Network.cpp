@@ -35,6 +35,9 @@
 #include <array>
 #include <cassert>
 #include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
 #include <iterator>
 #include <memory>
 #include <sstream>
@@ -59,6 +62,8 @@
 
 #include "Network.h"
 #include "CPUPipe.h"
+#include "CPUScheduler.h"
+#include "Int8Pipe.h"
 #ifdef USE_OPENCL
 #include "OpenCLScheduler.h"
 #include "UCTNode.h"
@@ -238,6 +243,79 @@ std::vector<float> Network::winograd_transform_f(const std::vector<float>& f,
     return U;
 }
 
+std::vector<float> Network::winograd_inverse_f(const std::vector<float>& U,
+                                               const int outputs,
+                                               const int channels) {
+    // f = Gp.U.transpose(Gp) with the pseudo-inverse
+    // Gp = inverse(transpose(G).G).transpose(G), as G is 6x3
+    const auto G = std::array<float, 3 * WINOGRAD_ALPHA>
+                    { 1.0f,        0.0f,      0.0f,
+                      -2.0f/3.0f, -SQ2/3.0f, -1.0f/3.0f,
+                      -2.0f/3.0f,  SQ2/3.0f, -1.0f/3.0f,
+                      1.0f/6.0f,   SQ2/6.0f,  1.0f/3.0f,
+                      1.0f/6.0f,  -SQ2/6.0f,  1.0f/3.0f,
+                      0.0f,        0.0f,      1.0f};
+    double GtG[3][3];
+    for (auto i = 0; i < 3; i++) {
+        for (auto j = 0; j < 3; j++) {
+            GtG[i][j] = 0.0;
+            for (auto k = 0; k < WINOGRAD_ALPHA; k++) {
+                GtG[i][j] += G[k*3 + i] * G[k*3 + j];
+            }
+        }
+    }
+    const auto det = GtG[0][0] * (GtG[1][1]*GtG[2][2] - GtG[1][2]*GtG[2][1])
+                   - GtG[0][1] * (GtG[1][0]*GtG[2][2] - GtG[1][2]*GtG[2][0])
+                   + GtG[0][2] * (GtG[1][0]*GtG[2][1] - GtG[1][1]*GtG[2][0]);
+    double inv[3][3];
+    for (auto i = 0; i < 3; i++) {
+        for (auto j = 0; j < 3; j++) {
+            // cofactor of (j, i)
+            const auto r0 = (j + 1) % 3, r1 = (j + 2) % 3;
+            const auto c0 = (i + 1) % 3, c1 = (i + 2) % 3;
+            inv[i][j] = (GtG[r0][c0]*GtG[r1][c1] - GtG[r0][c1]*GtG[r1][c0]) / det;
+        }
+    }
+    auto Gp = std::array<float, 3 * WINOGRAD_ALPHA>{};
+    for (auto i = 0; i < 3; i++) {
+        for (auto k = 0; k < WINOGRAD_ALPHA; k++) {
+            auto acc = 0.0;
+            for (auto j = 0; j < 3; j++) {
+                acc += inv[i][j] * G[k*3 + j];
+            }
+            Gp[i*WINOGRAD_ALPHA + k] = acc;
+        }
+    }
+
+    auto f = std::vector<float>(outputs * channels * 9);
+    for (auto o = 0; o < outputs; o++) {
+        for (auto c = 0; c < channels; c++) {
+            float temp[3][WINOGRAD_ALPHA];
+            for (auto i = 0; i < 3; i++) {
+                for (auto nu = 0; nu < WINOGRAD_ALPHA; nu++) {
+                    auto acc = 0.0f;
+                    for (auto xi = 0; xi < WINOGRAD_ALPHA; xi++) {
+                        acc += Gp[i*WINOGRAD_ALPHA + xi]
+                            * U[(xi*WINOGRAD_ALPHA + nu) * outputs * channels
+                                + c * outputs + o];
+                    }
+                    temp[i][nu] = acc;
+                }
+            }
+            for (auto i = 0; i < 3; i++) {
+                for (auto j = 0; j < 3; j++) {
+                    auto acc = 0.0f;
+                    for (auto nu = 0; nu < WINOGRAD_ALPHA; nu++) {
+                        acc += temp[i][nu] * Gp[j*WINOGRAD_ALPHA + nu];
+                    }
+                    f[o*channels*9 + c*9 + i*3 + j] = acc;
+                }
+            }
+        }
+    }
+    return f;
+}
+
 std::pair<int, int> Network::load_v1_network(std::istream& wtfile) {
     // Count size of the network
     myprintf("Detecting residual layers...");
@@ -370,6 +448,202 @@ std::pair<int, int> Network::load_v1_network(std::istream& wtfile) {
     return {channels, static_cast<int>(residual_blocks)};
 }
 
+// Binary weights file: a 64 byte header, a table of (offset, count) for
+// every float array, then the arrays themselves aligned to 64 bytes.
+// Convolution weights are stored after winograd_transform_f() and the
+// biases are already folded into the batchnorm means, so loading it is
+// only copying out of the mapped file. crc64 is the same CRC-64 as xz uses
+// and covers everything after the header.
+namespace {
+constexpr char BINARY_MAGIC[8] = {'A', 'Z', 'W', 'B', 'I', 'N', '1', '\n'};
+constexpr auto BINARY_VERSION = std::uint32_t{1};
+constexpr auto BINARY_ALIGN = size_t{64};
+
+struct BinaryHeader {
+    char magic[8];
+    std::uint32_t version;
+    std::uint32_t channels;
+    std::uint32_t residual_blocks;
+    std::uint32_t value_head_not_stm;
+    std::uint32_t num_blobs;
+    std::uint32_t reserved;
+    std::uint64_t payload_size;
+    std::uint64_t crc64;
+    char padding[16];
+};
+static_assert(sizeof(BinaryHeader) == 64, "BinaryHeader must be 64 bytes");
+
+struct BinaryBlob {
+    std::uint64_t offset;
+    std::uint64_t count;
+};
+}
+
+bool Network::is_binary_network_file(const std::string& filename) {
+    std::ifstream ifs(filename, std::ios::binary);
+    char magic[sizeof(BINARY_MAGIC)];
+    if (!ifs.read(magic, sizeof(magic))) return false;
+    return std::memcmp(magic, BINARY_MAGIC, sizeof(magic)) == 0;
+}
+
+std::pair<int, int> Network::load_binary_network(const std::string& filename) {
+    const Utils::MappedFile file(filename);
+    if (file.size() < sizeof(BinaryHeader)) {
+        myprintf("Could not read binary weights file: %s\n", filename.c_str());
+        return {0, 0};
+    }
+    auto header = BinaryHeader{};
+    std::memcpy(&header, file.data(), sizeof(header));
+    if (std::memcmp(header.magic, BINARY_MAGIC, sizeof(BINARY_MAGIC)) != 0
+        || header.version != BINARY_VERSION
+        || header.payload_size != file.size() - sizeof(header)) {
+        myprintf("Binary weights file is broken or the wrong version.\n");
+        return {0, 0};
+    }
+    const auto payload = file.data() + sizeof(header);
+    if (Utils::crc64_xz(payload, header.payload_size) != header.crc64) {
+        myprintf("Binary weights file has a bad crc64.\n");
+        return {0, 0};
+    }
+
+    const auto channels = int(header.channels);
+    const auto residual_blocks = int(header.residual_blocks);
+    const auto layers = size_t(1 + residual_blocks * 2);
+    if (header.num_blobs != layers * 4 + 14
+        || header.num_blobs > header.payload_size / sizeof(BinaryBlob)) {
+        myprintf("Binary weights file has a bad blob table.\n");
+        return {0, 0};
+    }
+    auto blobs = std::vector<BinaryBlob>(header.num_blobs);
+    std::memcpy(blobs.data(), payload, blobs.size() * sizeof(BinaryBlob));
+    // Compared so that nothing can wrap around, whatever the table says
+    const auto table_end = sizeof(header) + blobs.size() * sizeof(BinaryBlob);
+    for (const auto& b : blobs) {
+        if (b.offset % BINARY_ALIGN != 0
+            || b.offset < table_end || b.offset > file.size()
+            || b.count > (file.size() - b.offset) / sizeof(float)) {
+            myprintf("Binary weights file has a bad blob table.\n");
+            return {0, 0};
+        }
+    }
+
+    auto index = size_t{0};
+    auto next = [&](std::vector<float>& v) {
+        const auto& b = blobs[index++];
+        const auto p = reinterpret_cast<const float*>(file.data() + b.offset);
+        v.assign(p, p + b.count);
+    };
+    auto next_array = [&](float* dst, size_t size) {
+        const auto& b = blobs[index++];
+        if (b.count != size) return false;
+        std::memcpy(dst, file.data() + b.offset, size * sizeof(float));
+        return true;
+    };
+
+    m_value_head_not_stm = header.value_head_not_stm != 0;
+    m_fwd_weights->m_conv_weights.resize(layers);
+    m_fwd_weights->m_conv_biases.resize(layers);
+    m_fwd_weights->m_batchnorm_means.resize(layers);
+    m_fwd_weights->m_batchnorm_stddevs.resize(layers);
+    for (auto i = size_t{0}; i < layers; i++) {
+        next(m_fwd_weights->m_conv_weights[i]);
+        next(m_fwd_weights->m_conv_biases[i]);
+        next(m_fwd_weights->m_batchnorm_means[i]);
+        next(m_fwd_weights->m_batchnorm_stddevs[i]);
+    }
+    next(m_fwd_weights->m_conv_pol_w);
+    next(m_fwd_weights->m_conv_pol_b);
+    auto ok = next_array(m_bn_pol_w1.data(), m_bn_pol_w1.size());
+    ok = next_array(m_bn_pol_w2.data(), m_bn_pol_w2.size()) && ok;
+    next(m_conv2_pol_w);
+    next(m_conv2_pol_b);
+    next(m_fwd_weights->m_conv_val_w);
+    next(m_fwd_weights->m_conv_val_b);
+    ok = next_array(m_bn_val_w1.data(), m_bn_val_w1.size()) && ok;
+    ok = next_array(m_bn_val_w2.data(), m_bn_val_w2.size()) && ok;
+    ok = next_array(m_ip1_val_w.data(), m_ip1_val_w.size()) && ok;
+    ok = next_array(m_ip1_val_b.data(), m_ip1_val_b.size()) && ok;
+    ok = next_array(m_ip2_val_w.data(), m_ip2_val_w.size()) && ok;
+    ok = next_array(m_ip2_val_b.data(), m_ip2_val_b.size()) && ok;
+    if (!ok) {
+        myprintf("Binary weights file does not match the value/policy heads.\n");
+        return {0, 0};
+    }
+    myprintf("Loaded binary weights: %d channels, %d blocks.\n",
+             channels, residual_blocks);
+    return {channels, residual_blocks};
+}
+
+// Writes the weights as prepared by prepare_weights(), i.e. exactly what
+// is handed to the forward pipes.
+bool Network::save_binary_network(const std::string& filename) const {
+    auto blobs = std::vector<std::pair<const float*, size_t>>{};
+    auto add = [&](const float* p, size_t size) { blobs.emplace_back(p, size); };
+    auto add_vector = [&](const std::vector<float>& v) { add(v.data(), v.size()); };
+
+    const auto layers = m_fwd_weights->m_conv_weights.size();
+    for (auto i = size_t{0}; i < layers; i++) {
+        add_vector(m_fwd_weights->m_conv_weights[i]);
+        add_vector(m_fwd_weights->m_conv_biases[i]);
+        add_vector(m_fwd_weights->m_batchnorm_means[i]);
+        add_vector(m_fwd_weights->m_batchnorm_stddevs[i]);
+    }
+    add_vector(m_fwd_weights->m_conv_pol_w);
+    add_vector(m_fwd_weights->m_conv_pol_b);
+    add(m_bn_pol_w1.data(), m_bn_pol_w1.size());
+    add(m_bn_pol_w2.data(), m_bn_pol_w2.size());
+    add_vector(m_conv2_pol_w);
+    add_vector(m_conv2_pol_b);
+    add_vector(m_fwd_weights->m_conv_val_w);
+    add_vector(m_fwd_weights->m_conv_val_b);
+    add(m_bn_val_w1.data(), m_bn_val_w1.size());
+    add(m_bn_val_w2.data(), m_bn_val_w2.size());
+    add(m_ip1_val_w.data(), m_ip1_val_w.size());
+    add(m_ip1_val_b.data(), m_ip1_val_b.size());
+    add(m_ip2_val_w.data(), m_ip2_val_w.size());
+    add(m_ip2_val_b.data(), m_ip2_val_b.size());
+
+    auto align = [](size_t n) { return (n + BINARY_ALIGN - 1) / BINARY_ALIGN * BINARY_ALIGN; };
+    auto table = std::vector<BinaryBlob>(blobs.size());
+    auto offset = align(sizeof(BinaryHeader) + table.size() * sizeof(BinaryBlob));
+    for (auto i = size_t{0}; i < blobs.size(); i++) {
+        table[i].offset = offset;
+        table[i].count = blobs[i].second;
+        offset = align(offset + blobs[i].second * sizeof(float));
+    }
+
+    auto buffer = std::vector<char>(offset, 0);
+    std::memcpy(buffer.data() + sizeof(BinaryHeader), table.data(),
+                table.size() * sizeof(BinaryBlob));
+    for (auto i = size_t{0}; i < blobs.size(); i++) {
+        std::memcpy(buffer.data() + table[i].offset, blobs[i].first,
+                    blobs[i].second * sizeof(float));
+    }
+
+    auto header = BinaryHeader{};
+    std::memcpy(header.magic, BINARY_MAGIC, sizeof(BINARY_MAGIC));
+    header.version = BINARY_VERSION;
+    header.channels = m_fwd_weights->m_batchnorm_means[0].size();
+    header.residual_blocks = (layers - 1) / 2;
+    header.value_head_not_stm = m_value_head_not_stm;
+    header.num_blobs = blobs.size();
+    header.payload_size = buffer.size() - sizeof(BinaryHeader);
+    header.crc64 = Utils::crc64_xz(buffer.data() + sizeof(BinaryHeader),
+                            header.payload_size);
+    std::memcpy(buffer.data(), &header, sizeof(header));
+
+    std::ofstream ofs(filename, std::ios::binary | std::ios::trunc);
+    ofs.write(buffer.data(), buffer.size());
+    ofs.close();
+    if (!ofs) {
+        myprintf("Could not write binary weights file: %s\n", filename.c_str());
+        return false;
+    }
+    myprintf("Wrote binary weights: %s (crc64 %016llx)\n", filename.c_str(),
+             static_cast<unsigned long long>(header.crc64));
+    return true;
+}
+
 std::pair<int, int> Network::load_network_file(const std::string& filename) {
     // gzopen supports both gz and non-gz files, will decompress
     // or just read directly as needed.
@@ -439,6 +713,20 @@ std::unique_ptr<ForwardPipe> Network::init_net(int channels,
     return pipe;
 }
 
+// With several search threads their evaluations are batched together.
+static std::unique_ptr<ForwardPipe> make_cpu_pipe() {
+    auto pipe = std::unique_ptr<ForwardPipe>();
+    if (cfg_cpu_int8) {
+        pipe = std::make_unique<Int8Pipe>();
+    } else {
+        pipe = std::make_unique<CPUPipe>();
+    }
+    if (cfg_num_threads > 1) {
+        return std::make_unique<CPUScheduler>(std::move(pipe));
+    }
+    return pipe;
+}
+
 #ifdef USE_HALF
 void Network::select_precision(int channels) {
     if (cfg_precision == precision_t::AUTO) {
@@ -517,6 +805,49 @@ void Network::select_precision(int channels) {
 }
 #endif
 
+// Winograd transform the convolutions and fold the biases into batchnorm,
+// as the forward pipes expect.
+void Network::prepare_weights(size_t channels, size_t residual_blocks) {
+    auto weight_index = size_t{0};
+    // Input convolution
+    // Winograd transform convolution weights
+    m_fwd_weights->m_conv_weights[weight_index] =
+        winograd_transform_f(m_fwd_weights->m_conv_weights[weight_index],
+                             channels, INPUT_CHANNELS);
+    weight_index++;
+
+    // Residual block convolutions
+    for (auto i = size_t{0}; i < residual_blocks * 2; i++) {
+        m_fwd_weights->m_conv_weights[weight_index] =
+            winograd_transform_f(m_fwd_weights->m_conv_weights[weight_index],
+                                 channels, channels);
+        weight_index++;
+    }
+
+    // Biases are not calculated and are typically zero but some networks might
+    // still have non-zero biases.
+    // Move biases to batchnorm means to make the output match without having
+    // to separately add the biases.
+    auto bias_size = m_fwd_weights->m_conv_biases.size();
+    for (auto i = size_t{0}; i < bias_size; i++) {
+        auto means_size = m_fwd_weights->m_batchnorm_means[i].size();
+        for (auto j = size_t{0}; j < means_size; j++) {
+            m_fwd_weights->m_batchnorm_means[i][j] -= m_fwd_weights->m_conv_biases[i][j];
+            m_fwd_weights->m_conv_biases[i][j] = 0.0f;
+        }
+    }
+
+    for (auto i = size_t{0}; i < m_bn_val_w1.size(); i++) {
+        m_bn_val_w1[i] -= m_fwd_weights->m_conv_val_b[i];
+        m_fwd_weights->m_conv_val_b[i] = 0.0f;
+    }
+
+    for (auto i = size_t{0}; i < m_bn_pol_w1.size(); i++) {
+        m_bn_pol_w1[i] -= m_fwd_weights->m_conv_pol_b[i];
+        m_fwd_weights->m_conv_pol_b[i] = 0.0f;
+    }
+}
+
 void Network::initialize(int /*playouts*/, const std::string & weightsfile) {
 #ifdef USE_BLAS
 #ifndef __APPLE__
@@ -557,54 +888,28 @@ void Network::initialize(int /*playouts*/, const std::string & weightsfile) {
 */
     // Load network from file
     size_t channels, residual_blocks;
-    std::tie(channels, residual_blocks) = load_network_file(weightsfile);
-    if (channels == 0) {
-        exit(EXIT_FAILURE);
-    }
-
-    auto weight_index = size_t{0};
-    // Input convolution
-    // Winograd transform convolution weights
-    m_fwd_weights->m_conv_weights[weight_index] =
-        winograd_transform_f(m_fwd_weights->m_conv_weights[weight_index],
-                             channels, INPUT_CHANNELS);
-    weight_index++;
-
-    // Residual block convolutions
-    for (auto i = size_t{0}; i < residual_blocks * 2; i++) {
-        m_fwd_weights->m_conv_weights[weight_index] =
-            winograd_transform_f(m_fwd_weights->m_conv_weights[weight_index],
-                                 channels, channels);
-        weight_index++;
-    }
-
-    // Biases are not calculated and are typically zero but some networks might
-    // still have non-zero biases.
-    // Move biases to batchnorm means to make the output match without having
-    // to separately add the biases.
-    auto bias_size = m_fwd_weights->m_conv_biases.size();
-    for (auto i = size_t{0}; i < bias_size; i++) {
-        auto means_size = m_fwd_weights->m_batchnorm_means[i].size();
-        for (auto j = size_t{0}; j < means_size; j++) {
-            m_fwd_weights->m_batchnorm_means[i][j] -= m_fwd_weights->m_conv_biases[i][j];
-            m_fwd_weights->m_conv_biases[i][j] = 0.0f;
+    if (is_binary_network_file(weightsfile)) {
+        // Already transformed. Nothing to do but copy it out.
+        std::tie(channels, residual_blocks) = load_binary_network(weightsfile);
+        if (channels == 0) {
+            exit(EXIT_FAILURE);
         }
+    } else {
+        std::tie(channels, residual_blocks) = load_network_file(weightsfile);
+        if (channels == 0) {
+            exit(EXIT_FAILURE);
+        }
+        prepare_weights(channels, residual_blocks);
     }
-
-    for (auto i = size_t{0}; i < m_bn_val_w1.size(); i++) {
-        m_bn_val_w1[i] -= m_fwd_weights->m_conv_val_b[i];
-        m_fwd_weights->m_conv_val_b[i] = 0.0f;
-    }
-
-    for (auto i = size_t{0}; i < m_bn_pol_w1.size(); i++) {
-        m_bn_pol_w1[i] -= m_fwd_weights->m_conv_pol_b[i];
-        m_fwd_weights->m_conv_pol_b[i] = 0.0f;
+    if (!cfg_binary_weightsfile.empty()
+        && !save_binary_network(cfg_binary_weightsfile)) {
+        exit(EXIT_FAILURE);
     }
 
 #ifdef USE_OPENCL
-    if (cfg_cpu_only) {
+    if (cfg_cpu_only || cfg_cpu_int8) {
         myprintf("Initializing CPU-only evaluation.\n");
-        m_forward = init_net(channels, std::make_unique<CPUPipe>());
+        m_forward = init_net(channels, make_cpu_pipe());
     } else {
 #ifdef USE_OPENCL_SELFCHECK
         // initialize CPU reference first, so that we can self-check
@@ -624,8 +929,13 @@ void Network::initialize(int /*playouts*/, const std::string & weightsfile) {
 
 #else //!USE_OPENCL
     myprintf("Initializing CPU-only evaluation.\n");
-    m_forward = init_net(channels, std::make_unique<CPUPipe>());
+    m_forward = init_net(channels, make_cpu_pipe());
 #endif
+    if (cfg_cpu_int8) {
+        // float reference for the self-check, and the fallback if it fails
+        m_forward_cpu = init_net(channels, std::make_unique<CPUPipe>());
+        m_int8_failed = false;
+    }
 
     // Need to estimate size before clearing up the pipe.
     get_estimated_size();
@@ -636,25 +946,24 @@ template<unsigned int inputs,
          unsigned int outputs,
          bool ReLU,
          size_t W>
-std::vector<float> innerproduct(const std::vector<float>& input,
-                                const std::array<float, W>& weights,
-                                const std::array<float, outputs>& biases) {
-    std::vector<float> output(outputs);
-
+void innerproduct(const float* const input,
+                  const std::array<float, W>& weights,
+                  const std::array<float, outputs>& biases,
+                  float* const output) {
 #ifdef USE_BLAS
     cblas_sgemv(CblasRowMajor, CblasNoTrans,
                 // M     K
                 outputs, inputs,
                 1.0f, &weights[0], inputs,
-                &input[0], 1,
-                0.0f, &output[0], 1);
+                input, 1,
+                0.0f, output, 1);
 #else
-    EigenVectorMap<float> y(output.data(), outputs);
+    EigenVectorMap<float> y(output, outputs);
     y.noalias() =
         ConstEigenMatrixMap<float>(weights.data(),
                                    inputs,
                                    outputs).transpose()
-        * ConstEigenVectorMap<float>(input.data(), inputs);
+        * ConstEigenVectorMap<float>(input, inputs);
 #endif
     const auto lambda_ReLU = [](const auto val) { return (val > 0.0f) ?
                                                           val : 0.0f; };
@@ -665,13 +974,24 @@ std::vector<float> innerproduct(const std::vector<float>& input,
         }
         output[o] = val;
     }
+}
 
+template<unsigned int inputs,
+         unsigned int outputs,
+         bool ReLU,
+         size_t W>
+std::vector<float> innerproduct(const std::vector<float>& input,
+                                const std::array<float, W>& weights,
+                                const std::array<float, outputs>& biases) {
+    std::vector<float> output(outputs);
+    innerproduct<inputs, outputs, ReLU>(input.data(), weights, biases,
+                                        output.data());
     return output;
 }
 
 template <size_t spatial_size>
 void batchnorm(const size_t channels,
-               std::vector<float>& data,
+               float* const data,
                const float* const means,
                const float* const stddivs,
                const float* const eltwise = nullptr) {
@@ -697,7 +1017,6 @@ void batchnorm(const size_t channels,
     }
 }
 
-#ifdef USE_OPENCL_SELFCHECK
 /*
 void Network::compare_net_outputs(const Netresult& data,
                                   const Netresult& ref) {
@@ -745,10 +1064,33 @@ T relative_difference(T a, T b) {
     return std::max(fabs((a - b) / a), fabs((a - b) / b));
 }
 
+// The policy is a probability distribution, so the L1 distance between the
+// INT8 and float policies is at most 2, and 0.2 means 10% of the probability
+// mass moved. INT8 rounding alone stays around 0.03 (max 0.04 over 3000
+// positions of a test net), so only a broken quantization goes over 0.2.
+static constexpr auto INT8_POLICY_L1_MAX = 0.2f;
+
 //void compare_net_outputs(std::vector<float>& data,
 //                         std::vector<float>& ref) {
 void Network::compare_net_outputs(std::vector<scored_node>& data,
                                   std::vector<scored_node>& ref) {
+    if (cfg_cpu_int8) {
+        // INT8 rounding moves every probability a little, so compare the
+        // whole distribution instead. A mismatch is not fatal: the search
+        // threads are in the middle of a move, so switch to the float
+        // pipe and keep playing.
+        auto distance = 0.0f;
+        for (auto idx = size_t{0}; idx < data.size(); ++idx) {
+            distance += std::fabs(data[idx].first - ref[idx].first);
+        }
+        if (distance > INT8_POLICY_L1_MAX || std::isnan(distance)) {
+            myprintf("Error in INT8 calculation: policy differs from float "
+                     "by %f (limit %.2f). Using float evaluation from now on.\n",
+                     distance, INT8_POLICY_L1_MAX);
+            m_int8_failed = true;
+        }
+        return;
+    }
     // We accept an error up to 5%, but output values
     // smaller than 1/1000th are "rounded up" for the comparison.
     constexpr float relative_error = 5e-2f;
@@ -763,7 +1105,6 @@ void Network::compare_net_outputs(std::vector<scored_node>& data,
         }
     }
 }
-#endif
 
 std::vector<float> softmax(const std::vector<float>& input,
                            const float temperature = 1.0f) {
@@ -855,20 +1196,16 @@ Network::Netresult_old Network::get_output(
 */
 //        const auto rand_sym = Random::get_Rng().randfix<NUM_SYMMETRIES>();
         result = get_output_internal(planes);
-#ifdef USE_OPENCL_SELFCHECK
-        // Both implementations are available, self-check the OpenCL driver by
-        // running both with a probability of 1/2000.
+        // Both implementations are available, self-check the OpenCL driver
+        // (or the INT8 evaluation) by running both with a probability of 1/2000.
         // selfcheck is done here because this is the only place NN
         // evaluation is done on actual gameplay.
-        if (m_forward_cpu != nullptr
+        if (m_forward_cpu != nullptr && !m_int8_failed
             && (force_selfcheck || Random::get_Rng().randfix<SELFCHECK_PROBABILITY>() == 0)
         ) {
             auto result_ref = get_output_internal(planes, true);
             compare_net_outputs(result.first, result_ref.first);
         }
-#else
-        (void)force_selfcheck;
-#endif
 /*
     }
 */
@@ -908,26 +1245,34 @@ Network::Netresult_old Network::get_output_internal(
     }
 	if ( 0 ) { float s=0; for (size_t i=0; i<input_data.size(); i++) s += input_data[i]; myprintf("input_data.size()=%d,sum=%f\n",input_data.size(),s); }
 
+    return get_output_internal(input_data, selfcheck);
+}
+
+Network::Netresult_old Network::get_output_internal(
+    const std::vector<float>& input_data, bool selfcheck) {
+    constexpr auto width = BOARD_SIZE;
+    constexpr auto height = BOARD_SIZE;
 
     std::vector<float> policy_data(OUTPUTS_POLICY * width * height);
     std::vector<float> value_data(OUTPUTS_VALUE * width * height);
-#ifdef USE_OPENCL_SELFCHECK
     if (selfcheck) {
         m_forward_cpu->forward(input_data, policy_data, value_data);
     } else {
-        m_forward->forward(input_data, policy_data, value_data);
+        forward_pipe().forward(input_data, policy_data, value_data);
     }
-#else
-    m_forward->forward(input_data, policy_data, value_data);
-    (void) selfcheck;
-#endif
 
 	if ( 0 ) { float s=0; for (size_t i=0; i<policy_data.size(); i++) s += policy_data[i]; myprintf("policy_data.size()=%d,sum=%f\n",policy_data.size(),s); }
 	if ( 0 ) { float s=0; for (size_t i=0; i<value_data.size();  i++) s += value_data[i];  myprintf("value_data.size() =%d,sum=%f\n",value_data.size(),s); }
 
+    return get_output_heads(policy_data, value_data);
+}
+
+Network::Netresult_old Network::get_output_heads(
+    std::vector<float>& policy_data, std::vector<float>& value_data) {
+
     // Get the moves
 //    batchnorm<NUM_INTERSECTIONS>(OUTPUTS_POLICY, policy_data,  m_bn_pol_w1.data(), m_bn_pol_w2.data());
-    batchnorm<B_AREA>(OUTPUTS_POLICY, policy_data,  m_bn_pol_w1.data(), m_bn_pol_w2.data());
+    batchnorm<B_AREA>(OUTPUTS_POLICY, policy_data.data(),  m_bn_pol_w1.data(), m_bn_pol_w2.data());
 //    const auto policy_out =
 //        innerproduct<OUTPUTS_POLICY * NUM_INTERSECTIONS, POTENTIAL_MOVES, false>(
 //            policy_data, m_ip_pol_w, m_ip_pol_b);
@@ -942,7 +1287,7 @@ Network::Netresult_old Network::get_output_internal(
 
     // Now get the value
 //    batchnorm<NUM_INTERSECTIONS>(OUTPUTS_VALUE, value_data, m_bn_val_w1.data(), m_bn_val_w2.data());
-    batchnorm<B_AREA>(OUTPUTS_VALUE, value_data, m_bn_val_w1.data(), m_bn_val_w2.data());
+    batchnorm<B_AREA>(OUTPUTS_VALUE, value_data.data(), m_bn_val_w1.data(), m_bn_val_w2.data());
     const auto winrate_data =
 //        innerproduct<OUTPUTS_VALUE * NUM_INTERSECTIONS, VALUE_LAYER, true>( value_data, m_ip1_val_w, m_ip1_val_b);
         innerproduct<OUTPUTS_VALUE * B_AREA, VALUE_LAYER, true>( value_data, m_ip1_val_w, m_ip1_val_b);
@@ -1155,14 +1500,183 @@ size_t Network::get_estimated_size() {
 }
 
 size_t Network::get_estimated_cache_size() {
-    return m_nncache.get_estimated_size();
+    return m_nncache.get_estimated_size() + m_shogi_nncache.get_estimated_size();
 }
 
 void Network::nncache_resize(int max_count) {
     return m_nncache.resize(max_count);
 }
 
+void Network::nncache_allocate(size_t max_bytes) {
+    const auto count = std::min(max_bytes / ShogiNNCache::ENTRY_SIZE,
+                                size_t{ShogiNNCache::MAX_CACHE_COUNT});
+    m_shogi_nncache.resize(static_cast<int>(count));
+}
+
+void Network::nncache_dump_stats() {
+    m_shogi_nncache.dump_stats();
+}
+
+void Network::open_opening_cache(const std::string& filename) {
+    const Utils::MappedFile weights(cfg_weightsfile);
+    const auto crc = Utils::crc64_xz(weights.data(), weights.size());
+    m_opening_cache.open(filename, crc, cfg_softmax_temp);
+}
+
+void Network::save_opening_cache() {
+    m_opening_cache.save();
+}
+
+// FNV-1a over the active squares and the plane values
+static std::uint64_t sparse_input_hash(const ForwardPipe::SparseInput& input) {
+    auto h = std::uint64_t{0xcbf29ce484222325ULL};
+    const auto mix = [&h](const std::uint64_t v) {
+        h ^= v;
+        h *= 0x100000001b3ULL;
+    };
+    for (auto i = 0; i < input.m_num_ones; i++) {
+        mix(input.m_ones[i]);
+    }
+    for (const auto f : input.m_fill) {
+        std::uint32_t bits;
+        std::memcpy(&bits, &f, sizeof(bits));
+        mix(bits);
+    }
+    return h;
+}
+
+
 
+float Network::get_legal_heads(float* const policy_data,
+                               float* const value_data,
+                               const int* const move_ids,
+                               const int num_moves,
+                               float* const priors) {
+    // Policy: of the 139 x 81 outputs of the 1x1 convolution, only the
+    // ones of the legal moves are computed, then a softmax over them.
+    batchnorm<B_AREA>(OUTPUTS_POLICY, policy_data, m_bn_pol_w1.data(), m_bn_pol_w2.data());
+    std::array<float, B_AREA * OUTPUTS_POLICY> policy_t;
+    for (auto c = 0; c < OUTPUTS_POLICY; c++) {
+        for (auto sq = 0; sq < B_AREA; sq++) {
+            policy_t[sq * OUTPUTS_POLICY + c] = policy_data[c * B_AREA + sq];
+        }
+    }
+    auto alpha = -std::numeric_limits<float>::infinity();
+    for (auto i = 0; i < num_moves; i++) {
+        const auto plane = move_ids[i] / B_AREA;
+        const auto sq = move_ids[i] % B_AREA;
+        const auto w = &m_conv2_pol_w[plane * OUTPUTS_POLICY];
+        const auto in = &policy_t[sq * OUTPUTS_POLICY];
+        auto logit = m_conv2_pol_b[plane];
+        for (auto c = 0; c < OUTPUTS_POLICY; c++) {
+            logit += w[c] * in[c];
+        }
+        priors[i] = logit;
+        alpha = std::max(alpha, logit);
+    }
+    auto denom = 0.0f;
+    for (auto i = 0; i < num_moves; i++) {
+        priors[i] = std::exp((priors[i] - alpha) / cfg_softmax_temp);
+        denom += priors[i];
+    }
+    for (auto i = 0; i < num_moves; i++) {
+        priors[i] /= denom;
+    }
+
+    // Value
+    batchnorm<B_AREA>(OUTPUTS_VALUE, value_data, m_bn_val_w1.data(), m_bn_val_w2.data());
+    std::array<float, VALUE_LAYER> winrate_data;
+    innerproduct<OUTPUTS_VALUE * B_AREA, VALUE_LAYER, true>(
+        value_data, m_ip1_val_w, m_ip1_val_b, winrate_data.data());
+    std::array<float, 1> winrate_out;
+    innerproduct<VALUE_LAYER, 1, false>(
+        winrate_data.data(), m_ip2_val_w, m_ip2_val_b, winrate_out.data());
+    return std::tanh(winrate_out[0]);
+}
+
+void Network::get_legal_policy_value_yss_zero_batch(
+    const ForwardPipe::SparseInput* input, const int batch_size,
+    const int* const* move_ids, const int* num_moves,
+    float* const* priors, float* values) {
+    static_assert(ForwardPipe::SparseInput::CHANNELS == INPUT_CHANNELS,
+                  "SparseInput does not match the input planes");
+    constexpr auto pol_size = OUTPUTS_POLICY * B_AREA;
+    constexpr auto val_size = OUTPUTS_VALUE * B_AREA;
+    // Reused by the next calls of this search thread
+    thread_local auto policy_data = std::vector<float>();
+    thread_local auto value_data = std::vector<float>();
+    thread_local auto keys = std::vector<std::uint64_t>();
+    thread_local auto misses = std::vector<int>();
+    thread_local auto miss_input = std::vector<ForwardPipe::SparseInput>();
+
+    // Only the positions that are not in the cache go to the network
+    keys.resize(batch_size);
+    misses.clear();
+    for (auto i = 0; i < batch_size; i++) {
+        keys[i] = sparse_input_hash(input[i]);
+        if (m_opening_cache.enabled()
+            && input[i].move_number() <= OpeningCache::MAX_MOVE_NUMBER
+            && m_opening_cache.lookup(keys[i], num_moves[i], priors[i], values[i])) {
+            continue;
+        }
+        if (!m_shogi_nncache.lookup(keys[i], num_moves[i], priors[i], values[i])) {
+            misses.push_back(i);
+        }
+    }
+    const auto count = static_cast<int>(misses.size());
+    if (count == 0) {
+        return;
+    }
+    // net_input is indexed by j (misses), input keeps indexing by i
+    auto net_input = input;
+    if (count < batch_size) {
+        miss_input.resize(count);
+        for (auto j = 0; j < count; j++) {
+            miss_input[j] = input[misses[j]];
+        }
+        net_input = miss_input.data();
+    }
+
+    policy_data.resize(pol_size * count);
+    value_data.resize(val_size * count);
+    forward_pipe().forward_sparse(net_input, policy_data, value_data, count);
+
+    const auto selfcheck = m_forward_cpu != nullptr && !m_int8_failed
+        && Random::get_Rng().randfix<SELFCHECK_PROBABILITY>() == 0;
+    if (selfcheck) {
+        // Full policy of the first position for compare_net_outputs()
+        auto policy = std::vector<float>(begin(policy_data),
+                                         begin(policy_data) + pol_size);
+        auto value = std::vector<float>(begin(value_data),
+                                        begin(value_data) + val_size);
+        auto result = get_output_heads(policy, value);
+        auto input_data = std::vector<float>(INPUT_CHANNELS * B_AREA);
+        net_input[0].expand(input_data.data());
+        auto result_ref = get_output_internal(input_data, true);
+        compare_net_outputs(result.first, result_ref.first);
+    }
+
+    for (auto j = 0; j < count; j++) {
+        const auto i = misses[j];
+        values[i] = get_legal_heads(&policy_data[pol_size * j],
+                                    &value_data[val_size * j],
+                                    move_ids[i], num_moves[i], priors[i]);
+        m_shogi_nncache.insert(keys[i], num_moves[i], priors[i], values[i]);
+        if (m_opening_cache.enabled()
+            && input[i].move_number() <= OpeningCache::MAX_MOVE_NUMBER) {
+            m_opening_cache.insert(keys[i], num_moves[i], priors[i], values[i]);
+        }
+    }
+}
+
+float Network::get_legal_policy_value_yss_zero(
+    const ForwardPipe::SparseInput& input,
+    const int* move_ids, const int num_moves, float* priors) {
+    auto value = 0.0f;
+    get_legal_policy_value_yss_zero_batch(&input, 1, &move_ids, &num_moves,
+                                          &priors, &value);
+    return value;
+}
 
 Network::Netresult_old Network::get_scored_moves_yss_zero(float data[][B_SIZE][B_SIZE]) {
     Netresult_old result;
@@ -34,6 +34,7 @@
 
 #include "config.h"
 
+#include <atomic>
 #include <deque>
 #include <array>
 #include <memory>
@@ -127,15 +128,42 @@ public:
     size_t get_estimated_size();
     size_t get_estimated_cache_size();
     void nncache_resize(int max_count);
+    // Allocates the cache of the shogi evaluations in max_bytes at most.
+    void nncache_allocate(size_t max_bytes);
+    void nncache_dump_stats();
+    // Uses the evaluations of the opening positions in filename, and
+    // saves the new ones there with save_opening_cache().
+    void open_opening_cache(const std::string& filename);
+    void save_opening_cache();
 
     Netresult_old get_scored_moves_yss_zero(float data[][9][9]);
+    // Policy of the legal moves only: move_ids are their indexes in the
+    // 139 x 81 policy outputs, and priors gets a softmax over just those
+    // moves, in the same order. Returns the value.
+    float get_legal_policy_value_yss_zero(const ForwardPipe::SparseInput& input,
+                                          const int* move_ids, const int num_moves,
+                                          float* priors);
+    void get_legal_policy_value_yss_zero_batch(
+      const ForwardPipe::SparseInput* input, const int batch_size,
+      const int* const* move_ids, const int* num_moves,
+      float* const* priors, float* values);
     static void gather_features_yss_zero(NNPlanes& planes, float data[][9][9]);
     static Netresult_old get_scored_moves_internal(
       const GameState* state, NNPlanes & planes, int rotation);
 
+    static bool is_binary_network_file(const std::string& filename);
+    bool save_binary_network(const std::string& filename) const;
+
+    // Gets the 3x3 filters [outputs][channels][9] back from the output of
+    // winograd_transform_f(), for the pipes that do not use Winograd.
+    static std::vector<float> winograd_inverse_f(const std::vector<float>& U,
+                                                 const int outputs, const int channels);
+
 private:
     std::pair<int, int> load_v1_network(std::istream& wtfile);
     std::pair<int, int> load_network_file(const std::string& filename);
+    std::pair<int, int> load_binary_network(const std::string& filename);
+    void prepare_weights(size_t channels, size_t residual_blocks);
 
     static std::vector<float> winograd_transform_f(const std::vector<float>& f,
                                                    const int outputs, const int channels);
@@ -161,6 +189,13 @@ private:
 //    Netresult_old get_output_internal(const GameState* const state,
 //                                  const int symmetry, bool selfcheck = false);
     Netresult_old get_output_internal( NNPlanes & planes, bool selfcheck = false);
+    Netresult_old get_output_internal(const std::vector<float>& input_data,
+                                      bool selfcheck = false);
+    Netresult_old get_output_heads(std::vector<float>& policy_data,
+                                   std::vector<float>& value_data);
+    float get_legal_heads(float* const policy_data, float* const value_data,
+                          const int* const move_ids, const int num_moves,
+                          float* const priors);
     static void fill_input_plane_pair(const FullBoard& board,
                                       std::vector<float>::iterator black,
                                       std::vector<float>::iterator white,
@@ -175,13 +210,21 @@ private:
     void select_precision(int channels);
 #endif
     std::unique_ptr<ForwardPipe> m_forward;
-#ifdef USE_OPENCL_SELFCHECK
 //    void compare_net_outputs(const Netresult& data, const Netresult& ref);
     void compare_net_outputs(std::vector<scored_node>& data, std::vector<scored_node>& ref);
+    // CPUPipe reference for the OpenCL or INT8 self-check
     std::unique_ptr<ForwardPipe> m_forward_cpu;
-#endif
+    // Set when the INT8 self-check fails. m_forward_cpu then does all
+    // the evaluations instead of m_forward.
+    std::atomic<bool> m_int8_failed{false};
+    ForwardPipe& forward_pipe() {
+        return m_int8_failed ? *m_forward_cpu : *m_forward;
+    }
 
     NNCache m_nncache;
+    // Evaluations of get_legal_policy_value_yss_zero*()
+    ShogiNNCache m_shogi_nncache;
+    OpeningCache m_opening_cache;
 
     size_t estimated_size{0};
 
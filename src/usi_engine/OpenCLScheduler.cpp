@@ -285,6 +285,50 @@ void OpenCLScheduler<net_t>::forward(const std::vector<float>& input,
     entry->cv.wait(lk);
 }
 
+template <typename net_t>
+void OpenCLScheduler<net_t>::forward_batch(const std::vector<float>& input,
+                                           std::vector<float>& output_pol,
+                                           std::vector<float>& output_val,
+                                           const size_t batch_size) {
+    const auto in_size = input.size() / batch_size;
+    const auto out_pol_size = output_pol.size() / batch_size;
+    const auto out_val_size = output_val.size() / batch_size;
+
+    // Queue all positions at once so that batch_worker can pick them up
+    // as full batches instead of waiting for m_waittime.
+    auto ins = std::vector<std::vector<float>>(batch_size);
+    auto outs_pol = std::vector<std::vector<float>>(batch_size,
+                        std::vector<float>(out_pol_size));
+    auto outs_val = std::vector<std::vector<float>>(batch_size,
+                        std::vector<float>(out_val_size));
+    auto entries = std::vector<std::shared_ptr<ForwardQueueEntry>>();
+    for (auto i = size_t{0}; i < batch_size; i++) {
+        ins[i].assign(begin(input) + in_size * i,
+                      begin(input) + in_size * (i + 1));
+        entries.push_back(std::make_shared<ForwardQueueEntry>(
+                              ins[i], outs_pol[i], outs_val[i]));
+    }
+    {
+        std::unique_lock<std::mutex> lk(m_mutex);
+        for (auto & entry : entries) {
+            m_forward_queue.push_back(entry);
+        }
+    }
+    m_cv.notify_all();
+
+    for (auto i = size_t{0}; i < batch_size; i++) {
+        auto & entry = entries[i];
+        {
+            std::unique_lock<std::mutex> lk(entry->mutex);
+            entry->cv.wait(lk, [&entry] () { return entry->done; });
+        }
+        std::copy(begin(outs_pol[i]), end(outs_pol[i]),
+                  begin(output_pol) + out_pol_size * i);
+        std::copy(begin(outs_val[i]), end(outs_val[i]),
+                  begin(output_val) + out_val_size * i);
+    }
+}
+
 #ifndef NDEBUG
 struct batch_stats_t batch_stats;
 #endif
@@ -405,6 +449,10 @@ void OpenCLScheduler<net_t>::batch_worker(const size_t gnum) {
             std::copy(begin(batch_output_val) + out_val_size * index,
                       begin(batch_output_val) + out_val_size * (index + 1),
                       begin(x->out_v));
+            {
+                std::unique_lock<std::mutex> lk(x->mutex);
+                x->done = true;
+            }
             x->cv.notify_all();
             index++;
         }
@@ -32,9 +32,12 @@
 #include "config.h"
 #include "Utils.h"
 
+#include <array>
 #include <mutex>
 #include <cstdarg>
 #include <cstdio>
+#include <fstream>
+#include <iterator>
 
 #include <boost/filesystem.hpp>
 #include <boost/math/distributions/students_t.hpp>
@@ -46,6 +49,9 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <pwd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #endif
 
 #include "GTP.h"
@@ -237,3 +243,50 @@ const std::string Utils::leelaz_file(std::string file) {
     dir /= file;
     return dir.string();
 }
+
+std::uint64_t Utils::crc64_xz(const char* p, size_t len) {
+    static std::array<std::uint64_t, 256> table = [] {
+        auto t = std::array<std::uint64_t, 256>{};
+        for (auto i = 0; i < 256; i++) {
+            auto crc = std::uint64_t(i);
+            for (auto j = 0; j < 8; j++) {
+                crc = (crc >> 1) ^ ((crc & 1) ? 0xC96C5795D7870F42ULL : 0);
+            }
+            t[i] = crc;
+        }
+        return t;
+    }();
+    auto crc = ~std::uint64_t{0};
+    for (auto i = size_t{0}; i < len; i++) {
+        crc = table[(crc ^ static_cast<unsigned char>(p[i])) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+Utils::MappedFile::MappedFile(const std::string& filename) {
+#ifdef _WIN32
+    std::ifstream ifs(filename, std::ios::binary);
+    m_buffer.assign(std::istreambuf_iterator<char>(ifs),
+                    std::istreambuf_iterator<char>());
+    m_data = m_buffer.data();
+    m_size = m_buffer.size();
+#else
+    const auto fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) return;
+    struct stat sb;
+    if (fstat(fd, &sb) == 0 && sb.st_size > 0) {
+        auto p = mmap(nullptr, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p != MAP_FAILED) {
+            m_data = static_cast<const char*>(p);
+            m_size = sb.st_size;
+        }
+    }
+    close(fd);
+#endif
+}
+
+Utils::MappedFile::~MappedFile() {
+#ifndef _WIN32
+    if (m_data) munmap(const_cast<char*>(m_data), m_size);
+#endif
+}
@@ -33,8 +33,10 @@
 #include "config.h"
 
 #include <atomic>
+#include <cstdint>
 #include <limits>
 #include <string>
+#include <vector>
 
 #include "ThreadPool.h"
 
@@ -70,6 +72,28 @@ namespace Utils {
 
     void create_z_table();
     float cached_t_quantile(int v);
+
+    // The same CRC-64 as xz uses
+    std::uint64_t crc64_xz(const char* p, size_t len);
+
+    // Read-only view of a whole file. mmap where available.
+    class MappedFile {
+    public:
+        explicit MappedFile(const std::string& filename);
+        ~MappedFile();
+        MappedFile(const MappedFile&) = delete;
+        MappedFile& operator=(const MappedFile&) = delete;
+
+        const char* data() const { return m_data; }
+        size_t size() const { return m_size; }
+
+    private:
+        const char* m_data{nullptr};
+        size_t m_size{0};
+#ifdef _WIN32
+        std::vector<char> m_buffer;
+#endif
+    };
 }
 
 #endif
@@ -425,7 +425,8 @@ interpret_CSA_move( tree_t * restrict ptree, unsigned int *pmove,
 const char *
 str_CSA_move( unsigned int move )
 {
-  static char str[7];
+  /* aobaz -g searches several games at once */
+  static thread_local char str[7];
   int ifrom, ito, ipiece_move, is_promote;
 
   is_promote  = (int)I2IsPromote(move);
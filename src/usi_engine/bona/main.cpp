@@ -77,6 +77,9 @@ main()
       else if ( iret == -3 ) { break; }
     }
 
+#if defined(YSS_ZERO)
+  save_opening_cache();
+#endif
   if ( fin() < 0 ) { out_error( "%s", str_error ); }
 
   return EXIT_SUCCESS;
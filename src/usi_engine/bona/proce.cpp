@@ -54,6 +54,10 @@ static int CONV proce_usi( tree_t * restrict ptree );
 static int CONV usi_posi( tree_t * restrict ptree, char **lasts );
 static int CONV usi_go( tree_t * restrict ptree, char **lasts );
 static int CONV usi_ignore( tree_t * restrict ptree, char **lasts );
+static int CONV usi_setoption( char **lasts );
+#  if defined(YSS_ZERO)
+static int CONV usi_game( tree_t * restrict ptree, char **lasts );
+#  endif
 #endif
 
 #if defined(TLP)
@@ -428,6 +432,19 @@ static int CONV proce_usi( tree_t * restrict ptree )
       return 1;
     }
 
+  if ( ! strcmp( token, "usinewgame" ) )
+    {
+#if defined(YSS_ZERO)
+      usi_newgame( -1 );
+#endif
+      return 1;
+    }
+
+  if ( ! strcmp( token, "setoption" ) )
+    {
+      return usi_setoption( &lasts );
+    }
+
   if ( ! strcmp( token, "echo" ) )
     {
       USIOut( "%s\n", lasts );
@@ -454,7 +471,12 @@ static int CONV proce_usi( tree_t * restrict ptree )
 
   if ( ! strcmp( token, "stop" ) )     { return cmd_move_now(); }
   if ( ! strcmp( token, "position" ) ) { return usi_posi( ptree, &lasts ); }
+#if defined(YSS_ZERO)
+  if ( ! strcmp( token, "g" ) )        { return usi_game( ptree, &lasts ); }
+  if ( ! strcmp( token, "quit" ) )     { uct_game_wait_all(); return cmd_quit(); }
+#else
   if ( ! strcmp( token, "quit" ) )     { return cmd_quit(); }
+#endif
   if ( ! strcmp( token, "d" ) ) {
 /*
     fprintf(stderr,"print board\n");
@@ -477,6 +499,115 @@ static int CONV proce_usi( tree_t * restrict ptree )
 }
 
 
+static int CONV
+usi_setoption( char **lasts )
+{
+  const char *name, *token;
+
+  token = strtok_r( NULL, str_delimiters, lasts );
+  name  = strtok_r( NULL, str_delimiters, lasts );
+  if ( token == NULL || strcmp( token, "name" ) || name == NULL )
+    {
+      str_error = str_bad_cmdline;
+      return -1;
+    }
+
+  token = strtok_r( NULL, str_delimiters, lasts );
+  if ( token == NULL || strcmp( token, "value" ) )
+    {
+      str_error = str_bad_cmdline;
+      return -1;
+    }
+
+  /* the value is the rest of the line so that a path may contain spaces */
+  token = strtok_r( NULL, "\n", lasts );
+  if ( token == NULL )
+    {
+      str_error = str_bad_cmdline;
+      return -1;
+    }
+
+#if defined(YSS_ZERO)
+  if ( ! strcmp( name, "WeightsFile" ) )
+    {
+      uct_game_wait_all();
+      reload_network( token );
+      usi_newgame( -1 );
+      return 1;
+    }
+#endif
+
+  fprintf( stderr, "usi unknown option %s\n", name );
+  return 1;
+}
+
+
+#if defined(YSS_ZERO)
+/* "g <n> usinewgame", "g <n> position ...", "g <n> go [visit]" drive the
+   n-th game of "aobaz -g K".  go starts the search and returns at once, so
+   that the other games can be sent while it runs.  The reply comes as
+   "g <n> bestmove ...". */
+static int CONV
+usi_game( tree_t * restrict ptree, char **lasts )
+{
+  const char *token;
+  char *ptr;
+  long l;
+  int iret;
+
+  token = strtok_r( NULL, str_delimiters, lasts );
+  if ( token == NULL )
+    {
+      str_error = str_bad_cmdline;
+      return -1;
+    }
+
+  l = strtol( token, &ptr, 0 );
+  if ( ptr == token || l < 0 || l >= nUctGames )
+    {
+      str_error = str_bad_cmdline;
+      return -1;
+    }
+
+  token = strtok_r( NULL, str_delimiters, lasts );
+  if ( token == NULL )
+    {
+      str_error = str_bad_cmdline;
+      return -1;
+    }
+
+  if ( ! strcmp( token, "usinewgame" ) )
+    {
+      usi_newgame( (int)l );
+      return 1;
+    }
+
+  if ( ! strcmp( token, "position" ) )
+    {
+      iret = usi_posi( ptree, lasts );
+      if ( iret < 0 ) { return iret; }
+      usi_game_position( ptree, (int)l );
+      return 1;
+    }
+
+  if ( ! strcmp( token, "go" ) )
+    {
+      token = strtok_r( NULL, str_delimiters, lasts );
+      fUSIMoveCount = ( token != NULL && ! strcmp( token, "visit" ) );
+      if ( usi_game_go( (int)l ) < 0 )
+	{
+	  str_error = str_bad_cmdline;
+	  return -1;
+	}
+      return 1;
+    }
+
+  str_error = str_bad_cmdline;
+  return -1;
+}
+#endif
+
+
 static int CONV
 usi_ignore( tree_t * restrict ptree, char **lasts )
 {
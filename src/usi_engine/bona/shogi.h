@@ -686,6 +686,11 @@ typedef struct {
   signed char asquare[nsquare];
 } min_posi_t;
 
+typedef struct {
+  int num;
+  unsigned short plane_sq[40];	// 先手から見た駒の種類(0..27)*81 + 升
+} dcnn_piece_list_t;
+
 typedef struct {
   uint64_t nodes;
   unsigned int move, status;
@@ -718,9 +723,11 @@ struct tree {
 #if defined(YSS_ZERO)
   // 棋譜と探索木を含めた局面図
   min_posi_t record_plus_ply_min_posi[REP_HIST_LEN];
+  dcnn_piece_list_t record_plus_ply_piece_list[REP_HIST_LEN];	// 上の局面の盤上の駒の一覧。ネットワークの入力用
   int history_in_check[REP_HIST_LEN];	// 王手がかかっているか
   uint64_t sequence_hash;
   uint64_t keep_sequence_hash[REP_HIST_LEN];
+  int thread_id;	// UCT探索スレッドの番号
 #endif
   uint64_t node_searched;
   unsigned int *move_last[ PLY_MAX ];
@@ -782,6 +789,7 @@ struct tree {
 
 #if defined(YSS_ZERO)
 void copy_min_posi(tree_t * restrict ptree, int sideToMove, int ply);
+void save_opening_cache();
 #endif
 
 extern SHARE unsigned int game_status;
@@ -1442,6 +1450,7 @@ double calc_penalty( void );
 int YssZero_com_turn_start( tree_t * restrict ptree );
 int getCmdLineParam(int argc, char *argv[]);
 const char *get_cmd_line_ptr();
+void set_cmd_line_weights(const char *weights);
 void init_seqence_hash();
 const int SEQUENCE_HASH_SIZE = 512;	// 2^n.   別手順できた同一局面を区別するため
 extern uint64_t sequence_hash_from_to[SEQUENCE_HASH_SIZE][81][81][2];	// [from][to][promote]
@@ -1449,6 +1458,12 @@ extern uint64_t sequence_hash_drop[SEQUENCE_HASH_SIZE][81][7];
 void PRT(const char *fmt, ...);
 void print_board(const tree_t * restrict ptree);
 void init_yss_zero();
+void usi_newgame(int game);
+void usi_game_position(tree_t * restrict ptree, int game);
+int usi_game_go(int game);
+void uct_game_wait_all();
+extern int nUctGames;
+void reload_network(const char *weights);
 #endif
 
 #endif /* SHOGI_H */
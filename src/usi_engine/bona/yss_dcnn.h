@@ -4,7 +4,10 @@
 #ifndef INCLUDE_YSS_DCNN_H_GUARD	//[
 #define INCLUDE_YSS_DCNN_H_GUARD
 
+#include <atomic>
+
 #include "lock.h"
+#include "../ForwardPipe.h"
 
 const int B_SIZE = 9;
 const int DCNN_CHANNELS = 362;
@@ -13,11 +16,16 @@ const int LABEL_CHANNELS = 139;
 
 const int SHOGI_MOVES_MAX = 593;
 const float ILLEGAL_MOVE = -1000;
+const int UCT_THREAD_MAX = 1024;	// 全対局の探索スレッドの合計
+const int UCT_GAME_MAX = 256;
 
+// games and value are updated without entry_lock, each atomic on its own.
+// A reader may see a pair from the middle of an update. It is off by a few
+// playouts at most, and UCT tolerates that, so no lock or seqlock is used.
 typedef struct child {
 	int   move;			// position
-	int   games;		// number of selected
-	float value;		// win rate (win=+1, loss=0)
+	std::atomic<int>   games;	// number of selected. updated without entry_lock.
+	std::atomic<float> value;	// win rate (win=+1, loss=0)
 	float bias;			// policy
 } CHILD;
 
@@ -26,18 +34,33 @@ typedef struct hash_shogi {
 	uint64 hashcode64;			// sequence hash
 	uint64 hash64pos;			// position hash, we check both hash key.
 	int deleted;	//
-	int games_sum;	// sum of children selected
+	std::atomic<int> games_sum;	// sum of children selected
 	int sort_done;	//
 //	int used;		// 
 	int col;		// color 1 or 2
-	int age;		//
+	int game;		// -g. which game's tree this node belongs to
+	std::atomic<int> age;	// compared with the thinking_age of that game. stored by update_child_value() without entry_lock, so relaxed load/store
 	float net_value;		// winrate from value network
 //	int   has_net_value;
+	int pending;	// waiting for batched evaluation. net_value and child[].bias are not set yet.
+	int noise;		// dirichlet noise is already in child[].bias. set when searched as a root
 
 	int child_num;
-	CHILD child[SHOGI_MOVES_MAX];
+	CHILD *child;	// child_num entries in child_arena. not a fixed SHOGI_MOVES_MAX array.
 } HASH_SHOGI;
 
+typedef struct pending_leaf {
+	HASH_SHOGI *phg;			// leaf node waiting for network evaluation
+	int sideToMove;
+	int ply;
+	float value;				// set by get_network_policy_value_batch()
+	int path_num;				// path_phg[1]...path_phg[path_num] lead to this leaf
+	HASH_SHOGI *path_phg[PLY_MAX];
+	int path_select[PLY_MAX];
+	int   move_id[SHOGI_MOVES_MAX];	// 合法手の policy の番号。評価する時に作る
+	float prior[SHOGI_MOVES_MAX];	// 合法手だけで softmax した policy
+} PENDING_LEAF;
+
 enum {
   WHITE, BLACK, NO_COLOR	// WHITE is Sente(man) turn, BLACK is Gote(com) turn
 };
@@ -46,8 +69,15 @@ extern int fAddNoise;
 extern int fVisitCount;
 extern int fUSIMoveCount;
 extern int fPrtNetworkRawPath;
+extern int nLeafBatch;
+extern int nUctThread;
+extern int nUctGames;
+extern int UCT_LOOP_FIX;
 
 extern std::string default_weights;
+extern std::string default_opening_cache;
+extern int fUseInt8;
+extern int nNNCacheCount;
 #ifdef USE_OPENCL
 extern std::vector<int> default_gpus;
 #endif
@@ -62,11 +92,17 @@ double get_spend_time(int ct1);
 void create_node(tree_t * restrict ptree, int sideToMove, int ply, HASH_SHOGI *phg);
 double uct_tree(tree_t * restrict ptree, int sideToMove, int ply);
 int uct_search_start(tree_t * restrict ptree, int sideToMove, int ply, char *buf_move_count);
+void hash_shogi_next_age(int game);
+void usi_bestmove(int game);
+void add_pending_leaf(tree_t * restrict ptree, int sideToMove, int ply, HASH_SHOGI *phg);
+void flush_pending_leaves(tree_t * restrict ptree);
+void uct_search_loop(tree_t * restrict ptree, int sideToMove, int ply);
 void print_all_min_posi(tree_t * restrict ptree, int ply);
 
 // yss_net.cpp
 void init_network();
 void set_dcnn_channels(tree_t * restrict ptree, int sideToMove, int ply, float *p_data);
+void set_dcnn_channels_sparse(tree_t * restrict ptree, int sideToMove, int ply, ForwardPipe::SparseInput *ps);
 void prt_dcnn_data(float (*data)[B_SIZE][B_SIZE],int c,int turn_n);
 void prt_dcnn_data_table(float (*data)[B_SIZE][B_SIZE]);
 void make_move_id_c_y_x();
@@ -85,6 +121,7 @@ inline void unpack_te(int *bz,int *az,int *tk,int *nf, int te) {
 }
 int get_yss_packmove_from_bona_move(int move);
 float get_network_policy_value(tree_t * restrict ptree, int sideToMove, int ply, HASH_SHOGI *phg);
+void get_network_policy_value_batch(int num, const ForwardPipe::SparseInput *input, PENDING_LEAF *pl);
 void add_dirichlet_noise(float epsilon, float alpha, HASH_SHOGI *phg);
 
 #endif	//]] INCLUDE__GUARD
@@ -43,7 +43,11 @@
 
 //using namespace Utils;
 std::string default_weights;
+std::string default_opening_cache;
 std::vector<int> default_gpus;
+int fUseInt8 = 0;	// CPUで8bit整数の推論
+int nNNCacheCount = 0;	// 評価のキャッシュの局面数。0なら -p と -g から決める
+const int NNCACHE_MOVES = 4;	// 既定では、全対局の直近この手数分の評価を残す
 void init_global_objects();	// Leela.cpp
 
 void init_network()
@@ -55,6 +59,7 @@ void init_network()
 //	cfg_weightsfile = "networks/20180620_i362_64x29_iter_1_version.txt";
 //	cfg_weightsfile = "/home/yss/aobazero/networks/20190306_64L29_policy_160_139_bn_relu_cut_visit_x4_iter_910000.txt";
 	if ( !default_weights.empty() ) cfg_weightsfile = default_weights;
+	if ( fUseInt8 ) cfg_cpu_int8 = true;
 
 #ifdef USE_OPENCL
 	if ( !default_gpus.empty() ) {
@@ -63,7 +68,15 @@ void init_network()
 //	PRT("cfg_rowtiles    =%d\n",cfg_rowtiles);
 #endif
 
+	// OpenCLScheduler picks up this many positions at once. with -g, leaves from all games share one batch
+	if ( nLeafBatch > 1 || nUctGames > 1 ) cfg_batch_size = nLeafBatch * nUctGames;
+	if ( nUctThread > 1 || nUctGames > 1 ) cfg_num_threads = nUctThread * nUctGames;
+	// 1局面で約632バイト。1手で評価する局面は -p 程度で、-t で増やしても探索回数は同じなので局面も増えない
+	cfg_shogi_cache_count = nNNCacheCount > 0 ? nNNCacheCount : UCT_LOOP_FIX * nUctGames * NNCACHE_MOVES;
+
 	init_global_objects();
+	if ( !cfg_binary_weightsfile.empty() ) exit(EXIT_SUCCESS);	// 変換だけ
+	if ( !default_opening_cache.empty() ) GTP::s_network->open_opening_cache(default_opening_cache);
 
 	PRT("cfg_softmax_temp=%.3f,cfg_random_temp=%.3f,cfg_num_threads=%d,cfg_batch_size=%d\n",cfg_softmax_temp,cfg_random_temp,cfg_num_threads,cfg_batch_size);
 
@@ -80,6 +93,27 @@ static  auto network = std::make_unique<Network>();
 */
 }
 
+// 対局ごとにエンジンを起動し直さず、重みが変わった時だけ読み直す
+void reload_network(const char *weights)
+{
+	PRT("reload network path=%s\n",weights);
+	default_weights = weights;
+	cfg_weightsfile = default_weights;
+	auto network = std::make_unique<Network>();
+	network->initialize(std::min(cfg_max_playouts, cfg_max_visits), cfg_weightsfile);
+	GTP::s_network->save_opening_cache();	// 古い重みの評価はここまで
+	GTP::initialize(std::move(network));	// 古いNetworkはここで解放される
+	if ( !default_opening_cache.empty() ) GTP::s_network->open_opening_cache(default_opening_cache);
+	set_cmd_line_weights(weights);	// 次の "usi" で返す設定も新しい重みにする
+}
+
+// 終了時に序盤の評価をファイルに残す
+void save_opening_cache()
+{
+	if ( default_opening_cache.empty() || !GTP::s_network ) return;	// -nn_rand
+	GTP::s_network->save_opening_cache();
+}
+
 inline void set_dcnn_data(float data[][B_SIZE][B_SIZE], int n, int y, int x, float v=1.0f)
 {
 //	PRT("%.5f\n",v);
@@ -99,12 +133,12 @@ int get_motigoma(int m, int hand)
 	return 0;
 }
 
-void set_dcnn_channels(tree_t * restrict ptree, int sideToMove, int ply, float *p_data)
+// 入力の362 plane を疎な形で作る。駒の plane は値が1の (plane,升) の一覧、それ以外は盤全体で同じ値
+// 駒の一覧は copy_min_posi() で着手ごとに作ってあるので、ここでは8手分を並べるだけ
+void set_dcnn_channels_sparse(tree_t * restrict ptree, int sideToMove, int ply, ForwardPipe::SparseInput *ps)
 {
-	float (*data)[B_SIZE][B_SIZE] = (float(*)[B_SIZE][B_SIZE])p_data;
 	int base = 0;
 	int add_base = 0;
-	int x,y;
  	const int t = ptree->nrep + ply - 1;	// 手数。棋譜の手数+探索深さ。ply は1から始まるので1引く。
 	int flip = (t&1);	// 後手の時は全部ひっくり返す
 	int loop;
@@ -113,36 +147,33 @@ void set_dcnn_channels(tree_t * restrict ptree, int sideToMove, int ply, float *
 
 	if ( sideToMove != (t&1) ) { PRT("sideToMove Err\n"); debug(); }
 	if ( ply < 1 ) DEBUG_PRT("ply=%d Err.\n",ply);
-	
+
+	ps->m_num_ones = 0;
+	ps->m_fill.fill(0.0f);
+
 	for (loop=0; loop<T_STEP; loop++) {
 		add_base = 28;
 
 		int np = ptree->nrep + ply - loop - 1;
 		if ( np < 0 ) { PRT("np Err\n"); debug(); }
 		min_posi_t *p = &ptree->record_plus_ply_min_posi[np];	// [0] には平手局面 [1] は1手目を指した後の局面
+		const dcnn_piece_list_t *pl = &ptree->record_plus_ply_piece_list[np];
 
-		for (y=0;y<B_SIZE;y++) for (x=0;x<B_SIZE;x++) {
-			int z = y*B_SIZE + x;
-			int k = p->asquare[z];
-			if ( k==0 ) continue;
-			int m = abs(k);
-			if ( m>=0x0e ) m--;	// m = 1...14
-			m--;
-			// 先手の歩、香、桂、銀、金、角、飛、王、と、杏、圭、全、馬、竜 ... 14種類、+先手の駒が全部1、で15種類
-			if ( k < 0 ) m += 14;
-			int yy = y, xx = x;
+		// 先手の歩、香、桂、銀、金、角、飛、王、と、杏、圭、全、馬、竜 ... 14種類、後手も14種類
+		int i;
+		for (i=0; i<pl->num; i++) {
+			int m = pl->plane_sq[i] / 81;
+			int z = pl->plane_sq[i] - m*81;
 			if ( flip ) {
-				yy = B_SIZE - y -1;
-				xx = B_SIZE - x -1;
+				z = 80 - z;
 				m -= 14;
 				if ( m < 0 ) m += 28;	// 0..13 -> 14..27
-			} 
-			set_dcnn_data(data, base+m, yy,xx);
+			}
+			ps->m_ones[ps->m_num_ones++] = (uint16_t)((base+m)*81 + z);
 		}
 		base += add_base;
 
 		add_base = 14;
-		int i;
 		for (i=1;i<8;i++) {
 			int n0 = get_motigoma(i, p->hand_black);
 			int n1 = get_motigoma(i, p->hand_white);	// mo_c[i];
@@ -155,12 +186,8 @@ void set_dcnn_channels(tree_t * restrict ptree, int sideToMove, int ply, float *
 			const float mo_div[8] = { 0, 18, 4, 4, 4, 4, 2, 2 };
 			float div = 1.0f;
 			if ( STANDARDIZATION ) div = mo_div[i];
-			float f0 = (float)n0 / div;
-			float f1 = (float)n1 / div;
-			for (y=0;y<B_SIZE;y++) for (x=0;x<B_SIZE;x++) {
-				set_dcnn_data( data, base+0+i-1, y,x, f0);
-				set_dcnn_data( data, base+7+i-1, y,x, f1);
-			}
+			ps->m_fill[base+0+i-1] = (float)n0 / div;
+			ps->m_fill[base+7+i-1] = (float)n1 / div;
 		}
 		base += add_base;
 
@@ -174,18 +201,14 @@ void set_dcnn_channels(tree_t * restrict ptree, int sideToMove, int ply, float *
 		}
 		for (i=np-2; i>=0; i-=2) {
 			if ( ptree->rep_board_list[i] == key && ptree->rep_hand_list[i] == hand ) {
-//				PRT("same:sum=%d,i=%3d,t=%3d,loop=%d\n",sum,i,t,loop);
 				sum++;
 			}
 		}
-//		if ( 1 || sum > 0 ) PRT("repeat=%d,t=%3d,loop=%d\n",sum,t,loop);
 		if ( sum > 3 ) sum = 3;	// 同一局面5回以上。4回と同じで
 
 		add_base = 3;
 		for (i=0;i<3;i++) {	// 000, 100, 110, 111          論文だけでは実装不明。000,100,010,001 かも
-			if ( sum>=i+1 ) for (y=0;y<B_SIZE;y++) for (x=0;x<B_SIZE;x++) {
-				set_dcnn_data( data, base+i, y,x);
-			}
+			if ( sum>=i+1 ) ps->m_fill[base+i] = 1.0f;
 		}
 		base += add_base;
 
@@ -196,26 +219,27 @@ void set_dcnn_channels(tree_t * restrict ptree, int sideToMove, int ply, float *
 	}
 	
 	add_base = 1;
-	if ( sideToMove == 1 ) for (y=0;y<B_SIZE;y++) for (x=0;x<B_SIZE;x++) {
-		set_dcnn_data( data, base, y,x);
-	}
+	if ( sideToMove == 1 ) ps->m_fill[base] = 1.0f;
 	if ( DCNN_CHANNELS == 362 ) {
-		for (y=0;y<B_SIZE;y++) for (x=0;x<B_SIZE;x++) {
-//			set_dcnn_data( data, base+1, y,x, t);
-			float div = 1.0f;
-			if ( STANDARDIZATION ) div = 512.0f;
-			set_dcnn_data( data, base+1, y,x, (float)t/div);
-//			set_dcnn_data( data, base+1, y,x, 0);
-		}
+		float div = 1.0f;
+		if ( STANDARDIZATION ) div = 512.0f;
+		ps->m_fill[base+1] = (float)t/div;
 		add_base = 2;
 	}
 	base += add_base;
 
-//	PRT("base=%d,net_type=%d\n",base,net_type);
-//	if ( t==8 ) { hyouji(); int i; for (i=0;i<base;i++) prt_dcnn_data(data,i,-1); DEBUG_PRT("t=%d,tesuu=%d\n",t,tesuu); }
 	if ( DCNN_CHANNELS != base ) { PRT("Err. DCNN_CHANNELS != base %d\n",base); debug(); }
 }
 
+// 普通の [362][9][9] の形で作る。表示用
+void set_dcnn_channels(tree_t * restrict ptree, int sideToMove, int ply, float *p_data)
+{
+	ForwardPipe::SparseInput in;
+	set_dcnn_channels_sparse(ptree, sideToMove, ply, &in);
+	in.expand(p_data);
+//	if ( t==8 ) { hyouji(); int i; for (i=0;i<base;i++) prt_dcnn_data(data,i,-1); DEBUG_PRT("t=%d,tesuu=%d\n",t,tesuu); }
+}
+
 void prt_dcnn_data(float (*data)[B_SIZE][B_SIZE],int c,int turn_n)
 {
 	int x,y;
@@ -259,90 +283,34 @@ void PRT_path(tree_t * restrict ptree, int /*sideToMove*/, int ply)
 	PRT("\n");
 }
 
+// 評価待ちの末端局面は ptree がないので、登録した時の経路から手を取り出す
+void PRT_path(const PENDING_LEAF *pl)
+{
+	int i;
+	for (i=1;i<=pl->path_num;i++) {
+		int m = pl->path_phg[i]->child[pl->path_select[i]].move;
+		PRT("%s:",str_CSA_move(m));
+	}
+	PRT("\n");
+}
+
 bool is_nan_inf(float x)
 {
 	return ( std::isnan(x) || std::isinf(x) );
 }
 
-float get_network_policy_value(tree_t * restrict ptree, int sideToMove, int ply, HASH_SHOGI *phg)
+// 合法手(phg->child[])の policy の出力での番号を move_id[] に入れる
+int set_child_move_id(int sideToMove, HASH_SHOGI *phg, int *move_id)
 {
-	if ( ptree->nrep < 0 || ptree->nrep >= REP_HIST_LEN ) { PRT("nrep Err=%d\n",ptree->nrep); debug(); }
-
-	int size = 1*DCNN_CHANNELS*B_SIZE*B_SIZE;
-	float *data = new float[size];
-	memset(data, 0, sizeof(float)*size);
-
-	set_dcnn_channels(ptree, sideToMove, ply, data);
-//	if ( 1 || ply==1 ) { prt_dcnn_data_table((float(*)[B_SIZE][B_SIZE])data);  }
-//	{ int sum=0; int i; for (i=0;i<size;i++) sum = 37*sum + (int)(data[i]+0.1); PRT("sum=%d\n",sum); }
-
-//	const auto result = Network::get_scored_moves_yss_zero((float(*)[B_SIZE][B_SIZE])data);
-	const auto result = GTP::s_network->get_scored_moves_yss_zero((float(*)[B_SIZE][B_SIZE])data);
-
-
-//	float xxx = NAN;
-//	if ( std::isnan(xxx) || std::isinf(xxx) ) PRT("xxx is nan!\n"); else PRT("xxx is not nan...\n");
-    float raw_v = result.second;
-	if ( is_nan_inf(raw_v) ) raw_v = 0;
-	float v_fix = raw_v;	// (raw_v + 1) / 2;
-	if ( sideToMove==BLACK ) v_fix = -v_fix;	// 手番関係なく先手勝ちが+1
-//	float v = (net_eval + 1.0f) / 2.0;	// 0 <= v <= 1
-//    if ( sideToMove ) {	// DCNNは自分が勝ちなら+1、負けなら-1を返す。探索中は先手は+1～0, 後手は 0～-1を返す。
-//        v = v - 1;
-//    }
-//	float v = f_rnd();
-//	if ( sideToMove==BLACK ) v = -v;
-//	phg->net_value      = v_fix;
-
-//  std::vector<Network::scored_node> nodelist;
-
-//	PRT("result.first.size()=%d\n",result.first.size());
-	auto &node = result.first;
-//	PRT("node.size()=%d\n",node.size());
-//	{ int i; for (i=0;i<60;i++) PRT("%f,%d\n",node[i].first,node[i].second); }
-
-    float all_sum = 0.0f;
-    for (const auto& node : result.first) {
-        auto id = node.second;
-        all_sum += node.first;
-		int yss_m = get_move_from_c_y_x_id(id);
-		int bz,az,tk,nf;
-		unpack_te(&bz,&az,&tk,&nf, yss_m);
-		int bz_x = bz & 0x0f;
-		int bz_y =(bz & 0xf0) >> 4;
-		int az_x = az & 0x0f;
-		int az_y =(az & 0xf0) >> 4;
-		int from = 0,to = 0;
-		if ( bz==0xff ) {
-			from = tk + 81 - 1;
-		} else {
-			from = (bz_y-1) * 9 + (bz_x-1);
-		}
-		to = (az_y-1) * 9 + (az_x-1);
-		int promotion = nf >> 3;
-		int bona_m = (promotion << 14) | (from <<7) | to;
-		if ( yss_m == 0 ) bona_m = 0;
-		// "piece to move" は moveのみ。dropでは 0
-		
-	    if ( 0 && ply==1 && id < 100 ) PRT("%4d,%08x(%08x),%f\n",id,yss_m,bona_m, node.first);
-	}
-
-
-	float legal_sum = 0.0f;
-
 	int move_num = phg->child_num;
-	unsigned int * restrict pmove = ptree->move_last[0];
 	int i;
 	for ( i = 0; i < move_num; i++ ) {
-		int move = pmove[i];
-		CHILD *pc = &phg->child[i];
+		int move = phg->child[i].move;
 
 		int from = (int)I2From(move);
 		int to   = (int)I2To(move);
 		int drop = (int)From2Drop(from);
 		int is_promote = (int)I2IsPromote(move);
-		int cap  = (int)UToCap(move);
-		int piece_m	= (int)I2PieceMove(move);
 
 		int bz = get_yss_z_from_bona_z(from);
 		int az = get_yss_z_from_bona_z(to);
@@ -356,67 +324,91 @@ float get_network_policy_value(tree_t * restrict ptree, int sideToMove, int ply,
 			flip_dccn_move(&bz,&az,&tk,&nf);
 		}
 		int yss_m = pack_te(bz,az,tk,nf);
-		int id = get_id_from_move(yss_m);
+		move_id[i] = get_id_from_move(yss_m);
+	}
+	return move_num;
+}
 
-		// node[i].second ... id
-		float bias = node[id].first;
-		if ( id != node[id].second ) { PRT("id=%d,%d err\n",id,node[id].second); debug(); }
-		if ( ply==1 ) PRT("%3d:%s(%d)(%08x)id=%5d, bias=%8f,from=%2d,to=%2d,cap=%2d,drop=%3d,pr=%d,peice=%d\n",i,str_CSA_move(move),sideToMove,yss_m,id,bias, from,to,cap,drop,is_promote,piece_m);
+float set_network_policy_value(float raw_v, const float *prior, int sideToMove, int ply, HASH_SHOGI *phg);
 
-		if ( is_nan_inf(bias) ) bias = 0;
-		pc->bias = bias;
-		legal_sum += bias;
-	}
-//	PRT("legal_sum=%9f,all_sum=%f, raw_v=%10f,v_fix=%10f\n",legal_sum,all_sum, raw_v,v_fix );
+float get_network_policy_value(tree_t * restrict ptree, int sideToMove, int ply, HASH_SHOGI *phg)
+{
+	if ( ptree->nrep < 0 || ptree->nrep >= REP_HIST_LEN ) { PRT("nrep Err=%d\n",ptree->nrep); debug(); }
+
+	ForwardPipe::SparseInput in;
+	set_dcnn_channels_sparse(ptree, sideToMove, ply, &in);
+//	if ( 1 || ply==1 ) { std::vector<float> data(DCNN_CHANNELS*B_SIZE*B_SIZE); in.expand(data.data()); prt_dcnn_data_table((float(*)[B_SIZE][B_SIZE])data.data()); }
+
+	int   move_id[SHOGI_MOVES_MAX];
+	float prior[SHOGI_MOVES_MAX];
+	int move_num = set_child_move_id(sideToMove, phg, move_id);
+	float raw_v = GTP::s_network->get_legal_policy_value_yss_zero(in, move_id, move_num, prior);
+
+	float v_fix = set_network_policy_value(raw_v, prior, sideToMove, ply, phg);
 
 	if ( fPrtNetworkRawPath ) {
 		PRT("%9.6f(%9.6f)",v_fix,raw_v);
 		PRT_path(ptree, sideToMove, ply);
 	}
 
-	// sort
-	int j;
-	for ( i = 0; i < move_num-1; i++ ) {
-		CHILD *pc = &phg->child[i];
-		float max_b = pc->bias;
-		int   max_i = i;
-		for ( j = i+1; j < move_num; j++ ) {
-			CHILD *pc = &phg->child[j];
-			if ( max_b > pc->bias ) continue;
-			max_b = pc->bias;
-			max_i = j;
-		}
-		if ( max_i==i ) continue;
-		CHILD c_tmp = phg->child[i];
-		phg->child[i] = phg->child[max_i];
-		phg->child[max_i] = c_tmp;
-	}
+	return v_fix;
+}
 
-	float mul = 1.0f;
-	if ( all_sum > legal_sum && legal_sum > 0 ) mul = all_sum / legal_sum;
-	for ( i = 0; i < phg->child_num; i++ ) {
-		CHILD *pc = &phg->child[i];
-		if ( 1 && ply==1 && i < 30 ) {
-			PRT("%3d:%s(%08x), bias=%8f->(%8f)\n",i,str_CSA_move(pc->move), get_yss_packmove_from_bona_move(pc->move), pc->bias, pc->bias*mul);
+// 評価待ちの末端局面をまとめてネットワークに渡す
+void get_network_policy_value_batch(int num, const ForwardPipe::SparseInput *input, PENDING_LEAF *pl)
+{
+	// 探索スレッドごとに使い回す
+	thread_local std::vector<const int *> move_id;
+	thread_local std::vector<int>         move_num;
+	thread_local std::vector<float *>     prior;
+	thread_local std::vector<float>       raw_v;
+	move_id.resize(num);
+	move_num.resize(num);
+	prior.resize(num);
+	raw_v.resize(num);
+	int i;
+	for (i=0; i<num; i++) {
+		move_num[i] = set_child_move_id(pl[i].sideToMove, pl[i].phg, pl[i].move_id);
+		move_id[i]  = pl[i].move_id;
+		prior[i]    = pl[i].prior;
+	}
+	GTP::s_network->get_legal_policy_value_yss_zero_batch(input, num, move_id.data(), move_num.data(), prior.data(), raw_v.data());
+	for (i=0; i<num; i++) {
+		pl[i].value = set_network_policy_value(raw_v[i], pl[i].prior, pl[i].sideToMove, pl[i].ply, pl[i].phg);
+		if ( fPrtNetworkRawPath ) {
+			PRT("%9.6f(%9.6f)",pl[i].value,raw_v[i]);
+			PRT_path(&pl[i]);
 		}
-		pc->bias *= mul;
 	}
+}
 
+// policy(合法手だけで softmax 済み)を合法手(phg->child[])に割り当てて、手番に関係なく先手勝ちが+1の評価値を返す
+float set_network_policy_value(float raw_v, const float *prior, int sideToMove, int ply, HASH_SHOGI *phg)
+{
+	if ( is_nan_inf(raw_v) ) raw_v = 0;
+	float v_fix = raw_v;
+	if ( sideToMove==BLACK ) v_fix = -v_fix;	// 手番関係なく先手勝ちが+1
 
-/*
-    // If the sum is 0 or a denormal, then don't try to normalize.
-    if (legal_sum > std::numeric_limits<float>::min()) {
-        // re-normalize after removing illegal moves.
-        for (auto& node : nodelist) {
-            node.first /= legal_sum;
-        }
-    }
-
-    link_nodelist(nodecount, nodelist, net_eval);
-*/
-//	if ( ply==1 ) DEBUG_PRT("stop\n");
+	int move_num = phg->child_num;
+	std::pair<float,int> sort_b[SHOGI_MOVES_MAX];
+	int i;
+	for ( i = 0; i < move_num; i++ ) {
+		float bias = prior[i];
+		if ( is_nan_inf(bias) ) bias = 0;
+		if ( ply==1 ) PRT("%3d:%s(%d), bias=%8f\n",i,str_CSA_move(phg->child[i].move),sideToMove,bias);
+		sort_b[i] = std::make_pair(bias, phg->child[i].move);
+	}
 
-	delete[] data;
+	// games, value はまだ0なので move と bias だけ並べ替える
+	std::stable_sort(sort_b, sort_b + move_num, [](const std::pair<float,int> &a, const std::pair<float,int> &b) { return a.first > b.first; });
+	for ( i = 0; i < move_num; i++ ) {
+		CHILD *pc = &phg->child[i];
+		pc->bias = sort_b[i].first;
+		pc->move = sort_b[i].second;
+		if ( ply==1 && i < 30 ) {
+			PRT("%3d:%s(%08x), bias=%8f\n",i,str_CSA_move(pc->move), get_yss_packmove_from_bona_move(pc->move), pc->bias);
+		}
+	}
 	return v_fix;
 }
 
@@ -16,7 +16,11 @@
 
 #include <string>
 #include <vector>
+#include <algorithm>
 #include <random>
+#include <thread>
+#include <atomic>
+#include <new>
 
 #include "shogi.h"
 
@@ -36,18 +40,69 @@ int fAddNoise = 0;				// always add dirichlet noise on root node.
 int fUSIMoveCount;	// USIで上位ｎ手の訪問回数も返す
 int fPrtNetworkRawPath = 0;
 int fVerbose = 1;
-int fClearHashAlways = 1;
+int fClearHashAlways = 0;	// 1なら毎回全局面を捨てる。0なら前回の探索木を次の手で再利用
+int nLeafBatch = 1;		// 末端局面をこの数だけ集めてからまとめて評価する。1なら1局面ずつ
+int nUctThread = 1;		// 探索スレッド数。hash_shogi_tableは共有で、tree_tはスレッドごとにコピー
+int nUctGames = 1;		// 1プロセスで同時に進める対局数。探索木は対局ごとに別で、末端局面の評価はまとめてForwardPipeに渡る
 
 int UCT_LOOP_FIX = 100;
-int reached_ply = 0;
+
+const int VL_N = 6;		// virtual loss
+const float DIRICHLET_EPSILON = 0.25f;	// epsilon = 0.25
+const float DIRICHLET_ALPHA   = 0.15f;	// alpha ... Chess = 0.3, Shogi = 0.15, Go = 0.03
+const double UCT_PENDING   = 1000;	// uct_tree()の戻り値。末端局面を評価待ちに登録した
+const double UCT_COLLISION = 2000;	// uct_tree()の戻り値。評価待ちの局面に当たった
+
+typedef struct uct_thread {
+	tree_t *ptree;					// thread 0 は探索開始局面のtree_tをそのまま使う
+	std::vector<PENDING_LEAF> pending_leaf;
+	std::vector<ForwardPipe::SparseInput> pending_input;
+	int pending_num;
+	HASH_SHOGI *path_phg[PLY_MAX];	// 探索中の経路。評価待ちに登録する時にコピーする
+	int path_select[PLY_MAX];
+	int reached_ply;
+	int sum_reached_ply;
+	int loop_count;
+	int child_reserved;				// child_arena から予約して、まだ使っていない子の数
+} UCT_THREAD;
+
+UCT_THREAD uct_thread[UCT_THREAD_MAX];	// 対局 g の i 番目のスレッドは uct_thread[g*nUctThread + i]
+
+// 対局ごとの探索の状態。hash_shogi_table と child_arena は全対局で共有し、局面には対局の番号を付けて区別する
+typedef struct uct_game {
+	tree_t *ptree;					// -g の時は、USIのpositionで作った局面をコピーして持つ
+	int sideToMove;
+	int thinking_age;				// age が thinking_age-1 より古い局面は、次の手で hash_shogi_reclaim() が削除する
+	std::atomic<int> playouts;		// 全スレッドで探索した回数
+	std::atomic<int> stop;
+	std::atomic<int> hash_shogi_use;		// 今回の探索で作った、もしくは触った局面の数
+	std::atomic<int> hash_shogi_use_prev;	// 前回の探索の局面で、今回まだ触っていない数
+	std::vector<int> own_node;		// この対局の局面の hash_shogi_table での位置。削除済みの局面は含まない
+	std::atomic<int> own_node_num;
+	std::thread search;				// -g の時に bestmove を返すまで探索するスレッド
+} UCT_GAME;
+
+UCT_GAME uct_game[UCT_GAME_MAX];
+
+inline UCT_GAME *get_uct_game(const tree_t * restrict ptree) { return &uct_game[ptree->thread_id / nUctThread]; }
 
 HASH_SHOGI *hash_shogi_table = NULL;
 const int HASH_SHOGI_TABLE_SIZE_MIN = 1024*4*1;
 int Hash_Shogi_Table_Size = HASH_SHOGI_TABLE_SIZE_MIN;
 int Hash_Shogi_Mask;
-int hash_shogi_use = 0;
 int hash_shogi_sort_num = 0;
-int thinking_age = 0;
+
+// 子の手は局面ごとに固定長で持たず、child_arenaから必要な数だけ切り出す
+const int CHILD_ARENA_AVE = 128;	// 1局面あたりの子の数。平均は80手程度
+const int CHILD_FREE_UNIT = 8;		// 解放された子の配列は、この単位の大きさごとに使い回す
+CHILD *child_arena = NULL;
+int Child_Arena_Size = 0;
+std::atomic<int> child_arena_use(0);	// 先頭から切り出した分。解放された子も含む
+std::atomic<int> child_arena_commit(0);	// 使用中の子と、各スレッドが予約してまだ使っていない分の合計。解放された子は含まない。Child_Arena_Size を超えない
+const int CHILD_UNIT_MAX = (SHOGI_MOVES_MAX + CHILD_FREE_UNIT - 1) / CHILD_FREE_UNIT;
+const int CHILD_RESERVE = CHILD_UNIT_MAX * CHILD_FREE_UNIT * 2;	// 1回の探索で作る局面は高々2つ
+std::vector<CHILD*> child_free_list[CHILD_UNIT_MAX + 1];	// 単位の数ごとの解放された子の配列
+lock_yss_t child_free_lock;
 
 #define REHASH_MAX (2048*1)
 #define REHASH_SHOGI (REHASH_MAX-1)
@@ -172,15 +227,20 @@ unsigned long rand_m521()
 #else
 //std::random_device seed_gen;
 std::mt19937 get_mt_rand;
+lock_yss_t mt_rand_lock;	// -g では複数の対局のスレッドから呼ばれる
 
 void init_rnd521(unsigned long u_seed)
 {
+	LockInit(mt_rand_lock);
 	get_mt_rand.seed(u_seed);
 //	PRT("u_seed=%d, mt()=%d\n",u_seed,get_mt_rand());
 }
 unsigned long rand_m521()
 {
-	return get_mt_rand();
+	Lock(mt_rand_lock);
+	unsigned long r = get_mt_rand();
+	UnLock(mt_rand_lock);
+	return r;
 }
 #endif
 
@@ -288,8 +348,8 @@ int YssZero_com_turn_start( tree_t * restrict ptree )
 		PRT("%.2f sec\n",get_spend_time(ct1));
 	}
 
-	int ply = 1;	// 1 から始まる
 /*
+	int ply = 1;	// 1 から始まる
 	int move_num = generate_all_move( ptree, root_turn );
 	PRT("move_num=%d,root_turn=%d,nrep=%d\n",move_num,root_turn,ptree->nrep);
 
@@ -323,8 +383,24 @@ int YssZero_com_turn_start( tree_t * restrict ptree )
 		UnMakeMove( tt, move, ply );
 	}
 */
+	if ( nUctGames > 1 ) { PRT("use \"g <game> go\" with -g\n"); return 1; }
+	UCT_GAME *pg = &uct_game[0];
+	pg->ptree      = ptree;
+	pg->sideToMove = root_turn;
+	ptree->thread_id = 0;
+	hash_shogi_next_age(0);
+	usi_bestmove(0);
+	return 1;
+}
+
+// 探索して bestmove を返す。-g の時はどの対局の手か分かるように "g <game> bestmove ..." で返す
+void usi_bestmove(int game)
+{
+	UCT_GAME *pg = &uct_game[game];
+	tree_t * restrict ptree = pg->ptree;
+	int ply = 1;	// 1 から始まる
 	char buf_move_count[MAX_LEGAL_MOVES*(8+5)];
-	int m = uct_search_start( ptree, root_turn, ply, buf_move_count );
+	int m = uct_search_start( ptree, pg->sideToMove, ply, buf_move_count );
 
 	char buf[7];
 	if ( m == 0 ) {
@@ -332,14 +408,51 @@ int YssZero_com_turn_start( tree_t * restrict ptree )
 	} else {
 		csa2usi( ptree, str_CSA_move(m), buf );
 	}
+	char game_str[16] = "";
+	if ( nUctGames > 1 ) sprintf(game_str,"g %d ",game);
 	if ( fUSIMoveCount ) {
-		USIOut( "bestmove %s,%s\n", buf,buf_move_count );
+		USIOut( "%sbestmove %s,%s\n", game_str, buf,buf_move_count );
 	} else {
-		USIOut( "bestmove %s\n", buf );
+		USIOut( "%sbestmove %s\n", game_str, buf );
 	}
+}
+
+void uct_game_search(int game)
+{
+	usi_bestmove(game);
+}
+
+// -g の時、positionはUSIのtree_tで作ってから対局ごとのtree_tにコピーしておく
+void usi_game_position(tree_t * restrict ptree, int game)
+{
+	UCT_GAME *pg = &uct_game[game];
+	if ( pg->search.joinable() ) pg->search.join();	// bestmove を返す前に次の局面が来ることはない
+	if ( pg->ptree == NULL ) pg->ptree = (tree_t*)malloc( sizeof(tree_t) );
+	if ( pg->ptree == NULL ) { PRT("Fail malloc tree_t\n"); debug(); }
+	memcpy(pg->ptree, ptree, sizeof(tree_t));
+	pg->ptree->move_last[0] = pg->ptree->amove;
+	pg->ptree->thread_id    = game * nUctThread;
+	pg->sideToMove = root_turn;
+}
+
+// 探索を別スレッドで始めてすぐ戻る。他の対局の position, go は探索中でも受け付ける
+int usi_game_go(int game)
+{
+	UCT_GAME *pg = &uct_game[game];
+	if ( pg->search.joinable() ) pg->search.join();
+	if ( pg->ptree == NULL ) { PRT("no position. game=%d\n",game); return -1; }
+	hash_shogi_next_age(game);	// この対局の古い局面を消す。探索が止まっている今のうちに
+	pg->search = std::thread(uct_game_search, game);
 	return 1;
 }
 
+void uct_game_wait_all()
+{
+	for (int g=0; g<nUctGames; g++) {
+		if ( uct_game[g].search.joinable() ) uct_game[g].search.join();
+	}
+}
+
 void init_seqence_hash()
 {
 	static int fDone = 0;
@@ -362,9 +475,13 @@ void init_seqence_hash()
 	}
 }
 
-void set_Hash_Shogi_Table_Size(int playouts)
+// 1つの対局で同時に残る局面は、前回の探索で触った局面(再利用する部分木)と今回作る局面で、合わせて
+// 2*playouts 程度(-t,-b で virtual loss により広がっても実測で1.8倍まで)。これを全対局の分だけ入れて、
+// 使用率が半分以下になるように 4*playouts*games より大きい2の累乗にする。
+// child_arena は表の大きさ * CHILD_ARENA_AVE なので、終盤で1局面の子が100を超えても、細切れになる分まで余裕がある
+void set_Hash_Shogi_Table_Size(int playouts, int games)
 {
-	int n = playouts * 2;
+	int n = playouts * 4 * games;
 	
 	Hash_Shogi_Table_Size = HASH_SHOGI_TABLE_SIZE_MIN;
 	for (;;) {
@@ -375,25 +492,166 @@ void set_Hash_Shogi_Table_Size(int playouts)
 
 void hash_shogi_table_reset()
 {
-	HASH_ALLOC_SIZE size = sizeof(HASH_SHOGI) * Hash_Shogi_Table_Size;
-	memset(hash_shogi_table,0,size);
+	// atomic を含むので memset はせず、1つずつ代入する
 	for (int i=0;i<Hash_Shogi_Table_Size;i++) {
-		hash_shogi_table[i].deleted = 1;
-		LockInit(hash_shogi_table[i].entry_lock);
+		HASH_SHOGI *pt = &hash_shogi_table[i];
+		pt->hashcode64 = 0;
+		pt->hash64pos  = 0;
+		pt->deleted    = 1;
+		pt->games_sum  = 0;
+		pt->sort_done  = 0;
+		pt->col        = 0;
+		pt->game       = 0;
+		pt->age.store(0, std::memory_order_relaxed);
+		pt->net_value  = 0;
+		pt->pending    = 0;
+		pt->noise      = 0;
+		pt->child_num  = 0;
+		pt->child      = NULL;
+		LockInit(pt->entry_lock);
+	}
+	for (int g=0; g<nUctGames; g++) {
+		uct_game[g].hash_shogi_use = 0;
+		uct_game[g].hash_shogi_use_prev = 0;
+		uct_game[g].own_node_num = 0;
 	}
-	hash_shogi_use = 0;
+	child_arena_use = 0;
+	child_arena_commit = 0;
+	for (auto &t : uct_thread) t.child_reserved = 0;
+	for (auto &v : child_free_list) v.clear();
+	LockInit(child_free_lock);
 }
 
 void hash_shogi_table_clear()
 {
 	Hash_Shogi_Mask       = Hash_Shogi_Table_Size - 1;
 	HASH_ALLOC_SIZE size = sizeof(HASH_SHOGI) * Hash_Shogi_Table_Size;
-	if ( hash_shogi_table == NULL ) hash_shogi_table = (HASH_SHOGI*)malloc( size );
-	if ( hash_shogi_table == NULL ) { PRT("Fail malloc hash_shogi\n"); debug(); }
-	PRT("HashShogi=%7d(%3dMB),sizeof(HASH_SHOGI)=%d,Hash_SHOGI_Mask=%d\n",Hash_Shogi_Table_Size,(int)(size/(1024*1024)),sizeof(HASH_SHOGI),Hash_Shogi_Mask);
+	if ( hash_shogi_table == NULL ) hash_shogi_table = new (std::nothrow) HASH_SHOGI[Hash_Shogi_Table_Size]();
+	if ( hash_shogi_table == NULL ) { PRT("Fail new hash_shogi\n"); debug(); }
+	Child_Arena_Size = Hash_Shogi_Table_Size * CHILD_ARENA_AVE;
+	HASH_ALLOC_SIZE arena_size = sizeof(CHILD) * Child_Arena_Size;
+	// 値の初期化はしない(使った分だけ実メモリになる)。子の各値は create_node() で局面を作る時に全部代入する
+	if ( child_arena == NULL ) child_arena = new (std::nothrow) CHILD[Child_Arena_Size];
+	if ( child_arena == NULL ) { PRT("Fail new child_arena\n"); debug(); }
+	for (int g=0; g<nUctGames; g++) uct_game[g].own_node.resize(Hash_Shogi_Table_Size);	// 1つの対局が表を全部使っても入る
+	PRT("HashShogi=%7d(%3dMB),sizeof(HASH_SHOGI)=%d,Hash_SHOGI_Mask=%d,child_arena=%d(%3dMB)\n",Hash_Shogi_Table_Size,(int)(size/(1024*1024)),sizeof(HASH_SHOGI),Hash_Shogi_Mask,Child_Arena_Size,(int)(arena_size/(1024*1024)));
 	hash_shogi_table_reset();
 }
 
+// 子の予約は全対局のスレッドが1つの child_arena_commit で取り合う。満杯の判定と予約が1回の compare_exchange なので、
+// 他の対局と同時でも Child_Arena_Size を超えない。探索中の予約は limit までで、残りは各対局の探索開始局面を作る分
+int child_arena_reserve(UCT_THREAD *pth, int num, int limit)
+{
+	int need = num - pth->child_reserved;
+	if ( need <= 0 ) return 1;
+	int c = child_arena_commit;
+	for (;;) {
+		if ( c + need > limit ) return 0;
+		if ( child_arena_commit.compare_exchange_weak(c, c + need) ) break;
+	}
+	pth->child_reserved += need;
+	return 1;
+}
+
+void child_arena_release(UCT_THREAD *pth)
+{
+	child_arena_commit -= pth->child_reserved;
+	pth->child_reserved = 0;
+}
+
+// 同じ大きさの解放された子、先頭からの切り出し、大きい解放された子の分割、の順に探す。child_free_lock を取ってから呼ぶ
+static CHILD *child_free_list_take(int unit_num)
+{
+	std::vector<CHILD*> &free_list = child_free_list[unit_num];
+	if ( ! free_list.empty() ) {
+		CHILD *pc = free_list.back();
+		free_list.pop_back();
+		return pc;
+	}
+	int size = unit_num * CHILD_FREE_UNIT;
+	if ( child_arena_use + size <= Child_Arena_Size ) {
+		int n = child_arena_use.fetch_add(size);
+		return &child_arena[n];
+	}
+	for (int u=unit_num+1; u<=CHILD_UNIT_MAX; u++) {
+		if ( child_free_list[u].empty() ) continue;
+		CHILD *pc = child_free_list[u].back();
+		child_free_list[u].pop_back();
+		child_free_list[u - unit_num].push_back(pc + size);	// 残りは小さい大きさとして使い回す
+		return pc;
+	}
+	return NULL;
+}
+
+// 解放された子を番地の順に並べて、隣り合うものをつなげ直す。末尾に接する分は child_arena_use を戻す。child_free_lock を取ってから呼ぶ
+static void child_free_list_merge()
+{
+	std::vector<std::pair<CHILD*,int>> block;	// 先頭と単位の数
+	for (int u=1; u<=CHILD_UNIT_MAX; u++) {
+		for (CHILD *pc : child_free_list[u]) block.emplace_back(pc, u);
+		child_free_list[u].clear();
+	}
+	std::sort(block.begin(), block.end());
+	std::vector<std::pair<CHILD*,int>> merged;
+	for (auto &b : block) {
+		if ( ! merged.empty() && merged.back().first + merged.back().second * CHILD_FREE_UNIT == b.first ) {
+			merged.back().second += b.second;
+		} else {
+			merged.push_back(b);
+		}
+	}
+	if ( ! merged.empty() && merged.back().first + merged.back().second * CHILD_FREE_UNIT == &child_arena[child_arena_use] ) {
+		child_arena_use -= merged.back().second * CHILD_FREE_UNIT;
+		merged.pop_back();
+	}
+	for (auto &b : merged) {
+		CHILD *pc = b.first;
+		for (int u = b.second; u > 0; ) {
+			int k = std::min(u, CHILD_UNIT_MAX);
+			child_free_list[k].push_back(pc);
+			pc += k * CHILD_FREE_UNIT;
+			u  -= k;
+		}
+	}
+}
+
+// 予約は使用中の子の数だけで判定するので、解放された子も空きとして数える。
+// 予約できても空きが細切れで取れなければ NULL を返す。呼び出し側は局面を作らずに探索を止める
+CHILD *child_arena_alloc(tree_t * restrict ptree, int num)
+{
+	int unit_num = (num + CHILD_FREE_UNIT - 1) / CHILD_FREE_UNIT;
+	if ( unit_num == 0 ) return NULL;
+	int size = unit_num * CHILD_FREE_UNIT;
+	UCT_THREAD *pth = &uct_thread[ptree->thread_id];
+	if ( ! child_arena_reserve(pth, size, Child_Arena_Size) ) {
+		PRT("child_arena over. use=%d,commit=%d,num=%d,size=%d\n",(int)child_arena_use,(int)child_arena_commit,num,Child_Arena_Size);
+		return NULL;
+	}
+	pth->child_reserved -= size;
+	Lock(child_free_lock);
+	CHILD *pc = child_free_list_take(unit_num);
+	if ( pc == NULL ) {
+		child_free_list_merge();
+		pc = child_free_list_take(unit_num);
+	}
+	UnLock(child_free_lock);
+	if ( pc == NULL ) {
+		child_arena_commit -= size;
+		PRT("child_arena fragmented. use=%d,commit=%d,num=%d,size=%d\n",(int)child_arena_use,(int)child_arena_commit,num,Child_Arena_Size);
+	}
+	return pc;
+}
+
+void child_arena_free(CHILD *pc, int num)
+{
+	int unit_num = (num + CHILD_FREE_UNIT - 1) / CHILD_FREE_UNIT;
+	if ( unit_num == 0 || pc == NULL ) return;
+	Lock(child_free_lock);
+	child_free_list[unit_num].push_back(pc);
+	UnLock(child_free_lock);
+	child_arena_commit -= unit_num * CHILD_FREE_UNIT;
+}
+
 void inti_rehash()
 {
 	int i = 0;
@@ -409,10 +667,20 @@ void inti_rehash()
 //	for (i=0;i<REHASH_MAX-1;i++) PRT("%08x,",rehash[i]);
 }
 
-int IsHashFull()
+int IsHashFull(tree_t * restrict ptree)
 {
-	if ( hash_shogi_use >= Hash_Shogi_Table_Size*90/100 ) {
-		PRT("hash full! hash_shogi_use=%d,Hash_Shogi_Table_Size=%d\n",hash_shogi_use,Hash_Shogi_Table_Size);
+	int use = 0, use_prev = 0;
+	for (int g=0; g<nUctGames; g++) {
+		use      += uct_game[g].hash_shogi_use;
+		use_prev += uct_game[g].hash_shogi_use_prev;
+	}
+	if ( use + use_prev >= Hash_Shogi_Table_Size*90/100 ) {
+		PRT("hash full! hash_shogi_use=%d(+%d),Hash_Shogi_Table_Size=%d\n",use,use_prev,Hash_Shogi_Table_Size);
+		return 1;
+	}
+	// 次の1回の探索で作る局面の子の分を先に予約する。取れなければ満杯
+	if ( ! child_arena_reserve(&uct_thread[ptree->thread_id], CHILD_RESERVE, Child_Arena_Size - CHILD_RESERVE/2*nUctGames) ) {
+		PRT("child_arena full! child_arena_use=%d,commit=%d,Child_Arena_Size=%d\n",(int)child_arena_use,(int)child_arena_commit,Child_Arena_Size);
 		return 1;
 	}
 	return 0; 
@@ -429,54 +697,71 @@ uint64 get_marge_hash(tree_t * restrict ptree, int sideToMove)
 	return key;
 };
 
-void hash_half_del(tree_t * restrict ptree, int sideToMove)
+// 対局 game の局面のうち、前回の探索で触らなかったものを削除して子を child_arena に返す。
+// 表全体ではなく own_node だけを見る。この対局の探索が止まっている間に呼ぶ(他の対局は探索中でもよい)
+void hash_shogi_reclaim(int game)
 {
-	uint64 hash64pos  = get_marge_hash(ptree, sideToMove);
-	uint64 hashcode64 = ptree->sequence_hash;
-
-	int i,sum = 0;
-	for (i=0;i<Hash_Shogi_Table_Size;i++) if ( hash_shogi_table[i].deleted==0 ) sum++;
-	if ( sum != hash_shogi_use ) PRT("warning! sum=%d,hash_shogi_use=%d\n",sum,hash_shogi_use);
-	hash_shogi_use = sum;	// hash_shogi_useはロックしてないので12スレッドだと頻繁にずれる
-
-	int max_sum = 0;
-	int del_games = max_sum * 5 / 10000;	// 0.05%以上。5%程度残る。メモリを最大限まで使い切ってる場合のみ。age_minus = 2 に。
-
-	const double limit_occupy = 50;		// 50%以上空くまで削除
-	const int    limit_use    = (int)(limit_occupy*Hash_Shogi_Table_Size / 100);
-	int del_sum=0,age_minus = 4;
-	for (;age_minus>=0;age_minus--) {
-		for (i=0;i<Hash_Shogi_Table_Size;i++) {
-			HASH_SHOGI *pt = &hash_shogi_table[i];
-			int del = 0;
-			if ( pt->deleted == 0 && hashcode64 == pt->hashcode64 && hash64pos == pt->hash64pos ) {
-				PRT("root node, del hash\n");
-				del = 1;
-			}
-			if ( pt->deleted == 0 && (pt->age <= thinking_age - age_minus || pt->games_sum < del_games) ) {
-				del = 1;
-			}
-			if ( del ) {
-				memset(pt,0,sizeof(HASH_SHOGI));
-				pt->deleted = 1;
-				hash_shogi_use--;
-				del_sum++;
+	UCT_GAME *pg = &uct_game[game];
+	int n = pg->own_node_num;
+	int keep = 0;
+	for (int i=0; i<n; i++) {
+		HASH_SHOGI *pt = &hash_shogi_table[pg->own_node[i]];
+		Lock(pt->entry_lock);
+		if ( pt->deleted == 0 && pt->game == game ) {
+			if ( pt->age.load(std::memory_order_relaxed) < pg->thinking_age - 1 ) {
+				child_arena_free(pt->child, pt->child_num);
+				pt->child     = NULL;
+				pt->child_num = 0;
+				pt->pending   = 0;
+				pt->deleted   = 1;
+			} else {
+				pg->own_node[keep++] = pg->own_node[i];
 			}
-//			if ( hash_go_use < limit_use ) break;	// いきなり10分予測読みして埋めてしまっても全部消さないように --> 前半ばっかり消して再ハッシュでエラーになる。
 		}
-		double occupy = hash_shogi_use*100.0/Hash_Shogi_Table_Size;
-		PRT("hash del=%d,age=%d,minus=%d, %.0f%%(%d/%d)\n",del_sum,thinking_age,age_minus,occupy,hash_shogi_use,Hash_Shogi_Table_Size);
-		if ( hash_shogi_use < limit_use ) break;
-		if ( age_minus==0 ) { PRT("age_minus=0\n"); debug(); }
+		UnLock(pt->entry_lock);
+	}
+	pg->own_node_num        = keep;
+	pg->hash_shogi_use_prev = keep;
+	pg->hash_shogi_use      = 0;
+}
+
+// 前回の探索で触った局面は残す(次の手の部分木は再利用される)。それより古い局面は、この対局の手番で削除する
+// ageは対局ごと。表を全部消すのは最初に確保する時だけ
+void hash_shogi_next_age(int game)
+{
+	UCT_GAME *pg = &uct_game[game];
+	if ( hash_shogi_table == NULL ) {
+		pg->thinking_age = 1;
+		hash_shogi_table_clear();
+		return;
+	}
+	int age_step = fClearHashAlways ? 2 : 1;	// 2つ進めると全局面が古い扱いになる
+	pg->thinking_age = (pg->thinking_age + age_step) & 0x7ffffff;
+	hash_shogi_reclaim(game);
+}
+
+// 新しい対局。前の対局の局面は次の探索で全部古い扱いになるように、ageだけ進めておく
+// game が負なら全部の対局
+void usi_newgame(int game)
+{
+	for (int g=0; g<nUctGames; g++) {
+		if ( game >= 0 && g != game ) continue;
+		UCT_GAME *pg = &uct_game[g];
+		if ( pg->search.joinable() ) pg->search.join();
+		pg->thinking_age = (pg->thinking_age + 1) & 0x7ffffff;
 	}
 }
 
 void free_hash_shogi_table()
 {
 	if ( hash_shogi_table != NULL ) {
-		free(hash_shogi_table);
+		delete[] hash_shogi_table;
 		hash_shogi_table = NULL;
 	}
+	if ( child_arena != NULL ) {
+		delete[] child_arena;
+		child_arena = NULL;
+	}
 }
 
 HASH_SHOGI* HashShogiReadLock(tree_t * restrict ptree, int sideToMove)
@@ -486,9 +771,12 @@ research_empty_block:
 
 	uint64 hash64pos  = get_marge_hash(ptree, sideToMove);
 	uint64 hashcode64 = ptree->sequence_hash;
+	UCT_GAME *pg = get_uct_game(ptree);
+	const int game = (int)(pg - uct_game);
 //	PRT("ReadLock hash=%016" PRIx64 "\n",hashcode64);
 
-	n = (int)hashcode64 & Hash_Shogi_Mask;
+	n = (int)((unsigned int)hashcode64 + (unsigned int)game * 0x9e3779b1U) & Hash_Shogi_Mask;	// 同じ手順の別の対局は別の場所から
+
 	first_n = n;
 
 	HASH_SHOGI *pt_base = hash_shogi_table;
@@ -498,7 +786,12 @@ research_empty_block:
 		HASH_SHOGI *pt = &pt_base[n];
 		Lock(pt->entry_lock);		// Lockをかけっぱなしにするように
 		if ( pt->deleted == 0 ) {
-			if ( hashcode64 == pt->hashcode64 && hash64pos == pt->hash64pos ) {
+			if ( hashcode64 == pt->hashcode64 && hash64pos == pt->hash64pos && game == pt->game ) {
+				if ( pt->age.load(std::memory_order_relaxed) != pg->thinking_age ) {	// 前回の探索の局面を今回も使う
+					pt->age.store(pg->thinking_age, std::memory_order_relaxed);
+					pg->hash_shogi_use_prev--;
+					pg->hash_shogi_use++;
+				}
 				return pt;
 			}
 		} else {
@@ -522,19 +815,18 @@ research_empty_block:
 	}
 	int sum = 0;
 	for (int i=0;i<Hash_Shogi_Table_Size;i++) { sum = hash_shogi_table[i].deleted; PRT("%d",hash_shogi_table[i].deleted); }
-	PRT("\nno child hash Err loop=%d,hash_shogi_use=%d,first_n=%d,del_sum=%d(%.1f%%)\n",loop,hash_shogi_use,first_n,sum, 100.0*sum/Hash_Shogi_Table_Size); debug(); return NULL;
+	PRT("\nno child hash Err loop=%d,hash_shogi_use=%d,first_n=%d,del_sum=%d(%.1f%%)\n",loop,(int)pg->hash_shogi_use,first_n,sum, 100.0*sum/Hash_Shogi_Table_Size); debug(); return NULL;
 }
 
-char *prt_pv_from_hash(tree_t * restrict ptree, int ply, int sideToMove)
+// 読み筋を呼び出し側の str (長さ len) に追加する。探索スレッドと共有しないため static にはしない
+void prt_pv_from_hash(tree_t * restrict ptree, int ply, int sideToMove, char *str, int len)
 {
-	static char str[TMP_BUF_LEN];
-	if ( ply==1 ) str[0] = 0;
 	HASH_SHOGI *phg = HashShogiReadLock(ptree, sideToMove);
 	UnLock(phg->entry_lock);
-	if ( phg->deleted ) return str;
+	if ( phg->deleted ) return;
 //	if ( phg->hashcode64 != get_marge_hash(ptree, sideToMove) ) return str;
-	if ( phg->hashcode64 != ptree->sequence_hash || phg->hash64pos != get_marge_hash(ptree, sideToMove) ) return str;
-	if ( ply > 30 ) return str;
+	if ( phg->hashcode64 != ptree->sequence_hash || phg->hash64pos != get_marge_hash(ptree, sideToMove) ) return;
+	if ( ply > 30 ) return;
 
 	int max_i = -1;
 	int max_games = 0;
@@ -549,49 +841,94 @@ char *prt_pv_from_hash(tree_t * restrict ptree, int ply, int sideToMove)
 	if ( max_i >= 0 ) {
 		CHILD *pc = &phg->child[max_i];
 		MakeMove( sideToMove, pc->move, ply );
-		if ( ply > 0 ) strcat(str," ");
-		strcat(str,str_CSA_move(pc->move));
+		int n = strlen(str);
+		if ( n < len ) snprintf(str+n, len-n, "%s%s", (ply > 0) ? " " : "", str_CSA_move(pc->move));
 		
 //		print_teban(ply+tesuu+1);
 //		print_te_no_space(pc->move);
-		prt_pv_from_hash(ptree, ply+1, Flip(sideToMove));
+		prt_pv_from_hash(ptree, ply+1, Flip(sideToMove), str, len);
 		UnMakeMove( sideToMove, pc->move, ply );
 	}
-	return str;
 }
 
-int uct_search_start(tree_t * restrict ptree, int sideToMove, int ply, char *buf_move_count)
+// 各スレッドで合計 UCT_LOOP_FIX 回になるまで探索
+void uct_search_loop(tree_t * restrict ptree, int sideToMove, int ply)
 {
-	if ( fClearHashAlways ) {
-		hash_shogi_table_clear();
-	} else {
-		thinking_age = (thinking_age + 1) & 0x7ffffff;
-		if ( thinking_age == 0 ) thinking_age = 1;
-		if ( thinking_age == 1 ) {
-			hash_shogi_table_clear();
-		} else {
-			hash_half_del(ptree, sideToMove);
+	UCT_THREAD *pth = &uct_thread[ptree->thread_id];
+	UCT_GAME *pg = get_uct_game(ptree);
+	pth->pending_num     = 0;
+	pth->sum_reached_ply = 0;
+	pth->loop_count      = 0;
+	for (;;) {
+		if ( pg->stop ) break;
+		if ( IsHashFull(ptree) ) {	// 子を予約してから探索する
+			pg->stop = 1;
+			break;
+		}
+		if ( pg->playouts++ >= UCT_LOOP_FIX ) break;
+		pth->reached_ply = 0;
+		double ret = uct_tree(ptree, sideToMove, ply);
+		if ( ret == UCT_COLLISION ) {	// 評価待ちの局面に当たった。先に評価してやり直す
+			pg->playouts--;
+			if ( pth->pending_num == 0 ) std::this_thread::yield();	// 他スレッドの評価待ち
+			flush_pending_leaves(ptree);
+			continue;
 		}
+		if ( pth->pending_num >= nLeafBatch ) flush_pending_leaves(ptree);
+		pth->sum_reached_ply += pth->reached_ply;
+		pth->loop_count++;
+//		if ( IsNegaMaxTimeOver() ) break;
+//		if ( is_main_thread() ) PassWindowsSystem();	// GUIスレッド以外に渡すと中断が利かない場合あり
 	}
-	
+	flush_pending_leaves(ptree);
+	child_arena_release(pth);
+}
+
+int uct_search_start(tree_t * restrict ptree, int sideToMove, int ply, char *buf_move_count)
+{
+	UCT_GAME *pg = get_uct_game(ptree);
+	const int thread_base = (int)(pg - uct_game) * nUctThread;	// ptree->thread_id はこの対局の最初のスレッド
+
 	HASH_SHOGI *phg = HashShogiReadLock(ptree, sideToMove);
-	create_node(ptree, sideToMove, ply, phg);
+	if ( phg->deleted ) {
+		create_node(ptree, sideToMove, ply, phg);
+	} else if ( fAddNoise && phg->noise == 0 ) {
+		add_dirichlet_noise(DIRICHLET_EPSILON, DIRICHLET_ALPHA, phg);	// 前回は子局面だったのでノイズがない
+		phg->noise = 1;
+	}
 	UnLock(phg->entry_lock);
-	PRT("root phg->hash=%" PRIx64 ", child_num=%d\n",phg->hashcode64,phg->child_num);
+	PRT("root phg->hash=%" PRIx64 ", child_num=%d,games_sum=%d\n",phg->hashcode64,phg->child_num,(int)phg->games_sum);
 
 	int ct1 = get_clock();
-	int uct_count = UCT_LOOP_FIX;
+	pg->playouts = 0;	// -p は今回の探索回数。再利用した部分木の探索回数は含めない
+	pg->stop     = 0;
+	std::vector<std::thread> threads;
+	int i;
+	for (i=0; i<nUctThread; i++) {
+		UCT_THREAD *pth = &uct_thread[thread_base + i];
+		if ( nLeafBatch > 1 && (int)pth->pending_leaf.size() != nLeafBatch ) {
+			pth->pending_leaf.resize(nLeafBatch);
+			pth->pending_input.resize(nLeafBatch);
+		}
+		if ( i==0 ) {
+			pth->ptree = ptree;
+			continue;
+		}
+		if ( pth->ptree == NULL ) pth->ptree = (tree_t*)malloc( sizeof(tree_t) );
+		if ( pth->ptree == NULL ) { PRT("Fail malloc tree_t\n"); debug(); }
+		memcpy(pth->ptree, ptree, sizeof(tree_t));
+		pth->ptree->move_last[0] = pth->ptree->amove;	// 自分の配列を指すように
+		pth->ptree->thread_id    = thread_base + i;
+		threads.emplace_back(uct_search_loop, pth->ptree, sideToMove, ply);
+	}
+	uct_search_loop(ptree, sideToMove, ply);
+	for (auto &t : threads) t.join();
+
 	int sum_reached_ply = 0;
 	int loop_count = 0;
-	int loop;
-	for (loop=0; loop<uct_count; loop++) {
-		reached_ply = 0;
-		uct_tree(ptree, sideToMove, ply);
-		sum_reached_ply += reached_ply;
-		loop_count++;
-//		if ( IsNegaMaxTimeOver() ) break;
-//		if ( is_main_thread() ) PassWindowsSystem();	// GUIスレッド以外に渡すと中断が利かない場合あり
-		if ( IsHashFull() ) break;
+	for (i=0; i<nUctThread; i++) {
+		sum_reached_ply += uct_thread[thread_base + i].sum_reached_ply;
+		loop_count      += uct_thread[thread_base + i].loop_count;
 	}
 	if ( loop_count == 0 ) loop_count = 1;
 	double ave_reached_ply = (double)sum_reached_ply / loop_count;
@@ -608,7 +945,6 @@ int uct_search_start(tree_t * restrict ptree, int sideToMove, int ply, char *buf
 	int sort_n = 0;
 	int select_count = 0;
 
-	int i;
 	for (i=0;i<phg->child_num;i++) {
 		CHILD *pc = &phg->child[i];
 		if ( pc->games > max_games ) {
@@ -617,7 +953,7 @@ int uct_search_start(tree_t * restrict ptree, int sideToMove, int ply, char *buf
 		}
 		sum_games += pc->games;
 		if ( pc->games ) {
-			PRT("%3d(%3d):%8s,%3d,%6.3f,bias=%6.3f\n",i,select_count++,str_CSA_move(pc->move),pc->games,pc->value,pc->bias);
+			PRT("%3d(%3d):%8s,%3d,%6.3f,bias=%6.3f\n",i,select_count++,str_CSA_move(pc->move),(int)pc->games,(float)pc->value,pc->bias);
 			if ( sort_n < SORT_MAX ) {
 				sort[sort_n][0] = pc->games;
 				sort[sort_n][1] = pc->move;
@@ -629,9 +965,21 @@ int uct_search_start(tree_t * restrict ptree, int sideToMove, int ply, char *buf
 		CHILD *pc = &phg->child[max_i];
 		best_move = pc->move;
 		double v = 100.0 * (pc->value + 1.0) / 2.0;
-		PRT("best:%s,%3d,%6.2f%%(%6.3f),bias=%6.3f\n",str_CSA_move(pc->move),pc->games,v,pc->value,pc->bias);
+		PRT("best:%s,%3d,%6.2f%%(%6.3f),bias=%6.3f\n",str_CSA_move(pc->move),(int)pc->games,v,(float)pc->value,pc->bias);
 
-		char *pv_str = prt_pv_from_hash(ptree, ply, sideToMove); PRT("%s\n",pv_str);
+		char pv_str[TMP_BUF_LEN] = "";
+		prt_pv_from_hash(ptree, ply, sideToMove, pv_str, TMP_BUF_LEN); PRT("%s\n",pv_str);
+	}
+	if ( max_i < 0 ) {	// 1回も探索できなかった。合法手があるなら投了はせずに policy が最大の手を選ぶ
+		float max_bias = -1;
+		for (i=0;i<phg->child_num;i++) {
+			CHILD *pc = &phg->child[i];
+			if ( pc->value == ILLEGAL_MOVE || pc->bias <= max_bias ) continue;
+			max_bias  = pc->bias;
+			best_move = pc->move;
+		}
+		if ( phg->deleted && generate_all_move( ptree, sideToMove, ply ) > 0 ) best_move = ptree->move_last[0][0];	// 探索開始局面も作れなかった
+		if ( best_move ) PRT("no visit. select:%s,bias=%6.3f\n",str_CSA_move(best_move),max_bias);
 	}
 
 	for (i=0; i<sort_n-1; i++) {
@@ -678,10 +1026,11 @@ int uct_search_start(tree_t * restrict ptree, int sideToMove, int ply, char *buf
 		}
 		if ( i==phg->child_num ) DEBUG_PRT("not found\n");
 		best_move = pc->move;
-		PRT("rand select:%s,%3d,%6.3f,bias=%6.3f,r=%d\n",str_CSA_move(pc->move),pc->games,pc->value,pc->bias,r);
+		PRT("rand select:%s,%3d,%6.3f,bias=%6.3f,r=%d\n",str_CSA_move(pc->move),(int)pc->games,(float)pc->value,pc->bias,r);
 	}
-	PRT("%.2f sec, child=%d,net_v=%.3f,create=%d,loop=%d,%.0f/s,ave_ply=%.1f (%d/%d),fAddNoise=%d\n",
-		ct,phg->child_num,phg->net_value,hash_shogi_use,loop,(double)loop/ct,ave_reached_ply,ptree->nrep,nVisitCount,fAddNoise );
+	PRT("%.2f sec, child=%d,net_v=%.3f,create=%d,loop=%d,%.0f/s,ave_ply=%.1f (%d/%d),fAddNoise=%d,thread=%d\n",
+		ct,phg->child_num,phg->net_value,(int)pg->hash_shogi_use,loop_count,(double)loop_count/ct,ave_reached_ply,ptree->nrep,nVisitCount,fAddNoise,nUctThread );
+	if ( ! NOT_USE_NN ) GTP::s_network->nncache_dump_stats();
 
 	return best_move;
 }
@@ -689,11 +1038,18 @@ int uct_search_start(tree_t * restrict ptree, int sideToMove, int ply, char *buf
 void create_node(tree_t * restrict ptree, int sideToMove, int ply, HASH_SHOGI *phg)
 {
 	if ( phg->deleted == 0 ) {
-		PRT("already created? ply=%d,sideToMove=%d,games_sum=%d,child_num=%d, ",ply,sideToMove,phg->games_sum,phg->child_num); print_path();
+		PRT("already created? ply=%d,sideToMove=%d,games_sum=%d,child_num=%d, ",ply,sideToMove,(int)phg->games_sum,phg->child_num); print_path();
 		return;
 	}
 
 	int move_num = generate_all_move( ptree, sideToMove, ply );
+	UCT_GAME *pg = get_uct_game(ptree);
+	CHILD *child = child_arena_alloc(ptree, move_num);
+	if ( move_num > 0 && child == NULL ) {	// 子が取れない。局面は削除済みのままで探索を止める
+		pg->stop = 1;
+		return;
+	}
+	phg->child = child;
 
 	unsigned int * restrict pmove = ptree->move_last[0];
 	int i;
@@ -741,44 +1097,158 @@ void create_node(tree_t * restrict ptree, int sideToMove, int ply, HASH_SHOGI *p
 		if ( sideToMove==BLACK ) v = -v;
 //		{ static double va[2]; static int count[2]; va[sideToMove] += v; count[sideToMove]++; PRT("va[]=%10f,%10f\n",va[0]/(count[0]+1),va[1]/(count[1]+1)); }
 //		PRT("f=%10f,tanh()=%10f\n",f,v);
+	} else if ( nLeafBatch > 1 && ply > 1 ) {
+		add_pending_leaf(ptree, sideToMove, ply, phg);	// net_value, biasは後で
 	} else {
 		v = get_network_policy_value(ptree, sideToMove, ply, phg);
 	}
 	if ( sideToMove==BLACK ) v = -v;
 
-	const float epsilon = 0.25;	// epsilon = 0.25
-	const float alpha   = 0.15;	// alpha ... Chess = 0.3, Shogi = 0.15, Go = 0.03
-	if ( fAddNoise && ply==1 ) add_dirichlet_noise(epsilon, alpha, phg);
+	phg->noise = 0;
+	if ( fAddNoise && ply==1 ) {
+		add_dirichlet_noise(DIRICHLET_EPSILON, DIRICHLET_ALPHA, phg);
+		phg->noise = 1;
+	}
 //{ void test_dirichlet_noise(float epsilon, float alpha);  test_dirichlet_noise(0.25f, 0.03f); }
 
 	phg->hashcode64     = ptree->sequence_hash;
 	phg->hash64pos      = get_marge_hash(ptree, sideToMove);
 	phg->games_sum      = 0;	// この局面に来た回数(子局面の回数の合計)
 	phg->col            = sideToMove;
-	phg->age            = thinking_age;
+	phg->game           = (int)(pg - uct_game);
+	phg->age.store(pg->thinking_age, std::memory_order_relaxed);
 	phg->net_value      = v;
 	phg->deleted        = 0;
 
 //	PRT("create_node(),"); prt64(phg->hashcode64); PRT("\n"); print_path(); 
-	hash_shogi_use++;
+	pg->hash_shogi_use++;
+	pg->own_node[pg->own_node_num++] = (int)(phg - hash_shogi_table);
+}
+
+void add_pending_leaf(tree_t * restrict ptree, int sideToMove, int ply, HASH_SHOGI *phg)
+{
+	UCT_THREAD *pth = &uct_thread[ptree->thread_id];
+	if ( pth->pending_num >= nLeafBatch ) DEBUG_PRT("pending_num=%d Err\n",pth->pending_num);
+	set_dcnn_channels_sparse(ptree, sideToMove, ply, &pth->pending_input[pth->pending_num]);
+
+	PENDING_LEAF *pl = &pth->pending_leaf[pth->pending_num++];
+	pl->phg        = phg;
+	pl->sideToMove = sideToMove;
+	pl->ply        = ply;
+	pl->path_num   = ply - 1;
+	int i;
+	for (i=1; i<ply; i++) {
+		pl->path_phg[i]    = pth->path_phg[i];
+		pl->path_select[i] = pth->path_select[i];
+	}
+	phg->pending = 1;
+}
+
+// games, value はロックせずに atomic に更新する。value は compare_exchange で平均を取り直す
+// games と value の組は一致しない瞬間がある(数回分ずれるだけで、UCTには影響しない)。意図してロックしていない
+void add_virtual_loss(HASH_SHOGI *phg, CHILD *pc)
+{
+	// この手が負けた、とする。評価待ちや他スレッドの探索中に、なるべく別の手を探索するように
+	const int one_win = -1;	// 最初は負け、を仮定
+	int games = pc->games.fetch_add(VL_N);
+	phg->games_sum += VL_N;	// 末端のノードで減らしても意味がない、のでUCTの木だけで減らす
+	float v = pc->value;
+	for (;;) {
+		if ( v == ILLEGAL_MOVE ) break;
+		float new_v = (float)(((double)games * v + one_win*VL_N) / (games + VL_N));	// games==0 の時はpc->value は無視されるので問題なし
+		if ( pc->value.compare_exchange_weak(v, new_v) ) break;
+	}
+}
+
+void remove_virtual_loss(HASH_SHOGI *phg, CHILD *pc)
+{
+	const int one_win = -1;
+	phg->games_sum -= VL_N;
+	int games = pc->games.fetch_sub(VL_N) - VL_N;		// gamesを減らすのは非常に危険！ あちこちで games==0 で判定してるので
+	if ( games < 0 ) { PRT("Err pc->games=%d\n",games); debug(); }
+	float v = pc->value;
+	for (;;) {
+		if ( v == ILLEGAL_MOVE ) break;
+		float new_v = 0;
+		if ( games > 0 ) new_v = (float)((((double)games+VL_N) * v - one_win*VL_N) / games);
+		if ( pc->value.compare_exchange_weak(v, new_v) ) break;
+	}
+}
+
+void update_child_value(HASH_SHOGI *phg, CHILD *pc, double win)
+{
+	float v = pc->value;
+	for (;;) {
+		if ( v == ILLEGAL_MOVE ) break;
+		int games = pc->games;
+		float new_v = (float)(((double)games * v + win) / (games + 1));	// 単純平均
+		if ( pc->value.compare_exchange_weak(v, new_v) ) break;
+	}
+	pc->games++;			// この手を探索した回数
+	phg->games_sum++;
+	phg->age.store(uct_game[phg->game].thinking_age, std::memory_order_relaxed);	// entry_lock なし。同じ値を書くだけなので順序は要らない
+}
+
+// 評価待ちの末端局面をまとめて評価して、経路を遡ってvirtual lossを戻しながら勝率を反映
+void flush_pending_leaves(tree_t * restrict ptree)
+{
+	UCT_THREAD *pth = &uct_thread[ptree->thread_id];
+	if ( pth->pending_num == 0 ) return;
+	get_network_policy_value_batch(pth->pending_num, pth->pending_input.data(), pth->pending_leaf.data());
+
+	int i;
+	for (i=0; i<pth->pending_num; i++) {
+		PENDING_LEAF *pl = &pth->pending_leaf[i];
+		HASH_SHOGI *phg = pl->phg;
+		Lock(phg->entry_lock);
+		float v = pl->value;
+		if ( pl->sideToMove==BLACK ) v = -v;
+		phg->net_value = v;
+		phg->pending   = 0;
+		UnLock(phg->entry_lock);
+
+		double win = -v;
+		int p;
+		for (p=pl->path_num; p>=1; p--) {
+			HASH_SHOGI *pp = pl->path_phg[p];
+			CHILD *pc = &pp->child[pl->path_select[p]];
+			remove_virtual_loss(pp, pc);
+			update_child_value(pp, pc, win);
+			win = -win;
+		}
+	}
+	pth->pending_num = 0;
 }
 
 double uct_tree(tree_t * restrict ptree, int sideToMove, int ply)
 {
+	UCT_THREAD *pth = &uct_thread[ptree->thread_id];
 	int create_new_node_limit = 1;
 
-	reached_ply = ply;
-	HASH_SHOGI *phg = HashShogiReadLock(ptree, sideToMove);	// phgに触る場合は必ずロック！
+	pth->reached_ply = ply;
+	HASH_SHOGI *phg = HashShogiReadLock(ptree, sideToMove);	// 局面の作成はロックして
 
 	if ( phg->deleted ) {
 		PRT("not created? ply=%2d,col=%d\n",ply,sideToMove);
 		if ( fClearHashAlways ) { PRT("not created Err\n"); debug(); }
 		create_node(ptree, sideToMove, ply, phg);
+		if ( phg->deleted ) {	// 子が取れずに作れなかった
+			UnLock(phg->entry_lock);
+			return UCT_COLLISION;
+		}
+		if ( phg->pending ) {
+			UnLock(phg->entry_lock);
+			return UCT_PENDING;
+		}
+	} else if ( phg->pending ) {
+		UnLock(phg->entry_lock);
+		return UCT_COLLISION;
 	}
 
-	if ( phg->col != sideToMove ) { PRT("hash col Err. phg->col=%d,col=%d,age=%d(%d),ply=%d,nrep=%d,child_num=%d,games_sum=%d,sort=%d,phg->hash=%" PRIx64 "\n",phg->col,sideToMove,phg->age,thinking_age,ply,ptree->nrep,phg->child_num,phg->games_sum,phg->sort_done,phg->hashcode64); debug(); }
+	if ( phg->col != sideToMove ) { PRT("hash col Err. phg->col=%d,col=%d,age=%d(%d),ply=%d,nrep=%d,child_num=%d,games_sum=%d,sort=%d,phg->hash=%" PRIx64 "\n",phg->col,sideToMove,phg->age.load(std::memory_order_relaxed),get_uct_game(ptree)->thinking_age,ply,ptree->nrep,phg->child_num,(int)phg->games_sum,phg->sort_done,phg->hashcode64); debug(); }
 
 	int child_num = phg->child_num;
+	UnLock(phg->entry_lock);	// games, value は atomic に更新するので、手の選択はロックせずに
 
 	int select = -1;
 	int loop;
@@ -805,7 +1275,6 @@ select_again:
 		float v = -1;
 		if ( sideToMove==BLACK ) v = -1;
 		PRT("no legal move. mate? ply=%d,child_num=%d,v=%.0f\n",ply,child_num,v);
-		UnLock(phg->entry_lock);
 		return v;
 	}
 
@@ -834,7 +1303,7 @@ select_again:
 	int flag_illegal_move = 0;
 	
 	if ( InCheck(sideToMove) ) {
-		PRT("escape check err. %2d:%8s(%2d/%3d):selt=%3d,v=%.3f\n",ply,str_CSA_move(pc->move),pc->games,phg->games_sum,select,max_value);
+		PRT("escape check err. %2d:%8s(%2d/%3d):selt=%3d,v=%.3f\n",ply,str_CSA_move(pc->move),(int)pc->games,(int)phg->games_sum,select,max_value);
 		flag_illegal_move = 1;
 		debug();
 	}
@@ -934,55 +1403,47 @@ select_again:
 	if ( pc->games < create_new_node_limit || ply >= PLY_MAX-11 ) {
 		do_playout = 1;
 	}
-	if ( skip_search ) {
-	} else if ( do_playout ) {	// evaluate this position
-		UnLock(phg->entry_lock);
+	pth->path_phg[ply]    = phg;
+	pth->path_select[ply] = select;
 
-		HASH_SHOGI *phg2 = HashShogiReadLock(ptree, Flip(sideToMove));	// 1手進めた局面のデータ
-		if ( phg2->deleted ) {
-			create_node(ptree, Flip(sideToMove), ply+1, phg2);
+	if ( skip_search ) {
+	} else {
+		const int fVirtualLoss = (nLeafBatch > 1 || nUctThread > 1);
+		if ( fVirtualLoss ) add_virtual_loss(phg, pc);
+
+		double ret = 0;
+		if ( do_playout ) {	// evaluate this position
+			HASH_SHOGI *phg2 = HashShogiReadLock(ptree, Flip(sideToMove));	// 1手進めた局面のデータ
+			if ( phg2->deleted ) {
+				create_node(ptree, Flip(sideToMove), ply+1, phg2);
+				ret = phg2->deleted ? UCT_COLLISION : phg2->pending ? UCT_PENDING : phg2->net_value;
+			} else if ( phg2->pending ) {
+				ret = UCT_COLLISION;
+			} else {
+//				PRT("has come already?\n"); //debug();	// 手順前後?
+				ret = phg2->net_value;
+			}
+			UnLock(phg2->entry_lock);
 		} else {
-//			PRT("has come already?\n"); //debug();	// 手順前後?
+			// down tree
+			ret = uct_tree(ptree, Flip(sideToMove), ply+1);
 		}
-		win = -phg2->net_value;
-		
-		UnLock(phg2->entry_lock);
-		Lock(phg->entry_lock);
 
-	} else {
-		// down tree
-		const int VL_N = 6;
-		const int fVirtualLoss = 0;
-		const int one_win = -1;	// 最初は負け、を仮定
-		if ( fVirtualLoss ) {	// この手が負けた、とする。複数スレッドの時に、なるべく別の手を探索するように
-			pc->value = (float)(((double)pc->games * pc->value + one_win*VL_N) / (pc->games + VL_N));	// games==0 の時はpc->value は無視されるので問題なし
-			pc->games      += VL_N;
-			phg->games_sum += VL_N;	// 末端のノードで減らしても意味がない、のでUCTの木だけで減らす
+		if ( ret == UCT_PENDING ) {	// virtual lossは評価後に戻す
+			UnMakeMove( sideToMove, pc->move, ply );
+			return ret;
 		}
-
-		UnLock(phg->entry_lock);
-		win = -uct_tree(ptree, Flip(sideToMove), ply+1);
-		Lock(phg->entry_lock);
-
-		if ( fVirtualLoss ) {
-			phg->games_sum -= VL_N;
-			pc->games      -= VL_N;		// gamesを減らすのは非常に危険！ あちこちで games==0 で判定してるので
-			if ( pc->games < 0 ) { PRT("Err pc->games=%d\n",pc->games); debug(); }
-			if ( pc->games == 0 ) pc->value = 0;
-			else                  pc->value = (float)((((double)pc->games+VL_N) * pc->value - one_win*VL_N) / pc->games);
+		if ( fVirtualLoss ) remove_virtual_loss(phg, pc);
+		if ( ret == UCT_COLLISION ) {
+			UnMakeMove( sideToMove, pc->move, ply );
+			return ret;
 		}
+		win = -ret;
 	}
 
 	UnMakeMove( sideToMove, pc->move, ply );
 
-	double win_prob = ((double)pc->games * pc->value + win) / (pc->games + 1);	// 単純平均
-
-	pc->value = (float)win_prob;
-	pc->games++;			// この手を探索した回数
-	phg->games_sum++;
-	phg->age = thinking_age;
-
-	UnLock(phg->entry_lock);
+	update_child_value(phg, pc, win);
 	return win;
 }
 
@@ -1006,9 +1467,19 @@ void copy_min_posi(tree_t * restrict ptree, int sideToMove, int ply)
 	p->hand_black = HAND_B;
 	p->hand_white = HAND_W;
 	p->turn_to_move = sideToMove;
+	// 入力の駒の plane は着手ごとにここで一度だけ作る。末端で評価する時は8手分の一覧を並べるだけ
+	dcnn_piece_list_t *pl = &ptree->record_plus_ply_piece_list[ptree->nrep + ply];
+	pl->num = 0;
 	int i;
 	for (i=0;i<nsquare;i++) {
-		p->asquare[i] = ptree->posi.asquare[i];
+		int k = ptree->posi.asquare[i];
+		p->asquare[i] = k;
+		if ( k==0 ) continue;
+		int m = abs(k);
+		if ( m>=0x0e ) m--;	// m = 1...14
+		m--;
+		if ( k < 0 ) m += 14;
+		pl->plane_sq[pl->num++] = (unsigned short)(m*nsquare + i);
 	}
 }
 
@@ -1043,7 +1514,33 @@ void print_all_min_posi(tree_t * restrict ptree, int ply)
 	}
 }
 
-std::string keep_cmd_line;
+std::vector<std::string> keep_cmd_args;
+std::string keep_cmd_line;	// "id settings" で返して棋譜に残す。重みを読み直したら作り直す
+
+void make_keep_cmd_line()
+{
+	keep_cmd_line.clear();
+	for (size_t i=0;i<keep_cmd_args.size();i++) {
+		keep_cmd_line += keep_cmd_args[i];
+		if ( i < keep_cmd_args.size()-1 ) keep_cmd_line += " ";
+	}
+	for (size_t i=0;i<keep_cmd_line.size();i++) {
+		char c = keep_cmd_line.at(i);
+		if ( c < 0x20 || c > 0x7e ) c = '?';
+		keep_cmd_line[i] = c;
+	}
+	if ( keep_cmd_line.size() > 127 ) keep_cmd_line.resize(127);
+//	PRT("%s\n",keep_cmd_line.c_str());
+}
+
+// setoption WeightsFile で読み直した重みを -w の値にする
+void set_cmd_line_weights(const char *weights)
+{
+	for (size_t i=0;i+1<keep_cmd_args.size();i++) {
+		if ( keep_cmd_args[i] == "-w" ) keep_cmd_args[i+1] = weights;
+	}
+	make_keep_cmd_line();
+}
 
 int getCmdLineParam(int argc, char *argv[])
 {
@@ -1053,8 +1550,7 @@ int getCmdLineParam(int argc, char *argv[])
 		memset(sa,0,sizeof(sa));
 		strncpy(sa[0], argv[i],TMP_BUF_LEN-1);
 		if ( i+1 < argc ) strncpy(sa[1], argv[i+1],TMP_BUF_LEN-1);
-		keep_cmd_line += sa[0];
-		if ( i < argc-1 ) keep_cmd_line += " ";
+		keep_cmd_args.push_back(sa[0]);
 //		PRT("argv[%d]=%s\n",i,sa[0]);
 		char *p = sa[0];
 		char *q = sa[1];
@@ -1073,6 +1569,26 @@ int getCmdLineParam(int argc, char *argv[])
 			cfg_random_temp = nf;
 			continue;
 		}
+		if ( strstr(p,"-int8") ) {
+			PRT("use int8 CPU evaluation\n");
+			fUseInt8 = 1;
+			continue;
+		}
+		if ( strstr(p,"-save_bin") ) {
+			PRT("save binary weights to %s\n",q);
+			cfg_binary_weightsfile = q;	// -w で読んだ重みを変換して保存して終了
+			continue;
+		}
+		if ( strstr(p,"-nncache") ) {
+			PRT("nncache=%d\n",n);
+			nNNCacheCount = n;
+			continue;
+		}
+		if ( strstr(p,"-opening_cache") ) {
+			PRT("opening cache=%s\n",q);
+			default_opening_cache = q;
+			continue;
+		}
 		if ( strstr(p,"-time_sec") ) {
 //			PRT("sec=%d\n",n);
 //			NegaMaxTimeLimit = n;
@@ -1086,7 +1602,6 @@ int getCmdLineParam(int argc, char *argv[])
 		if ( strstr(p,"-p") ) {
 			PRT("playouts=%d\n",n);
 			UCT_LOOP_FIX = n;
-			set_Hash_Shogi_Table_Size(n);
 		}
 #ifdef USE_OPENCL
 		if ( strstr(p,"-u") ) {
@@ -1097,9 +1612,22 @@ int getCmdLineParam(int argc, char *argv[])
 			}
 		}
 #endif
+		if ( strstr(p,"-b") ) {
+			nLeafBatch = n;
+			if ( nLeafBatch < 1 ) nLeafBatch = 1;
+			PRT("leaf batch=%d\n",nLeafBatch);
+		}
 		if ( strstr(p,"-t") ) {
-//			PRT("mt=%d\n",n);
-//			aya_set_thread(n);
+			nUctThread = n;
+			if ( nUctThread < 1 ) nUctThread = 1;
+			if ( nUctThread > UCT_THREAD_MAX ) nUctThread = UCT_THREAD_MAX;
+			PRT("thread=%d\n",nUctThread);
+		}
+		if ( strstr(p,"-g") ) {
+			nUctGames = n;
+			if ( nUctGames < 1 ) nUctGames = 1;
+			if ( nUctGames > UCT_GAME_MAX ) nUctGames = UCT_GAME_MAX;
+			PRT("games=%d\n",nUctGames);
 		}
 		if ( strstr(p,"-w") ) {
 			PRT("network path=%s\n",q);
@@ -1119,13 +1647,12 @@ int getCmdLineParam(int argc, char *argv[])
 //		PRT("%s,%s\n",sa[0],sa[1]);
 	}
 
-	for (i=0;i<(int)keep_cmd_line.size();i++) {
-		char c = keep_cmd_line.at(i);
-		if ( c < 0x20 || c > 0x7e ) c = '?';
-		keep_cmd_line[i] = c;
+	make_keep_cmd_line();
+
+	if ( nUctGames > 1 ) {
+		if ( nUctThread * nUctGames > UCT_THREAD_MAX ) nUctThread = UCT_THREAD_MAX / nUctGames;
 	}
-	if ( keep_cmd_line.size() > 127 ) keep_cmd_line.resize(127);
-//	PRT("%s\n",keep_cmd_line.c_str());
+	set_Hash_Shogi_Table_Size(UCT_LOOP_FIX, nUctGames);	// 全対局の探索木が1つの表に入る
 
 	if ( default_weights.empty() ) {
 		PRT("A network weights file is required to use the program.\n");
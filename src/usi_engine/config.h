@@ -136,8 +136,9 @@ static constexpr auto MAX_CPUS = 256;
 // If OpenCL are fully usable, then check the OpenCL against CPU
 // implementation with some probability.
 #define USE_OPENCL_SELFCHECK
-static constexpr auto SELFCHECK_PROBABILITY = 2000;
 #endif
+// The INT8 CPU evaluation is checked against CPUPipe the same way.
+static constexpr auto SELFCHECK_PROBABILITY = 2000;
 
 #if (_MSC_VER >= 1400) /* VC8+ Disable all deprecation warnings */
     #pragma warning(disable : 4996)